@@ -21,6 +21,12 @@ if (tinyxml2_comp_static AND tinyxml2_comp_shared)
     return()
 endif ()
 
+# Configured from tinyxml2_THREADS when the library was built.
+if (@tinyxml2_THREADS@)
+    include(CMakeFindDependencyMacro)
+    find_dependency(Threads)
+endif ()
+
 set(tinyxml2_static_targets "${CMAKE_CURRENT_LIST_DIR}/tinyxml2-static-targets.cmake")
 set(tinyxml2_shared_targets "${CMAKE_CURRENT_LIST_DIR}/tinyxml2-shared-targets.cmake")
 
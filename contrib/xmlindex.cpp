@@ -0,0 +1,99 @@
+//  g++ -Wall -O2 contrib/xmlindex.cpp -o xmlindex -ltinyxml2
+
+//  A command line front end to tinyxml2::XMLIndex. It indexes a large XML
+//  file once, into a sidecar file beside it, and then prints one element
+//  of the file, read with XMLDocument::LoadSubtree(), without reading the
+//  rest of the file.
+//
+//      xmlindex build archive.xml [keyAttribute [pathDepth]]
+//      xmlindex get archive.xml "/archive/record[@id='42']"
+//
+//  The index is written to, and read from, "archive.xml.idx".
+
+/*
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+
+#include "../tinyxml2.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace tinyxml2;
+
+static int Usage()
+{
+    fprintf( stderr,
+             "usage: xmlindex build <file.xml> [keyAttribute [pathDepth]]\n"
+             "       xmlindex get <file.xml> <key>\n" );
+    return 2;
+}
+
+static int Fail( const char* what, XMLError error )
+{
+    fprintf( stderr, "xmlindex: %s: %s\n", what, XMLDocument::ErrorIDToName( error ) );
+    return 1;
+}
+
+int main( int argc, const char** argv )
+{
+    if ( argc < 3 ) {
+        return Usage();
+    }
+    const char* command = argv[1];
+    const char* filename = argv[2];
+    char indexName[4096];
+    if ( strlen( filename ) + 5 > sizeof( indexName ) ) {
+        return Usage();
+    }
+    strcpy( indexName, filename );
+    strcat( indexName, ".idx" );
+
+    XMLIndex index;
+    if ( strcmp( command, "build" ) == 0 && argc <= 5 ) {
+        const char* keyAttribute = argc > 3 ? argv[3] : "id";
+        const int pathDepth = argc > 4 ? atoi( argv[4] ) : 2;
+        XMLError error = index.Build( filename, keyAttribute, pathDepth );
+        if ( error != XML_SUCCESS ) {
+            return Fail( filename, error );
+        }
+        error = index.Save( indexName );
+        if ( error != XML_SUCCESS ) {
+            return Fail( indexName, error );
+        }
+        printf( "%u keys in %s\n", static_cast<unsigned>( index.KeyCount() ), indexName );
+        return 0;
+    }
+    if ( strcmp( command, "get" ) == 0 && argc == 4 ) {
+        XMLError error = index.Load( indexName );
+        if ( error != XML_SUCCESS ) {
+            return Fail( indexName, error );
+        }
+        XMLDocument doc;
+        error = doc.LoadSubtree( filename, index, argv[3] );
+        if ( error != XML_SUCCESS ) {
+            return Fail( argv[3], error );
+        }
+        doc.Print();
+        return 0;
+    }
+    return Usage();
+}
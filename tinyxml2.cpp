@@ -138,6 +138,77 @@ distribution.
 	#define TIXML_FTELL ftell
 #endif
 
+// Vector instructions used to scan text. SSE2 is part of the x86-64 baseline,
+// and NEON of AArch64, so no runtime dispatch is needed. The NEON code uses
+// A64 instructions, so 32-bit ARM uses the scalar code. Define
+// TINYXML2_NO_SIMD to use the scalar code everywhere.
+#if !defined(TINYXML2_NO_SIMD)
+	#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+		#include <emmintrin.h>
+		#define TIXML_SSE2
+	#elif defined(__aarch64__) || defined(_M_ARM64)
+		#include <arm_neon.h>
+		#define TIXML_NEON
+	#endif
+#endif
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#endif
+
+// The vector scanners read whole aligned blocks, which can extend past the
+// null terminator (but never into the next page.) Keep ASan and TSan from
+// flagging them.
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5)
+	#define TIXML_NO_SANITIZE __attribute__((no_sanitize_address, no_sanitize_thread))
+#else
+	#define TIXML_NO_SANITIZE
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+	#define TIXML_MMAP
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+	#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+		#define MAP_ANONYMOUS MAP_ANON
+	#endif
+#endif
+
+// File descriptors, for XMLDocument::LoadFileDescriptor().
+#if defined(_WIN32)
+	#define TIXML_FD_WIN32
+	#include <io.h>
+	#include <sys/types.h>
+	#include <sys/stat.h>
+#elif defined(__unix__) || defined(__APPLE__)
+	#define TIXML_FD_POSIX
+	#include <errno.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+// Threads for XMLDocument::SetParseThreads(). Define TINYXML2_NO_THREADS
+// to build without them; the parse is then always serial.
+#if !defined(TINYXML2_NO_THREADS)
+	#if defined(_WIN32)
+		#define TIXML_WIN32_THREADS
+		#ifndef WIN32_LEAN_AND_MEAN
+			#define WIN32_LEAN_AND_MEAN
+		#endif
+		#ifndef NOMINMAX
+			#define NOMINMAX
+		#endif
+		#include <windows.h>
+		#include <process.h>
+	#elif defined(__unix__) || defined(__APPLE__)
+		#define TIXML_PTHREADS
+		#include <pthread.h>
+		#include <unistd.h>
+	#endif
+#endif
+
 
 static const char LINE_FEED				= static_cast<char>(0x0a);			// all line endings are normalized to LF
 static const char LF = LINE_FEED;
@@ -173,6 +244,280 @@ static const Entity entities[NUM_ENTITIES] = {
 };
 
 
+static inline int CountBits( uint64_t v )
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll( v );
+#else
+    v = v - ( ( v >> 1 ) & 0x5555555555555555ULL );
+    v = ( v & 0x3333333333333333ULL ) + ( ( v >> 2 ) & 0x3333333333333333ULL );
+    v = ( v + ( v >> 4 ) ) & 0x0f0f0f0f0f0f0f0fULL;
+    return static_cast<int>( ( v * 0x0101010101010101ULL ) >> 56 );
+#endif
+}
+
+
+static inline int LowestBit( uint64_t v )
+{
+    TIXMLASSERT( v );
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll( v );
+#elif defined(_MSC_VER) && defined(_WIN64)
+    unsigned long index = 0;
+    _BitScanForward64( &index, v );
+    return static_cast<int>( index );
+#else
+    return CountBits( ( v & (0 - v) ) - 1 );
+#endif
+}
+
+
+// The size, and alignment, of the blocks FindCharOrEnd() reads.
+static const size_t SCAN_BLOCK = 16;
+
+/*
+	Returns the first occurrence of 'ch', or the null terminator, at or
+	after 'p'. The line feeds that are skipped over are added to 'newlines'.
+	This is the inner loop of text parsing, so it checks 16 bytes at a time
+	where vector instructions are available. With NOTE_SPECIAL, '*special'
+	is also set if a '&' or a CR is skipped over: without either, a string
+	needs no rewriting by StrPair::GetStr() (unless whitespace is collapsed.)
+*/
+template< bool NOTE_SPECIAL >
+TIXML_NO_SANITIZE
+static const char* ScanForChar( const char* p, char ch, int* newlines, bool* special )
+{
+    TIXMLASSERT( p );
+    TIXMLASSERT( newlines );
+    TIXMLASSERT( ch != 0 && ch != LF );
+    TIXMLASSERT( special || !NOTE_SPECIAL );
+#if defined(TIXML_SSE2) || defined(TIXML_NEON)
+    static const size_t BLOCK = SCAN_BLOCK;
+    // Scalar until aligned: an aligned block never crosses a page boundary,
+    // so reading past the terminator is safe.
+    while ( reinterpret_cast<uintptr_t>( p ) & ( BLOCK - 1 ) ) {
+        if ( *p == ch || *p == 0 ) {
+            return p;
+        }
+        if ( *p == LF ) {
+            ++(*newlines);
+        }
+        else if ( NOTE_SPECIAL && ( *p == '&' || *p == CR ) ) {
+            *special = true;
+        }
+        ++p;
+    }
+#if defined(TIXML_SSE2)
+    const __m128i vch = _mm_set1_epi8( ch );
+    const __m128i vlf = _mm_set1_epi8( LF );
+    const __m128i vzero = _mm_setzero_si128();
+    const __m128i vamp = _mm_set1_epi8( '&' );
+    const __m128i vcr = _mm_set1_epi8( CR );
+    __m128i seen = vzero;
+    for( ;; p += BLOCK ) {
+        const __m128i block = _mm_load_si128( reinterpret_cast<const __m128i*>( p ) );
+        const uint64_t stop = static_cast<unsigned>( _mm_movemask_epi8(
+            _mm_or_si128( _mm_cmpeq_epi8( block, vch ), _mm_cmpeq_epi8( block, vzero ) ) ) );
+        const uint64_t lf = static_cast<unsigned>( _mm_movemask_epi8( _mm_cmpeq_epi8( block, vlf ) ) );
+        const __m128i amp = NOTE_SPECIAL ? _mm_or_si128( _mm_cmpeq_epi8( block, vamp ), _mm_cmpeq_epi8( block, vcr ) ) : vzero;
+        if ( stop ) {
+            const int index = LowestBit( stop );
+            const uint64_t before = ( uint64_t(1) << index ) - 1;
+            *newlines += CountBits( lf & before );
+            if ( NOTE_SPECIAL && ( _mm_movemask_epi8( seen ) || ( _mm_movemask_epi8( amp ) & before ) ) ) {
+                *special = true;
+            }
+            return p + index;
+        }
+        *newlines += CountBits( lf );
+        if ( NOTE_SPECIAL ) {
+            seen = _mm_or_si128( seen, amp );
+        }
+    }
+#else
+    // NEON has no movemask; narrowing the comparison gives 4 bits per byte.
+    const uint8x16_t vch = vdupq_n_u8( static_cast<uint8_t>( ch ) );
+    const uint8x16_t vlf = vdupq_n_u8( static_cast<uint8_t>( LF ) );
+    const uint8x16_t vamp = vdupq_n_u8( static_cast<uint8_t>( '&' ) );
+    const uint8x16_t vcr = vdupq_n_u8( static_cast<uint8_t>( CR ) );
+    uint8x16_t seen = vdupq_n_u8( 0 );
+    for( ;; p += BLOCK ) {
+        const uint8x16_t block = vld1q_u8( reinterpret_cast<const uint8_t*>( p ) );
+        const uint8x16_t stopCmp = vorrq_u8( vceqq_u8( block, vch ), vceqzq_u8( block ) );
+        const uint8x16_t lfCmp = vceqq_u8( block, vlf );
+        const uint64_t stop = vget_lane_u64( vreinterpret_u64_u8( vshrn_n_u16( vreinterpretq_u16_u8( stopCmp ), 4 ) ), 0 );
+        const uint64_t lf = vget_lane_u64( vreinterpret_u64_u8( vshrn_n_u16( vreinterpretq_u16_u8( lfCmp ), 4 ) ), 0 );
+        const uint8x16_t amp = NOTE_SPECIAL ? vorrq_u8( vceqq_u8( block, vamp ), vceqq_u8( block, vcr ) ) : vdupq_n_u8( 0 );
+        if ( stop ) {
+            const int index = LowestBit( stop ) / 4;
+            const uint64_t before = ( uint64_t(1) << ( index * 4 ) ) - 1;
+            *newlines += CountBits( lf & before ) / 4;
+            if ( NOTE_SPECIAL ) {
+                const uint64_t bits = vget_lane_u64( vreinterpret_u64_u8( vshrn_n_u16( vreinterpretq_u16_u8( amp ), 4 ) ), 0 );
+                if ( vmaxvq_u8( seen ) || ( bits & before ) ) {
+                    *special = true;
+                }
+            }
+            return p + index;
+        }
+        *newlines += CountBits( lf ) / 4;
+        if ( NOTE_SPECIAL ) {
+            seen = vorrq_u8( seen, amp );
+        }
+    }
+#endif
+#else
+    while ( *p != ch && *p ) {
+        if ( *p == LF ) {
+            ++(*newlines);
+        }
+        else if ( NOTE_SPECIAL && ( *p == '&' || *p == CR ) ) {
+            *special = true;
+        }
+        ++p;
+    }
+    return p;
+#endif
+}
+
+
+static inline const char* FindCharOrEnd( const char* p, char ch, int* newlines )
+{
+    return ScanForChar< false >( p, ch, newlines, 0 );
+}
+
+
+static inline const char* FindCharOrEnd( const char* p, char ch, int* newlines, bool* special )
+{
+    return ScanForChar< true >( p, ch, newlines, special );
+}
+
+
+/*
+	Appends the offset of every line feed in 'base', up to the null
+	terminator, to 'lines'. Like ScanForChar(), it checks 16 bytes at a
+	time where vector instructions are available.
+*/
+TIXML_NO_SANITIZE
+static void IndexLines( const char* base, DynArray<size_t, 16>* lines )
+{
+    TIXMLASSERT( base );
+    TIXMLASSERT( lines );
+    const char* p = base;
+#if defined(TIXML_SSE2) || defined(TIXML_NEON)
+    static const size_t BLOCK = SCAN_BLOCK;
+    while ( reinterpret_cast<uintptr_t>( p ) & ( BLOCK - 1 ) ) {
+        if ( *p == 0 ) {
+            return;
+        }
+        if ( *p == LF ) {
+            lines->Push( static_cast<size_t>( p - base ) );
+        }
+        ++p;
+    }
+#if defined(TIXML_SSE2)
+    const __m128i vlf = _mm_set1_epi8( LF );
+    const __m128i vzero = _mm_setzero_si128();
+    for( ;; p += BLOCK ) {
+        const __m128i block = _mm_load_si128( reinterpret_cast<const __m128i*>( p ) );
+        const uint64_t end = static_cast<unsigned>( _mm_movemask_epi8( _mm_cmpeq_epi8( block, vzero ) ) );
+        uint64_t lf = static_cast<unsigned>( _mm_movemask_epi8( _mm_cmpeq_epi8( block, vlf ) ) );
+        if ( end ) {
+            lf &= ( uint64_t(1) << LowestBit( end ) ) - 1;
+        }
+        for( ; lf; lf &= lf - 1 ) {
+            lines->Push( static_cast<size_t>( p - base ) + LowestBit( lf ) );
+        }
+        if ( end ) {
+            return;
+        }
+    }
+#else
+    // One bit of the 4 that the narrowing gives each byte is enough.
+    const uint8x16_t vlf = vdupq_n_u8( static_cast<uint8_t>( LF ) );
+    const uint64_t ONE_PER_BYTE = 0x1111111111111111ULL;
+    for( ;; p += BLOCK ) {
+        const uint8x16_t block = vld1q_u8( reinterpret_cast<const uint8_t*>( p ) );
+        const uint64_t end = vget_lane_u64( vreinterpret_u64_u8( vshrn_n_u16( vreinterpretq_u16_u8( vceqzq_u8( block ) ), 4 ) ), 0 ) & ONE_PER_BYTE;
+        uint64_t lf = vget_lane_u64( vreinterpret_u64_u8( vshrn_n_u16( vreinterpretq_u16_u8( vceqq_u8( block, vlf ) ), 4 ) ), 0 ) & ONE_PER_BYTE;
+        if ( end ) {
+            lf &= ( uint64_t(1) << LowestBit( end ) ) - 1;
+        }
+        for( ; lf; lf &= lf - 1 ) {
+            lines->Push( static_cast<size_t>( p - base ) + LowestBit( lf ) / 4 );
+        }
+        if ( end ) {
+            return;
+        }
+    }
+#endif
+#else
+    for( ; *p; ++p ) {
+        if ( *p == LF ) {
+            lines->Push( static_cast<size_t>( p - base ) );
+        }
+    }
+#endif
+}
+
+
+/*
+	Returns the first character at or after 'p' that StrPair::GetStr() has
+	to look at: the null terminator, 'a', 'b' or 'c' (0 for none), or with
+	'spaces', any whitespace or other control character.
+*/
+TIXML_NO_SANITIZE
+static const char* FindSpecialOrEnd( const char* p, char a, char b, char c, bool spaces )
+{
+#if defined(TIXML_SSE2) || defined(TIXML_NEON)
+    static const size_t BLOCK = SCAN_BLOCK;
+    while ( reinterpret_cast<uintptr_t>( p ) & ( BLOCK - 1 ) ) {
+        if ( *p == 0 || *p == a || *p == b || *p == c || ( spaces && static_cast<unsigned char>( *p ) <= ' ' ) ) {
+            return p;
+        }
+        ++p;
+    }
+#if defined(TIXML_SSE2)
+    const __m128i va = _mm_set1_epi8( a );
+    const __m128i vb = _mm_set1_epi8( b );
+    const __m128i vc = _mm_set1_epi8( c );
+    // Bytes up to ' ' are those equal to their minimum with ' '. When
+    // spaces don't matter, that is just the null terminator.
+    const __m128i vspace = _mm_set1_epi8( spaces ? ' ' : 0 );
+    for( ;; p += BLOCK ) {
+        const __m128i block = _mm_load_si128( reinterpret_cast<const __m128i*>( p ) );
+        const __m128i hit = _mm_or_si128(
+            _mm_or_si128( _mm_cmpeq_epi8( block, va ), _mm_cmpeq_epi8( block, vb ) ),
+            _mm_or_si128( _mm_cmpeq_epi8( block, vc ), _mm_cmpeq_epi8( _mm_min_epu8( block, vspace ), block ) ) );
+        const unsigned stop = static_cast<unsigned>( _mm_movemask_epi8( hit ) );
+        if ( stop ) {
+            return p + LowestBit( stop );
+        }
+    }
+#else
+    const uint8x16_t va = vdupq_n_u8( static_cast<uint8_t>( a ) );
+    const uint8x16_t vb = vdupq_n_u8( static_cast<uint8_t>( b ) );
+    const uint8x16_t vc = vdupq_n_u8( static_cast<uint8_t>( c ) );
+    const uint8x16_t vspace = vdupq_n_u8( spaces ? ' ' : 0 );
+    for( ;; p += BLOCK ) {
+        const uint8x16_t block = vld1q_u8( reinterpret_cast<const uint8_t*>( p ) );
+        const uint8x16_t hit = vorrq_u8( vorrq_u8( vceqq_u8( block, va ), vceqq_u8( block, vb ) ),
+                                         vorrq_u8( vceqq_u8( block, vc ), vcleq_u8( block, vspace ) ) );
+        const uint64_t stop = vget_lane_u64( vreinterpret_u64_u8( vshrn_n_u16( vreinterpretq_u16_u8( hit ), 4 ) ), 0 );
+        if ( stop ) {
+            return p + LowestBit( stop ) / 4;
+        }
+    }
+#endif
+#else
+    while ( *p && *p != a && *p != b && *p != c && !( spaces && static_cast<unsigned char>( *p ) <= ' ' ) ) {
+        ++p;
+    }
+    return p;
+#endif
+}
+
+
 StrPair::~StrPair()
 {
     Reset();
@@ -204,30 +549,174 @@ void StrPair::TransferTo( StrPair* other )
 }
 
 
+// In front of a string from an XMLAllocator: where it came from, and
+// how big it is, so that Reset() can give it back.
+struct StrHeader
+{
+    XMLAllocator*   allocator;
+    size_t          size;
+};
+
+
 void StrPair::Reset()
 {
     if ( _flags & NEEDS_DELETE ) {
         delete [] _start;
     }
+    else if ( _flags & NEEDS_FREE ) {
+        StrHeader* header = reinterpret_cast<StrHeader*>( _start ) - 1;
+        header->allocator->Free( header, header->size );
+    }
     _flags = 0;
     _start = 0;
     _end = 0;
 }
 
 
-void StrPair::SetStr( const char* str, int flags )
+bool StrPair::SetStr( const char* str, int flags, XMLAllocator* allocator )
 {
     TIXMLASSERT( str );
-    Reset();
+    // Copy before the Reset(), which keeps the old string on failure,
+    // and allows 'str' to be the old string.
     size_t len = strlen( str );
-    TIXMLASSERT( _start == 0 );
-    _start = new char[ len+1 ];
-    memcpy( _start, str, len+1 );
+    char* copy = 0;
+    int copyFlags = 0;
+    if ( allocator ) {
+        const size_t size = sizeof( StrHeader ) + len + 1;
+        StrHeader* header = static_cast<StrHeader*>( allocator->Allocate( size ) );
+        if ( !header ) {
+            return false;
+        }
+        header->allocator = allocator;
+        header->size = size;
+        copy = reinterpret_cast<char*>( header + 1 );
+        copyFlags = flags | NEEDS_FREE;
+    }
+    else {
+        copy = new char[ len+1 ];
+        copyFlags = flags | NEEDS_DELETE;
+    }
+    memcpy( copy, str, len+1 );
+    Reset();
+    _start = copy;
     _end = _start + len;
-    _flags = flags | NEEDS_DELETE;
+    _flags = copyFlags;
+    return true;
+}
+
+
+size_t StrPair::NameLength() const
+{
+    // Unflushed names run to _end; anything else is null terminated.
+    if ( _flags & NEEDS_FLUSH ) {
+        return static_cast<size_t>( _end - _start );
+    }
+    return _start ? strlen( _start ) : 0;
+}
+
+
+bool StrPair::NameEqual( const StrPair& other ) const
+{
+    const size_t length = NameLength();
+    return length == other.NameLength() && ( length == 0 || memcmp( _start, other._start, length ) == 0 );
+}
+
+
+static unsigned HashName( const char* name, size_t length )
+{
+    // FNV-1a
+    unsigned hash = 2166136261u;
+    for( size_t i = 0; i < length; ++i ) {
+        hash = ( hash ^ static_cast<unsigned char>( name[i] ) ) * 16777619u;
+    }
+    return hash;
+}
+
+
+unsigned StrPair::NameHash() const
+{
+    return HashName( _start, NameLength() );
+}
+
+
+// Open-addressed hash tables of strings, with linear probing, a power of
+// 2 in size and no more than half full: the interned names, the names of
+// an XMLCompactDocument, and the keys of an XMLIndex. A slot holds a T;
+// SLOTS says which T is an empty slot, and which string a T stands for:
+//     static T Empty();
+//     const char* Key( T slot ) const;
+
+// Returns the slot holding 'key', or the empty slot where it would go.
+template< class T, class SLOTS >
+static size_t FindSlot( const T* table, size_t size, const char* key, size_t length, const SLOTS& slots )
+{
+    TIXMLASSERT( size > 0 && ( size & ( size - 1 ) ) == 0 );
+    const size_t mask = size - 1;
+    size_t at = HashName( key, length ) & mask;
+    for( ; table[at] != slots.Empty(); at = ( at + 1 ) & mask ) {
+        const char* str = slots.Key( table[at] );
+        if ( strncmp( str, key, length ) == 0 && str[length] == 0 ) {
+            break;
+        }
+    }
+    return at;
+}
+
+
+// Makes room for one more than the 'count' slots in use, by rebuilding
+// the table at twice the size when it would be more than half full.
+template< class T, size_t N, class SLOTS >
+static void GrowTable( DynArray<T, N>* table, size_t count, const SLOTS& slots, XMLAllocator* allocator = 0 )
+{
+    if ( ( count + 1 ) * 2 <= table->Size() ) {
+        return;
+    }
+    const size_t size = table->Empty() ? 64 : table->Size() * 2;
+    DynArray<T, N> old;
+    old.SetAllocator( allocator );
+    for( size_t i = 0; i < table->Size(); ++i ) {
+        if ( (*table)[i] != slots.Empty() ) {
+            old.Push( (*table)[i] );
+        }
+    }
+    table->Clear();
+    T* mem = table->PushArr( size );
+    for( size_t i = 0; i < size; ++i ) {
+        mem[i] = slots.Empty();
+    }
+    for( size_t i = 0; i < old.Size(); ++i ) {
+        const char* str = slots.Key( old[i] );
+        mem[FindSlot( mem, size, str, strlen( str ), slots )] = old[i];
+    }
 }
 
 
+// Slots that are the strings themselves.
+struct StringSlots
+{
+    static const char* Empty() {
+        return 0;
+    }
+    const char* Key( const char* slot ) const {
+        return slot;
+    }
+};
+
+
+// Slots that are offsets into a block of strings.
+struct OffsetSlots
+{
+    const char* strings;
+
+    static uint32_t Empty() {
+        return XMLCompactDocument::NONE;
+    }
+    const char* Key( uint32_t slot ) const {
+        return strings + slot;
+    }
+};
+
+
 char* StrPair::ParseText( char* p, const char* endTag, int strFlags, int* curLineNumPtr )
 {
     TIXMLASSERT( p );
@@ -237,19 +726,24 @@ char* StrPair::ParseText( char* p, const char* endTag, int strFlags, int* curLin
     char* start = p;
     const char  endChar = *endTag;
     size_t length = strlen( endTag );
+    bool special = false;
 
-    // Inner loop of text parsing.
-    while ( *p ) {
-        if ( *p == endChar && strncmp( p, endTag, length ) == 0 ) {
+    for( ;; ) {
+        p = const_cast<char*>( FindCharOrEnd( p, endChar, curLineNumPtr, &special ) );
+        if ( !*p ) {
+            return 0;
+        }
+        TIXMLASSERT( *p == endChar );
+        if ( strncmp( p, endTag, length ) == 0 ) {
+            if ( !special ) {
+                // No entities or CRs: GetStr() only has to terminate it.
+                strFlags &= ~( NEEDS_ENTITY_PROCESSING | NEEDS_NEWLINE_NORMALIZATION );
+            }
             Set( start, p, strFlags );
             return p + length;
-        } else if (*p == '\n') {
-            ++(*curLineNumPtr);
         }
         ++p;
-        TIXMLASSERT( p );
     }
-    return 0;
 }
 
 
@@ -273,32 +767,39 @@ char* StrPair::ParseName( char* p )
 }
 
 
-void StrPair::CollapseWhitespace()
+// Decodes the entity at 'p' into 'value', returning its length, or 0 if
+// it isn't one of the predefined entities.
+static int ReadEntity( const char* p, char* value )
 {
-    // Adjusting _start would cause undefined behavior on delete[]
-    TIXMLASSERT( ( _flags & NEEDS_DELETE ) == 0 );
-    // Trim leading space.
-    _start = XMLUtil::SkipWhiteSpace( _start, 0 );
-
-    if ( *_start ) {
-        const char* p = _start;	// the read pointer
-        char* q = _start;	// the write pointer
-
-        while( *p ) {
-            if ( XMLUtil::IsWhiteSpace( *p )) {
-                p = XMLUtil::SkipWhiteSpace( p, 0 );
-                if ( *p == 0 ) {
-                    break;    // don't write to q; this trims the trailing space.
-                }
-                *q = ' ';
-                ++q;
+    TIXMLASSERT( *p == '&' );
+    switch ( p[1] ) {
+        case 'a':
+            if ( p[2] == 'm' && p[3] == 'p' && p[4] == ';' ) {
+                *value = '&';
+                return 5;
             }
-            *q = *p;
-            ++q;
-            ++p;
-        }
-        *q = 0;
+            if ( p[2] == 'p' && p[3] == 'o' && p[4] == 's' && p[5] == ';' ) {
+                *value = SINGLE_QUOTE;
+                return 6;
+            }
+            break;
+        case 'l':
+        case 'g':
+            if ( p[2] == 't' && p[3] == ';' ) {
+                *value = ( p[1] == 'l' ) ? '<' : '>';
+                return 4;
+            }
+            break;
+        case 'q':
+            if ( p[2] == 'u' && p[3] == 'o' && p[4] == 't' && p[5] == ';' ) {
+                *value = DOUBLE_QUOTE;
+                return 6;
+            }
+            break;
+        default:
+            break;
     }
+    return 0;
 }
 
 
@@ -309,107 +810,144 @@ const char* StrPair::GetStr()
     if ( _flags & NEEDS_FLUSH ) {
         *_end = 0;
         _flags ^= NEEDS_FLUSH;
+        if ( _flags & ( NEEDS_ENTITY_PROCESSING | NEEDS_NEWLINE_NORMALIZATION | NEEDS_WHITESPACE_COLLAPSING ) ) {
+            Normalize();
+        }
+        _flags = (_flags & ( NEEDS_DELETE | NEEDS_FREE ));
+    }
+    TIXMLASSERT( _start );
+    return _start;
+}
 
-        if ( _flags ) {
-            const char* p = _start;	// the read pointer
-            char* q = _start;	// the write pointer
-
-            while( p < _end ) {
-                if ( (_flags & NEEDS_NEWLINE_NORMALIZATION) && *p == CR ) {
-                    // CR-LF pair becomes LF
-                    // CR alone becomes LF
-                    // LF-CR becomes LF
-                    if ( *(p+1) == LF ) {
-                        p += 2;
-                    }
-                    else {
-                        ++p;
-                    }
-                    *q = LF;
-                    ++q;
+
+void StrPair::Normalize()
+{
+    // One pass, in place: the write pointer never gets ahead of the read
+    // pointer. Runs of characters that need nothing are found a block at
+    // a time, and moved down in one go.
+    //
+    // Newlines: CR-LF, CR alone, and LF-CR all become LF.
+    // Entities: the predefined ones in the entity table, and numeric
+    //   character references, &#20013; or &#x4e2d;
+    // Whitespace collapsing: leading and trailing whitespace is removed,
+    //   and any other run of it becomes a single space.
+    const bool decode = ( _flags & NEEDS_ENTITY_PROCESSING ) != 0;
+    const bool newlines = ( _flags & NEEDS_NEWLINE_NORMALIZATION ) != 0;
+    const bool collapse = ( _flags & NEEDS_WHITESPACE_COLLAPSING ) != 0;
+    // Adjusting _start would cause undefined behavior on delete[]
+    TIXMLASSERT( !collapse || ( _flags & NEEDS_DELETE ) == 0 );
+
+    const char* p = _start;	// the read pointer
+    char* q = _start;	// the write pointer
+    bool space = false;		// a collapsed run of whitespace is pending
+
+    for( ;; ) {
+        const char* const run = FindSpecialOrEnd( p, decode ? '&' : 0, newlines ? CR : 0, newlines ? LF : 0, collapse );
+        if ( run != p ) {
+            if ( space ) {
+                *q++ = ' ';
+                space = false;
+            }
+            if ( q != p ) {
+                memmove( q, p, run - p );
+            }
+            q += run - p;
+            p = run;
+        }
+
+        char c = *p;
+        if ( c == 0 ) {
+            break;
+        }
+        if ( newlines && ( c == CR || c == LF ) ) {
+            const char pair = ( c == CR ) ? LF : CR;
+            p += ( p[1] == pair ) ? 2 : 1;
+            c = LF;
+        }
+        else if ( decode && c == '&' ) {
+            if ( p[1] == '#' ) {
+                const int buflen = 10;
+                char buf[buflen] = { 0 };
+                int len = 0;
+                const char* adjusted = XMLUtil::GetCharacterRef( p, buf, &len );
+                if ( !adjusted ) {
+                    ++p;
                 }
-                else if ( (_flags & NEEDS_NEWLINE_NORMALIZATION) && *p == LF ) {
-                    if ( *(p+1) == CR ) {
-                        p += 2;
-                    }
-                    else {
-                        ++p;
-                    }
-                    *q = LF;
-                    ++q;
+                else if ( len == 1 ) {
+                    // Goes through the whitespace check below, like
+                    // any other character.
+                    p = adjusted;
+                    c = buf[0];
                 }
-                else if ( (_flags & NEEDS_ENTITY_PROCESSING) && *p == '&' ) {
-                    // Entities handled by tinyXML2:
-                    // - special entities in the entity table [in/out]
-                    // - numeric character reference [in]
-                    //   &#20013; or &#x4e2d;
-
-                    if ( *(p+1) == '#' ) {
-                        const int buflen = 10;
-                        char buf[buflen] = { 0 };
-                        int len = 0;
-                        const char* adjusted = const_cast<char*>( XMLUtil::GetCharacterRef( p, buf, &len ) );
-                        if ( adjusted == 0 ) {
-                            *q = *p;
-                            ++p;
-                            ++q;
-                        }
-                        else {
-                            TIXMLASSERT( 0 <= len && len <= buflen );
-                            TIXMLASSERT( q + len <= adjusted );
-                            p = adjusted;
-                            memcpy( q, buf, len );
-                            q += len;
-                        }
-                    }
-                    else {
-                        bool entityFound = false;
-                        for( int i = 0; i < NUM_ENTITIES; ++i ) {
-                            const Entity& entity = entities[i];
-                            if ( strncmp( p + 1, entity.pattern, entity.length ) == 0
-                                    && *( p + entity.length + 1 ) == ';' ) {
-                                // Found an entity - convert.
-                                *q = entity.value;
-                                ++q;
-                                p += entity.length + 2;
-                                entityFound = true;
-                                break;
-                            }
-                        }
-                        if ( !entityFound ) {
-                            // fixme: treat as error?
-                            ++p;
-                            ++q;
-                        }
+                else {
+                    TIXMLASSERT( 0 <= len && len <= buflen );
+                    if ( space ) {
+                        *q++ = ' ';
+                        space = false;
                     }
+                    TIXMLASSERT( q + len <= adjusted );
+                    p = adjusted;
+                    memcpy( q, buf, len );
+                    q += len;
+                    continue;
+                }
+            }
+            else {
+                char value = 0;
+                const int length = ReadEntity( p, &value );
+                if ( length ) {
+                    p += length;
+                    c = value;
                 }
                 else {
-                    *q = *p;
-                    ++p;
-                    ++q;
+                    ++p;    // not an entity; the '&' is kept
                 }
             }
-            *q = 0;
         }
-        // The loop below has plenty going on, and this
-        // is a less useful mode. Break it out.
-        if ( _flags & NEEDS_WHITESPACE_COLLAPSING ) {
-            CollapseWhitespace();
+        else {
+            ++p;
+        }
+
+        if ( collapse && XMLUtil::IsWhiteSpace( c ) ) {
+            space = ( q != _start );
+        }
+        else {
+            if ( space ) {
+                *q++ = ' ';
+                space = false;
+            }
+            *q++ = c;
         }
-        _flags = (_flags & NEEDS_DELETE);
     }
-    TIXMLASSERT( _start );
-    return _start;
+    *q = 0;
 }
 
 
-
-
 // --------- XMLUtil ----------- //
 
 const char* XMLUtil::writeBoolTrue  = "true";
 const char* XMLUtil::writeBoolFalse = "false";
 
+// 1: whitespace, 2: name start, 4: name. See XMLUtil::IsWhiteSpace() and friends.
+const unsigned char XMLUtil::_charClass[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0,	// 0x00
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	// 0x10
+    1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 4, 4, 0,	// 0x20
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 6, 0, 0, 0, 0, 0,	// 0x30
+    0, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0x40
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 0, 0, 0, 0, 6,	// 0x50
+    0, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0x60
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 0, 0, 0, 0, 0,	// 0x70
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0x80
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0x90
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0xa0
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0xb0
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0xc0
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0xd0
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0xe0
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0xf0
+};
+
 void XMLUtil::SetBoolSerialization(const char* writeTrue, const char* writeFalse)
 {
 	static const char* defTrue  = "true";
@@ -752,26 +1290,25 @@ char* XMLDocument::Identify( char* p, XMLNode** node, bool first )
     TIXMLASSERT( sizeof( XMLComment ) == sizeof( XMLUnknown ) );		// use same memory pool
     TIXMLASSERT( sizeof( XMLComment ) == sizeof( XMLDeclaration ) );	// use same memory pool
     XMLNode* returnNode = 0;
+    int lineNum = _parseCurLineNum;
     if ( XMLUtil::StringEqual( p, xmlHeader, xmlHeaderLen ) ) {
         returnNode = CreateUnlinkedNode<XMLDeclaration>( _commentPool );
-        returnNode->_parseLineNum = _parseCurLineNum;
         p += xmlHeaderLen;
     }
     else if ( XMLUtil::StringEqual( p, commentHeader, commentHeaderLen ) ) {
         returnNode = CreateUnlinkedNode<XMLComment>( _commentPool );
-        returnNode->_parseLineNum = _parseCurLineNum;
         p += commentHeaderLen;
     }
     else if ( XMLUtil::StringEqual( p, cdataHeader, cdataHeaderLen ) ) {
         XMLText* text = CreateUnlinkedNode<XMLText>( _textPool );
         returnNode = text;
-        returnNode->_parseLineNum = _parseCurLineNum;
         p += cdataHeaderLen;
-        text->SetCData( true );
+        if ( text ) {
+            text->SetCData( true );
+        }
     }
     else if ( XMLUtil::StringEqual( p, dtdHeader, dtdHeaderLen ) ) {
         returnNode = CreateUnlinkedNode<XMLUnknown>( _commentPool );
-        returnNode->_parseLineNum = _parseCurLineNum;
         p += dtdHeaderLen;
     }
     else if ( XMLUtil::StringEqual( p, elementHeader, elementHeaderLen ) ) {
@@ -779,24 +1316,25 @@ char* XMLDocument::Identify( char* p, XMLNode** node, bool first )
         // Preserve whitespace pedantically before closing tag, when it's immediately after opening tag
         if (WhitespaceMode() == PEDANTIC_WHITESPACE && first && p != start && *(p + elementHeaderLen) == '/') {
             returnNode = CreateUnlinkedNode<XMLText>(_textPool);
-            returnNode->_parseLineNum = startLine;
+            lineNum = startLine;
             p = start;	// Back it up, all the text counts.
             _parseCurLineNum = startLine;
         }
         else {
             returnNode = CreateUnlinkedNode<XMLElement>(_elementPool);
-            returnNode->_parseLineNum = _parseCurLineNum;
             p += elementHeaderLen;
         }
     }
     else {
-        returnNode = CreateUnlinkedNode<XMLText>( _textPool );
-        returnNode->_parseLineNum = _parseCurLineNum; // Report line of first non-whitespace character
+        returnNode = CreateUnlinkedNode<XMLText>( _textPool );	// on the line of the first non-whitespace character
         p = start;	// Back it up, all the text counts.
         _parseCurLineNum = startLine;
     }
 
-    TIXMLASSERT( returnNode );
+    // Null if memory ran out; the error is set.
+    if ( returnNode ) {
+        returnNode->_parseLineNum = lineNum;
+    }
     TIXMLASSERT( p );
     *node = returnNode;
     return p;
@@ -824,10 +1362,12 @@ XMLNode::XMLNode( XMLDocument* doc ) :
     _parent( 0 ),
     _value(),
     _parseLineNum( 0 ),
+    _lazy( false ),
     _firstChild( 0 ), _lastChild( 0 ),
     _prev( 0 ), _next( 0 ),
 	_userData( 0 ),
-    _memPool( 0 )
+    _memPool( 0 ),
+    _unlinkedSlot( 0 )
 {
 }
 
@@ -876,14 +1416,34 @@ const char* XMLNode::Value() const
     return _value.GetStr();
 }
 
+int64_t XMLNode::GetByteOffset() const
+{
+    return _document->ByteOffset( _value.Start() );
+}
+
+
 void XMLNode::SetValue( const char* str, bool staticMem )
 {
+    if ( !SetValueStr( str, staticMem ) ) {
+        _document->SetError( XML_ERROR_OUT_OF_MEMORY, 0, 0 );
+    }
+}
+
+
+bool XMLNode::SetValueStr( const char* str, bool staticMem )
+{
+    if ( _document->_internNames && ToElement() ) {
+        const char* name = _document->InternName( str, strlen( str ) );
+        if ( name ) {
+            _value.SetInternedStr( name );
+            return true;
+        }
+    }
     if ( staticMem ) {
         _value.SetInternedStr( str );
+        return true;
     }
-    else {
-        _value.SetStr( str );
-    }
+    return _value.SetStr( str, 0, _document->StrAllocator() );
 }
 
 XMLNode* XMLNode::DeepClone(XMLDocument* target) const
@@ -893,7 +1453,10 @@ XMLNode* XMLNode::DeepClone(XMLDocument* target) const
 
 	for (const XMLNode* child = this->FirstChild(); child; child = child->NextSibling()) {
 		XMLNode* childClone = child->DeepClone(target);
-		TIXMLASSERT(childClone);
+		if (!childClone) {
+			// Out of memory.
+			break;
+		}
 		clone->InsertEndChild(childClone);
 	}
 	return clone;
@@ -901,9 +1464,19 @@ XMLNode* XMLNode::DeepClone(XMLDocument* target) const
 
 void XMLNode::DeleteChildren()
 {
-    while( _firstChild ) {
-        TIXMLASSERT( _lastChild );
-        DeleteChild( _firstChild );
+    // Deletes leaves first, so no node being deleted has children
+    // of its own, and a deep tree doesn't recurse. Children that were
+    // never parsed are simply forgotten.
+    _lazy = false;
+    XMLNode* node = _firstChild;
+    while( node ) {
+        if ( node->_firstChild ) {
+            node = node->_firstChild;
+            continue;
+        }
+        XMLNode* parent = node->_parent;
+        parent->DeleteChild( node );
+        node = ( parent == this ) ? _firstChild : parent;
     }
     _firstChild = _lastChild = 0;
 }
@@ -953,6 +1526,7 @@ XMLNode* XMLNode::InsertEndChild( XMLNode* addThis )
         TIXMLASSERT( false );
         return 0;
     }
+    Expand();
     InsertChildPreamble( addThis );
 
     if ( _lastChild ) {
@@ -983,6 +1557,7 @@ XMLNode* XMLNode::InsertFirstChild( XMLNode* addThis )
         TIXMLASSERT( false );
         return 0;
     }
+    Expand();
     InsertChildPreamble( addThis );
 
     if ( _firstChild ) {
@@ -1047,8 +1622,13 @@ XMLNode* XMLNode::InsertAfterChild( XMLNode* afterThis, XMLNode* addThis )
 
 const XMLElement* XMLNode::FirstChildElement( const char* name ) const
 {
+    Expand();
+    if ( !_document->NameKey( &name ) ) {
+        return 0;
+    }
+    const bool interned = name && _document->_internNames;
     for( const XMLNode* node = _firstChild; node; node = node->_next ) {
-        const XMLElement* element = node->ToElementWithName( name );
+        const XMLElement* element = node->ToElementWithName( name, interned );
         if ( element ) {
             return element;
         }
@@ -1059,8 +1639,13 @@ const XMLElement* XMLNode::FirstChildElement( const char* name ) const
 
 const XMLElement* XMLNode::LastChildElement( const char* name ) const
 {
+    Expand();
+    if ( !_document->NameKey( &name ) ) {
+        return 0;
+    }
+    const bool interned = name && _document->_internNames;
     for( const XMLNode* node = _lastChild; node; node = node->_prev ) {
-        const XMLElement* element = node->ToElementWithName( name );
+        const XMLElement* element = node->ToElementWithName( name, interned );
         if ( element ) {
             return element;
         }
@@ -1071,8 +1656,12 @@ const XMLElement* XMLNode::LastChildElement( const char* name ) const
 
 const XMLElement* XMLNode::NextSiblingElement( const char* name ) const
 {
+    if ( !_document->NameKey( &name ) ) {
+        return 0;
+    }
+    const bool interned = name && _document->_internNames;
     for( const XMLNode* node = _next; node; node = node->_next ) {
-        const XMLElement* element = node->ToElementWithName( name );
+        const XMLElement* element = node->ToElementWithName( name, interned );
         if ( element ) {
             return element;
         }
@@ -1083,8 +1672,12 @@ const XMLElement* XMLNode::NextSiblingElement( const char* name ) const
 
 const XMLElement* XMLNode::PreviousSiblingElement( const char* name ) const
 {
+    if ( !_document->NameKey( &name ) ) {
+        return 0;
+    }
+    const bool interned = name && _document->_internNames;
     for( const XMLNode* node = _prev; node; node = node->_prev ) {
-        const XMLElement* element = node->ToElementWithName( name );
+        const XMLElement* element = node->ToElementWithName( name, interned );
         if ( element ) {
             return element;
         }
@@ -1093,10 +1686,112 @@ const XMLElement* XMLNode::PreviousSiblingElement( const char* name ) const
 }
 
 
-char* XMLNode::ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr )
+/*
+	Skipping, for lazy parsing and the prescan of the parallel parse. These
+	step over markup just the way the parser does, but without creating
+	nodes or writing to the buffer. Line feeds are counted into 'newlines'.
+	They return null if the input ends first.
+*/
+static char* SkipPast( char* p, const char* endTag, int* newlines )
+{
+    const int length = static_cast<int>( strlen( endTag ) );
+    for( ;; ++p ) {
+        p = const_cast<char*>( FindCharOrEnd( p, *endTag, newlines ) );
+        if ( !*p ) {
+            return 0;
+        }
+        if ( XMLUtil::StringEqual( p, endTag, length ) ) {
+            return p + length;
+        }
+    }
+}
+
+// Steps over a start or end tag, from after the '<' to after the '>'.
+// Quoted attribute values can hold a '>'.
+static char* SkipTag( char* p, bool* empty, int* newlines )
+{
+    for( ;; ++p ) {
+        const char c = *p;
+        if ( c == 0 ) {
+            return 0;
+        }
+        if ( c == LF ) {
+            ++(*newlines);
+        }
+        else if ( c == SINGLE_QUOTE || c == DOUBLE_QUOTE ) {
+            p = const_cast<char*>( FindCharOrEnd( p + 1, c, newlines ) );
+            if ( !*p ) {
+                return 0;
+            }
+        }
+        else if ( c == '>' ) {
+            *empty = ( p[-1] == '/' );
+            return p + 1;
+        }
+    }
+}
+
+// Steps over the markup at 'p', in the order XMLDocument::Identify() checks
+// for it, and tracks the element depth. Like the parser, an end tag that
+// ends in "/>" is read as an empty element.
+static char* SkipMarkup( char* p, int* depth, int* newlines )
+{
+    TIXMLASSERT( *p == '<' );
+    if ( XMLUtil::StringEqual( p, "<?", 2 ) ) {
+        return SkipPast( p + 2, "?>", newlines );
+    }
+    if ( XMLUtil::StringEqual( p, "<!--", 4 ) ) {
+        return SkipPast( p + 4, "-->", newlines );
+    }
+    if ( XMLUtil::StringEqual( p, "<![CDATA[", 9 ) ) {
+        return SkipPast( p + 9, "]]>", newlines );
+    }
+    if ( XMLUtil::StringEqual( p, "<!", 2 ) ) {
+        return SkipPast( p + 2, ">", newlines );
+    }
+    const bool endTag = ( p[1] == '/' );
+    bool empty = false;
+    p = SkipTag( p + 1, &empty, newlines );
+    if ( p && !empty ) {
+        *depth += endTag ? -1 : 1;
+    }
+    return p;
+}
+
+// Steps over the content of an element, from after its start tag to the
+// '<' of its end tag.
+static char* SkipContent( char* p, int* newlines )
+{
+    int depth = 1;
+    for( ;; ) {
+        p = const_cast<char*>( FindCharOrEnd( p, '<', newlines ) );
+        if ( !*p ) {
+            return 0;
+        }
+        int lineNum = *newlines;
+        char* const next = SkipMarkup( p, &depth, &lineNum );
+        if ( !next ) {
+            return 0;
+        }
+        if ( depth == 0 ) {
+            return p;
+        }
+        *newlines = lineNum;
+        p = next;
+    }
+}
+
+
+char* XMLNode::ParseDeep( char* p, int* curLineNumPtr )
+{
+    return ParseNodes( p, curLineNumPtr, 0 );
+}
+
+
+char* XMLNode::ParseNodes( char* p, int* curLineNumPtr, XMLNode** open )
 {
-    // This is a recursive method, but thinking about it "at the current level"
-    // it is a pretty simple flat list:
+    // Parses the children of this node, and all of their descendants. At
+    // the current level it is a pretty simple flat list:
     //		<foo/>
     //		<!-- comment -->
     //
@@ -1106,18 +1801,39 @@ char* XMLNode::ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr )
     //		<!-- comment -->
     //
     // Where the closing element (/foo) *must* be the next thing after the opening
-    // element, and the names must match. BUT the tricky bit is that the closing
-    // element will be read by the child.
+    // element (and its children), and the names must match.
     //
-    // 'endTag' is the end tag for this node, it is returned by a call to a child.
-    // 'parentEnd' is the end tag for the parent, which is filled in and returned.
-
-	XMLDocument::DepthTracker tracker(_document);
-	if (_document->Error())
-		return 0;
+    // This isn't done recursively. An open element is linked in as soon as its
+    // start tag is read, and becomes the 'parent' of everything that follows
+    // until its end tag. The stack of open elements is therefore just the chain
+    // of parents from 'parent' back up to 'this', and nesting depth costs
+    // no stack space.
+    //
+    // That also makes the parse resumable, which the parallel parse uses.
+    // If the document has a _parseEnd, parsing stops there; when 'open' is
+    // given, the innermost open element is returned through it, and a
+    // later call that passes it back in carries on where this one stopped.
+    // If the parse finishes instead, '*open' is set to null.
 
-	bool first = true;
-	while( p && *p ) {
+    XMLNode* parent = this;
+    if ( open && *open ) {
+        parent = *open;
+    }
+    else {
+        _document->PushDepth();
+    }
+    char* result = 0;
+    bool stopped = false;
+    XMLParseFilter* const filter = _document->_parseFilter;
+    bool filterStopped = false;
+    XMLNode* skipped = 0;       // an element whose content was stepped over
+
+	bool first = !parent->_lastChild;
+	while( !_document->Error() && p && *p ) {
+        if ( p == _document->_parseEnd ) {
+            stopped = true;
+            break;
+        }
         XMLNode* node = 0;
 
         p = _document->Identify( p, &node, first );
@@ -1127,10 +1843,9 @@ char* XMLNode::ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr )
         }
         first = false;
 
-       const int initialLineNum = node->_parseLineNum;
+        const int initialLineNum = node->_parseLineNum;
 
-        StrPair endTag;
-        p = node->ParseDeep( p, &endTag, curLineNumPtr );
+        p = node->ParseDeep( p, curLineNumPtr );
         if ( !p ) {
             _document->DeleteNode( node );
             if ( !_document->Error() ) {
@@ -1151,13 +1866,11 @@ char* XMLNode::ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr )
             // declarations have so far been added.
             bool wellLocated = false;
 
-            if (ToDocument()) {
-                if (FirstChild()) {
+            if (parent->ToDocument()) {
+                if (parent->_firstChild) {
                     wellLocated =
-                        FirstChild() &&
-                        FirstChild()->ToDeclaration() &&
-                        LastChild() &&
-                        LastChild()->ToDeclaration();
+                        parent->_firstChild->ToDeclaration() &&
+                        parent->_lastChild->ToDeclaration();
                 }
                 else {
                     wellLocated = true;
@@ -1171,44 +1884,167 @@ char* XMLNode::ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr )
         }
 
         XMLElement* ele = node->ToElement();
-        if ( ele ) {
-            // We read the end tag. Return it to the parent.
-            if ( ele->ClosingType() == XMLElement::CLOSING ) {
-                if ( parentEndTag ) {
-                    ele->_value.TransferTo( parentEndTag );
-                }
+        if ( ele && ele->ClosingType() == XMLElement::CLOSING ) {
+            // The end tag closes 'parent'. Check the names match,
+            // then pop back up a level.
+            if ( parent == this ) {
+                // An end tag with nothing open at this level. Parsing
+                // stops here; the caller decides what that means.
                 node->_memPool->SetTracked();   // created and then immediately deleted.
                 DeleteNode( node );
-                return p;
+                result = p;
+                break;
+            }
+            // Compared in place: a lazy parse reads this end tag again.
+            const bool mismatch = !ele->_value.NameEqual( parent->_value );
+            node->_memPool->SetTracked();
+            DeleteNode( node );
+            if ( mismatch ) {
+                _document->SetError( XML_ERROR_MISMATCHED_ELEMENT, parent->_parseLineNum, "XMLElement name=%s", parent->Value());
+                break;
+            }
+            XMLElement* const closed = parent->ToElement();
+            parent = parent->_parent;
+            _document->PopDepth();
+            if ( closed == skipped ) {
+                parent->DeleteChild( closed );
+                skipped = 0;
+            }
+            else if ( filter && !filter->CloseElement( *closed ) ) {
+                filterStopped = true;
+                break;
             }
+            continue;
+        }
 
-            // Handle an end tag returned to this level.
-            // And handle a bunch of annoying errors.
-            bool mismatch = false;
-            if ( endTag.Empty() ) {
-                if ( ele->ClosingType() == XMLElement::OPEN ) {
-                    mismatch = true;
+        parent->InsertEndChild( node );
+        if ( filter ) {
+            if ( !ele ) {
+                if ( !filter->KeepNode( *node ) ) {
+                    parent->DeleteChild( node );
                 }
+                continue;
             }
-            else {
-                if ( ele->ClosingType() != XMLElement::OPEN ) {
-                    mismatch = true;
+            const XMLParseFilter::Action action = filter->OpenElement( *ele );
+            if ( action == XMLParseFilter::STOP ) {
+                parent->DeleteChild( ele );
+                filterStopped = true;
+                break;
+            }
+            if ( ele->ClosingType() == XMLElement::CLOSED ) {
+                if ( action == XMLParseFilter::SKIP ) {
+                    parent->DeleteChild( ele );
                 }
-                else if ( !XMLUtil::StringEqual( endTag.GetStr(), ele->Name() ) ) {
-                    mismatch = true;
+                else if ( !filter->CloseElement( *ele ) ) {
+                    filterStopped = true;
+                    break;
                 }
+                continue;
             }
-            if ( mismatch ) {
+            if ( action == XMLParseFilter::SKIP ) {
+                // Step over the content to the end tag, which closes
+                // the element, and deletes it, as usual.
+                char* const end = SkipContent( p, curLineNumPtr );
+                if ( !end ) {
+                    _document->SetError( XML_ERROR_MISMATCHED_ELEMENT, initialLineNum, "XMLElement name=%s", ele->Name());
+                    break;
+                }
+                p = end;
+                skipped = ele;
+            }
+        }
+        if ( ele && ele->ClosingType() == XMLElement::OPEN ) {
+            if ( !*p ) {
                 _document->SetError( XML_ERROR_MISMATCHED_ELEMENT, initialLineNum, "XMLElement name=%s", ele->Name());
-                _document->DeleteNode( node );
                 break;
             }
+            // Push: the children of 'ele' follow.
+            parent = ele;
+            first = true;
+            _document->PushDepth();
+
+            if ( _document->_lazyParse && !filter && !_document->Error() ) {
+                // Skip to the end tag, and leave the children until
+                // they are asked for. See XMLNode::ParseLazy().
+                int lineNum = *curLineNumPtr;
+                char* const end = SkipContent( p, &lineNum );
+                if ( end && end != p ) {
+                    ele->_lazy = true;
+                    ele->_lazyContent = p;
+                    ele->_lazyLineNum = *curLineNumPtr;
+                    p = end;
+                    *curLineNumPtr = lineNum;
+                }
+            }
         }
-        InsertEndChild( node );
     }
-    return 0;
+
+    if ( stopped && open && !_document->Error() ) {
+        *open = parent;
+        return p;
+    }
+    if ( open ) {
+        *open = 0;
+    }
+
+    int levels = 1;
+    for( XMLNode* n = parent; n != this; n = n->_parent ) {
+        ++levels;
+    }
+    if ( filterStopped && !_document->Error() ) {
+        // Not an error: the filter has what it needs. Elements that are
+        // still open are kept as they are.
+        result = p;
+    }
+    else if ( parent != this ) {
+        // Ran out of input (or hit an error) with elements still open.
+        if ( !_document->Error() ) {
+            _document->SetError( XML_ERROR_PARSING, parent->_parseLineNum, 0 );
+        }
+        XMLNode* outermost = parent;
+        while ( outermost->_parent != this ) {
+            outermost = outermost->_parent;
+        }
+        DeleteChild( outermost );
+        result = 0;
+    }
+    while ( levels-- ) {
+        _document->PopDepth();
+    }
+    return result;
+}
+
+void XMLNode::ParseLazy() const
+{
+    // Parses the children skipped by a lazy parse, in the context the
+    // document parse would have: at the same depth, with the same line
+    // numbers. Their own children are left lazy in turn.
+    XMLElement* element = const_cast<XMLElement*>( ToElement() );
+    TIXMLASSERT( element && element->_lazy );
+    element->_lazy = false;
+
+    XMLDocument* doc = _document;
+    const int depth = doc->_parsingDepth;
+    doc->_parsingDepth = 0;
+    for( const XMLNode* node = _parent; node; node = node->_parent ) {
+        ++doc->_parsingDepth;
+    }
+    // An error left by reading another element doesn't stop this one
+    // being read. The document reports the last error found; if there
+    // is none here, the earlier one (whose ErrorStr() is untouched.)
+    const XMLError error = doc->_errorID;
+    const int errorLineNum = doc->_errorLineNum;
+    doc->_errorID = XML_SUCCESS;
+    doc->_parseCurLineNum = element->_lazyLineNum;
+    element->ParseNodes( element->_lazyContent, &doc->_parseCurLineNum, 0 );
+    doc->_parsingDepth = depth;
+    if ( !doc->Error() ) {
+        doc->_errorID = error;
+        doc->_errorLineNum = errorLineNum;
+    }
 }
 
+
 /*static*/ void XMLNode::DeleteNode( XMLNode* node )
 {
     if ( node == 0 ) {
@@ -1238,8 +2074,12 @@ void XMLNode::InsertChildPreamble( XMLNode* insertThis ) const
 	}
 }
 
-const XMLElement* XMLNode::ToElementWithName( const char* name ) const
+const XMLElement* XMLNode::ToElementWithName( const char* name, bool interned ) const
 {
+    if ( interned ) {
+        // Only an element can have an interned name as its value.
+        return _value.Start() == name ? this->ToElement() : 0;
+    }
     const XMLElement* element = this->ToElement();
     if ( element == 0 ) {
         return 0;
@@ -1254,7 +2094,7 @@ const XMLElement* XMLNode::ToElementWithName( const char* name ) const
 }
 
 // --------- XMLText ---------- //
-char* XMLText::ParseDeep( char* p, StrPair*, int* curLineNumPtr )
+char* XMLText::ParseDeep( char* p, int* curLineNumPtr )
 {
     if ( this->CData() ) {
         p = _value.ParseText( p, "]]>", StrPair::NEEDS_NEWLINE_NORMALIZATION, curLineNumPtr );
@@ -1287,7 +2127,9 @@ XMLNode* XMLText::ShallowClone( XMLDocument* doc ) const
         doc = _document;
     }
     XMLText* text = doc->NewText( Value() );	// fixme: this will always allocate memory. Intern?
-    text->SetCData( this->CData() );
+    if ( text ) {
+        text->SetCData( this->CData() );
+    }
     return text;
 }
 
@@ -1319,7 +2161,7 @@ XMLComment::~XMLComment()
 }
 
 
-char* XMLComment::ParseDeep( char* p, StrPair*, int* curLineNumPtr )
+char* XMLComment::ParseDeep( char* p, int* curLineNumPtr )
 {
     // Comment parses as text.
     p = _value.ParseText( p, "-->", StrPair::COMMENT, curLineNumPtr );
@@ -1368,7 +2210,7 @@ XMLDeclaration::~XMLDeclaration()
 }
 
 
-char* XMLDeclaration::ParseDeep( char* p, StrPair*, int* curLineNumPtr )
+char* XMLDeclaration::ParseDeep( char* p, int* curLineNumPtr )
 {
     // Declaration parses as text.
     p = _value.ParseText( p, "?>", StrPair::NEEDS_NEWLINE_NORMALIZATION, curLineNumPtr );
@@ -1416,7 +2258,7 @@ XMLUnknown::~XMLUnknown()
 }
 
 
-char* XMLUnknown::ParseDeep( char* p, StrPair*, int* curLineNumPtr )
+char* XMLUnknown::ParseDeep( char* p, int* curLineNumPtr )
 {
     // Unknown parses as text.
     p = _value.ParseText( p, ">", StrPair::NEEDS_NEWLINE_NORMALIZATION, curLineNumPtr );
@@ -1493,7 +2335,13 @@ char* XMLAttribute::ParseDeep( char* p, bool processEntities, int* curLineNumPtr
 
 void XMLAttribute::SetName( const char* n )
 {
-    _name.SetStr( n );
+    _outOfMemory = !_name.SetStr( n, 0, _memPool->StrAllocator() );
+}
+
+
+void XMLAttribute::SetValueStr( const char* v )
+{
+    _outOfMemory = !_value.SetStr( v, 0, _memPool->StrAllocator() );
 }
 
 
@@ -1562,7 +2410,7 @@ XMLError XMLAttribute::QueryDoubleValue( double* value ) const
 
 void XMLAttribute::SetAttribute( const char* v )
 {
-    _value.SetStr( v );
+    SetValueStr( v );
 }
 
 
@@ -1570,7 +2418,7 @@ void XMLAttribute::SetAttribute( int v )
 {
     char buf[BUF_SIZE];
     XMLUtil::ToStr( v, buf, BUF_SIZE );
-    _value.SetStr( buf );
+    SetValueStr( buf );
 }
 
 
@@ -1578,7 +2426,7 @@ void XMLAttribute::SetAttribute( unsigned v )
 {
     char buf[BUF_SIZE];
     XMLUtil::ToStr( v, buf, BUF_SIZE );
-    _value.SetStr( buf );
+    SetValueStr( buf );
 }
 
 
@@ -1586,14 +2434,14 @@ void XMLAttribute::SetAttribute(int64_t v)
 {
 	char buf[BUF_SIZE];
 	XMLUtil::ToStr(v, buf, BUF_SIZE);
-	_value.SetStr(buf);
+	SetValueStr( buf );
 }
 
 void XMLAttribute::SetAttribute(uint64_t v)
 {
     char buf[BUF_SIZE];
     XMLUtil::ToStr(v, buf, BUF_SIZE);
-    _value.SetStr(buf);
+    SetValueStr( buf );
 }
 
 
@@ -1601,27 +2449,29 @@ void XMLAttribute::SetAttribute( bool v )
 {
     char buf[BUF_SIZE];
     XMLUtil::ToStr( v, buf, BUF_SIZE );
-    _value.SetStr( buf );
+    SetValueStr( buf );
 }
 
 void XMLAttribute::SetAttribute( double v )
 {
     char buf[BUF_SIZE];
     XMLUtil::ToStr( v, buf, BUF_SIZE );
-    _value.SetStr( buf );
+    SetValueStr( buf );
 }
 
 void XMLAttribute::SetAttribute( float v )
 {
     char buf[BUF_SIZE];
     XMLUtil::ToStr( v, buf, BUF_SIZE );
-    _value.SetStr( buf );
+    SetValueStr( buf );
 }
 
 
 // --------- XMLElement ---------- //
 XMLElement::XMLElement( XMLDocument* doc ) : XMLNode( doc ),
     _closingType( OPEN ),
+    _lazyLineNum( 0 ),
+    _lazyContent( 0 ),
     _rootAttribute( 0 )
 {
 }
@@ -1639,6 +2489,17 @@ XMLElement::~XMLElement()
 
 const XMLAttribute* XMLElement::FindAttribute( const char* name ) const
 {
+    if ( _document->_internNames ) {
+        if ( !_document->NameKey( &name ) ) {
+            return 0;
+        }
+        for( XMLAttribute* a = _rootAttribute; a; a = a->_next ) {
+            if ( a->_name.Start() == name ) {
+                return a;
+            }
+        }
+        return 0;
+    }
     for( XMLAttribute* a = _rootAttribute; a; a = a->_next ) {
         if ( XMLUtil::StringEqual( a->Name(), name ) ) {
             return a;
@@ -1734,7 +2595,8 @@ void	XMLElement::SetText( const char* inText )
 		FirstChild()->SetValue( inText );
 	else {
 		XMLText*	theText = GetDocument()->NewText( inText );
-		InsertFirstChild( theText );
+		if ( theText )
+			InsertFirstChild( theText );
 	}
 }
 
@@ -1935,18 +2797,38 @@ float XMLElement::FloatText(float defaultValue) const
 
 XMLAttribute* XMLElement::FindOrCreateAttribute( const char* name )
 {
+    const char* interned = 0;
+    if ( _document->_internNames ) {
+        interned = _document->InternName( name, strlen( name ) );
+        if ( !interned ) {
+            return 0;
+        }
+    }
     XMLAttribute* last = 0;
     XMLAttribute* attrib = 0;
     for( attrib = _rootAttribute;
             attrib;
             last = attrib, attrib = attrib->_next ) {
-        if ( XMLUtil::StringEqual( attrib->Name(), name ) ) {
+        if ( interned ? attrib->_name.Start() == interned : XMLUtil::StringEqual( attrib->Name(), name ) ) {
             break;
         }
     }
     if ( !attrib ) {
         attrib = CreateAttribute();
-        TIXMLASSERT( attrib );
+        if ( !attrib ) {
+            return 0;
+        }
+        if ( interned ) {
+            attrib->_name.SetInternedStr( interned );
+        }
+        else {
+            attrib->SetName( name );
+            if ( attrib->_outOfMemory ) {
+                DeleteAttribute( attrib );
+                _document->SetError( XML_ERROR_OUT_OF_MEMORY, 0, 0 );
+                return 0;
+            }
+        }
         if ( last ) {
             TIXMLASSERT( last->_next == 0 );
             last->_next = attrib;
@@ -1955,12 +2837,24 @@ XMLAttribute* XMLElement::FindOrCreateAttribute( const char* name )
             TIXMLASSERT( _rootAttribute == 0 );
             _rootAttribute = attrib;
         }
-        attrib->SetName( name );
     }
     return attrib;
 }
 
 
+void XMLElement::CheckAttributeValue( XMLAttribute* attribute )
+{
+    // An existing attribute keeps its old value; a new one, which has
+    // none, is taken off again.
+    if ( attribute->_outOfMemory ) {
+        if ( !attribute->_value.Start() ) {
+            DeleteAttribute( attribute->Name() );
+        }
+        _document->SetError( XML_ERROR_OUT_OF_MEMORY, 0, 0 );
+    }
+}
+
+
 void XMLElement::DeleteAttribute( const char* name )
 {
     XMLAttribute* prev = 0;
@@ -1980,9 +2874,34 @@ void XMLElement::DeleteAttribute( const char* name )
 }
 
 
+// Adds 'name' to an open-addressed hash set of attribute names, whose
+// size is a power of 2. Returns false if it is already there.
+static bool InsertAttributeName( DynArray< const StrPair*, 64 >* names, const StrPair* name )
+{
+    const size_t mask = names->Size() - 1;
+    for( size_t i = name->NameHash() & mask; ; i = ( i + 1 ) & mask ) {
+        const StrPair*& slot = ( *names )[i];
+        if ( !slot ) {
+            slot = name;
+            return true;
+        }
+        if ( slot->NameEqual( *name ) ) {
+            return false;
+        }
+    }
+}
+
+
 char* XMLElement::ParseAttributes( char* p, int* curLineNumPtr )
 {
     XMLAttribute* prevAttribute = 0;
+    // Duplicate names are found by a scan of the attributes read so far,
+    // or once there are enough of them, by a hash set. Either way the
+    // names are compared in place, without being flushed.
+    static const int HASH_ATTRIBUTES = 16;
+    int nAttributes = 0;
+    DynArray< const StrPair*, 64 > names;
+    names.SetAllocator( _document->_allocator );
 
     // Read the attributes.
     while( p ) {
@@ -1995,22 +2914,46 @@ char* XMLElement::ParseAttributes( char* p, int* curLineNumPtr )
         // attribute.
         if (XMLUtil::IsNameStartChar( static_cast<unsigned char>(*p) ) ) {
             XMLAttribute* attrib = CreateAttribute();
-            TIXMLASSERT( attrib );
+            if ( !attrib ) {
+                return 0;
+            }
             attrib->_parseLineNum = _document->_parseCurLineNum;
 
             const int attrLineNum = attrib->_parseLineNum;
 
             p = attrib->ParseDeep( p, _document->ProcessEntities(), curLineNumPtr );
-            if ( !p || Attribute( attrib->Name() ) ) {
+            if ( p && _document->_internNames && !_document->InternName( &attrib->_name ) ) {
+                DeleteAttribute( attrib );
+                return 0;
+            }
+            bool duplicate = false;
+            if ( p ) {
+                ++nAttributes;
+                if ( nAttributes < HASH_ATTRIBUTES ) {
+                    for( const XMLAttribute* a = _rootAttribute; a && !duplicate; a = a->_next ) {
+                        duplicate = a->_name.NameEqual( attrib->_name );
+                    }
+                }
+                else {
+                    if ( static_cast<size_t>( nAttributes ) * 2 > names.Size() ) {
+                        // (Re)build the set, at no more than half full.
+                        const size_t size = names.Empty() ? 4 * HASH_ATTRIBUTES : names.Size() * 2;
+                        names.Clear();
+                        memset( names.PushArr( size ), 0, size * sizeof( const StrPair* ) );
+                        for( const XMLAttribute* a = _rootAttribute; a; a = a->_next ) {
+                            InsertAttributeName( &names, &a->_name );
+                        }
+                    }
+                    duplicate = !InsertAttributeName( &names, &attrib->_name );
+                }
+            }
+            if ( !p || duplicate ) {
                 DeleteAttribute( attrib );
                 _document->SetError( XML_ERROR_PARSING_ATTRIBUTE, attrLineNum, "XMLElement name=%s", Name() );
                 return 0;
             }
-            // There is a minor bug here: if the attribute in the source xml
-            // document is duplicated, it will not be detected and the
-            // attribute will be doubly added. However, tracking the 'prevAttribute'
-            // avoids re-scanning the attribute list. Preferring performance for
-            // now, may reconsider in the future.
+            // Appended after 'prevAttribute', so the list isn't walked
+            // to find its end.
             if ( prevAttribute ) {
                 TIXMLASSERT( prevAttribute->_next == 0 );
                 prevAttribute->_next = attrib;
@@ -2052,8 +2995,12 @@ void XMLElement::DeleteAttribute( XMLAttribute* attribute )
 XMLAttribute* XMLElement::CreateAttribute()
 {
     TIXMLASSERT( sizeof( XMLAttribute ) == _document->_attributePool.ItemSize() );
-    XMLAttribute* attrib = new (_document->_attributePool.Alloc() ) XMLAttribute();
-    TIXMLASSERT( attrib );
+    void* mem = _document->_attributePool.Alloc();
+    if ( !mem ) {
+        _document->SetError( XML_ERROR_OUT_OF_MEMORY, _document->_parseCurLineNum, 0 );
+        return 0;
+    }
+    XMLAttribute* attrib = new (mem) XMLAttribute();
     attrib->_memPool = &_document->_attributePool;
     attrib->_memPool->SetTracked();
     return attrib;
@@ -2063,31 +3010,31 @@ XMLAttribute* XMLElement::CreateAttribute()
 XMLElement* XMLElement::InsertNewChildElement(const char* name)
 {
     XMLElement* node = _document->NewElement(name);
-    return InsertEndChild(node) ? node : 0;
+    return (node && InsertEndChild(node)) ? node : 0;
 }
 
 XMLComment* XMLElement::InsertNewComment(const char* comment)
 {
     XMLComment* node = _document->NewComment(comment);
-    return InsertEndChild(node) ? node : 0;
+    return (node && InsertEndChild(node)) ? node : 0;
 }
 
 XMLText* XMLElement::InsertNewText(const char* text)
 {
     XMLText* node = _document->NewText(text);
-    return InsertEndChild(node) ? node : 0;
+    return (node && InsertEndChild(node)) ? node : 0;
 }
 
 XMLDeclaration* XMLElement::InsertNewDeclaration(const char* text)
 {
     XMLDeclaration* node = _document->NewDeclaration(text);
-    return InsertEndChild(node) ? node : 0;
+    return (node && InsertEndChild(node)) ? node : 0;
 }
 
 XMLUnknown* XMLElement::InsertNewUnknown(const char* text)
 {
     XMLUnknown* node = _document->NewUnknown(text);
-    return InsertEndChild(node) ? node : 0;
+    return (node && InsertEndChild(node)) ? node : 0;
 }
 
 
@@ -2096,7 +3043,7 @@ XMLUnknown* XMLElement::InsertNewUnknown(const char* text)
 //	<ele></ele>
 //	<ele>foo<b>bar</b></ele>
 //
-char* XMLElement::ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr )
+char* XMLElement::ParseDeep( char* p, int* curLineNumPtr )
 {
     // Read the element name.
     p = XMLUtil::SkipWhiteSpace( p, curLineNumPtr );
@@ -2113,13 +3060,12 @@ char* XMLElement::ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr
     if ( _value.Empty() ) {
         return 0;
     }
-
-    p = ParseAttributes( p, curLineNumPtr );
-    if ( !p || !*p || _closingType != OPEN ) {
-        return p;
+    // End tags are compared in place, and deleted.
+    if ( _document->_internNames && _closingType != CLOSING && !_document->InternName( &_value ) ) {
+        return 0;
     }
 
-    p = XMLNode::ParseDeep( p, parentEndTag, curLineNumPtr );
+    p = ParseAttributes( p, curLineNumPtr );
     return p;
 }
 
@@ -2131,7 +3077,7 @@ XMLNode* XMLElement::ShallowClone( XMLDocument* doc ) const
         doc = _document;
     }
     XMLElement* element = doc->NewElement( Value() );					// fixme: this will always allocate memory. Intern?
-    for( const XMLAttribute* a=FirstAttribute(); a; a=a->Next() ) {
+    for( const XMLAttribute* a=FirstAttribute(); element && a; a=a->Next() ) {
         element->SetAttribute( a->Name(), a->Value() );					// fixme: this will always allocate memory. Intern?
     }
     return element;
@@ -2180,6 +3126,29 @@ bool XMLElement::Accept( XMLVisitor* visitor ) const
 
 // --------- XMLDocument ----------- //
 
+// Character buffers come from the document's allocator, if it has one.
+static char* AllocChars( XMLAllocator* allocator, size_t size )
+{
+    if ( allocator ) {
+        return static_cast<char*>( allocator->Allocate( size ) );
+    }
+    return new char[size];
+}
+
+static void FreeChars( XMLAllocator* allocator, char* chars, size_t size )
+{
+    if ( !chars ) {
+        return;
+    }
+    if ( allocator ) {
+        allocator->Free( chars, size );
+    }
+    else {
+        delete [] chars;
+    }
+}
+
+
 // Warning: List must match 'enum XMLError'
 const char* XMLDocument::_errorNames[XML_ERROR_COUNT] = {
     "XML_SUCCESS",
@@ -2200,7 +3169,11 @@ const char* XMLDocument::_errorNames[XML_ERROR_COUNT] = {
     "XML_ERROR_PARSING",
     "XML_CAN_NOT_CONVERT_TEXT",
     "XML_NO_TEXT_NODE",
-	"XML_ELEMENT_DEPTH_EXCEEDED"
+	"XML_ELEMENT_DEPTH_EXCEEDED",
+	"XML_ERROR_OUT_OF_MEMORY",
+	"XML_ERROR_INVALID_SNAPSHOT",
+	"XML_ERROR_KEY_NOT_FOUND",
+	"XML_ERROR_INDEX_OUT_OF_DATE"
 };
 
 
@@ -2213,8 +3186,28 @@ XMLDocument::XMLDocument( bool processEntities, Whitespace whitespaceMode ) :
     _errorStr(),
     _errorLineNum( 0 ),
     _charBuffer( 0 ),
+    _charBufferOwned( true ),
+    _charBufferMapLength( 0 ),
+    _charBufferSize( 0 ),
+    _charBufferCapacity( 0 ),
+    _spareBuffer( 0 ),
+    _spareBufferCapacity( 0 ),
+    _recycleMemory( 0 ),
+    _allocator( 0 ),
+    _strings( 8 * 1024 ),
+    _stringArena( false ),
+    _internNames( false ),
+    _names(),
+    _nameCount( 0 ),
+    _buildLineIndex( false ),
+    _lineIndex(),
     _parseCurLineNum( 0 ),
 	_parsingDepth(0),
+	_maxElementDepth(TINYXML2_MAX_ELEMENT_DEPTH),
+	_parseThreads(1),
+	_lazyParse(false),
+	_parseFilter(0),
+	_parseEnd(0),
     _unlinked(),
     _elementPool(),
     _attributePool(),
@@ -2228,23 +3221,35 @@ XMLDocument::XMLDocument( bool processEntities, Whitespace whitespaceMode ) :
 
 XMLDocument::~XMLDocument()
 {
+    // Nothing is kept: Clear() frees the buffers too.
+    _recycleMemory = 0;
     Clear();
 }
 
 
-void XMLDocument::MarkInUse(const XMLNode* const node)
+void XMLDocument::MarkInUse(XMLNode* node)
 {
 	TIXMLASSERT(node);
 	TIXMLASSERT(node->_parent == 0);
 
-	for (size_t i = 0; i < _unlinked.Size(); ++i) {
-		if (node == _unlinked[i]) {
-			_unlinked.SwapRemove(i);
-			break;
+	if (node->_unlinkedSlot) {
+		const size_t i = node->_unlinkedSlot - 1;
+		TIXMLASSERT(_unlinked[i] == node);
+		_unlinked.SwapRemove(i);
+		if (i < _unlinked.Size()) {
+			_unlinked[i]->_unlinkedSlot = i + 1;
 		}
+		node->_unlinkedSlot = 0;
 	}
 }
 
+size_t XMLDocument::ShrinkToFit()
+{
+    return _elementPool.ShrinkToFit() + _attributePool.ShrinkToFit()
+           + _textPool.ShrinkToFit() + _commentPool.ShrinkToFit();
+}
+
+
 void XMLDocument::Clear()
 {
     DeleteChildren();
@@ -2256,10 +3261,57 @@ void XMLDocument::Clear()
     const bool hadError = Error();
 #endif
     ClearError();
+    // Nothing is left that uses the strings, or the names.
+    _names.Clear();
+    _nameCount = 0;
+    _strings.Reset();
 
-    delete [] _charBuffer;
+#ifdef TIXML_MMAP
+    if ( _charBufferMapLength ) {
+        munmap( _charBuffer, _charBufferMapLength );
+    }
+    else
+#endif
+    if ( _charBufferOwned && _charBuffer ) {
+        if ( _charBufferCapacity == 0 ) {
+            // Handed over to ParseInPlace(), so it came from new[].
+            delete [] _charBuffer;
+        }
+        // Keep the bigger of the buffer and the spare, if it is within
+        // the limit.
+        else if ( _charBufferCapacity <= _recycleMemory && _charBufferCapacity > _spareBufferCapacity ) {
+            FreeChars( _allocator, _spareBuffer, _spareBufferCapacity );
+            _spareBuffer = _charBuffer;
+            _spareBufferCapacity = _charBufferCapacity;
+        }
+        else {
+            FreeChars( _allocator, _charBuffer, _charBufferCapacity );
+        }
+    }
     _charBuffer = 0;
+    _charBufferMapLength = 0;
+    _charBufferSize = 0;
+    _charBufferCapacity = 0;
+    _charBufferOwned = true;
+    if ( _spareBufferCapacity > _recycleMemory ) {
+        FreeChars( _allocator, _spareBuffer, _spareBufferCapacity );
+        _spareBuffer = 0;
+        _spareBufferCapacity = 0;
+    }
+    if ( _recycleMemory ) {
+        // Trim the pools to what is left of the limit.
+        size_t left = _recycleMemory - _spareBufferCapacity;
+        size_t held = _elementPool.Trim( left );
+        left -= ( held < left ) ? held : left;
+        held = _attributePool.Trim( left );
+        left -= ( held < left ) ? held : left;
+        held = _textPool.Trim( left );
+        left -= ( held < left ) ? held : left;
+        _commentPool.Trim( left );
+    }
+    _lineIndex.Clear();
 	_parsingDepth = 0;
+	_parseEnd = 0;
 
 #if 0
     _textPool.Trace( "text" );
@@ -2288,14 +3340,48 @@ void XMLDocument::DeepCopy(XMLDocument* target) const
 
 	target->Clear();
 	for (const XMLNode* node = this->FirstChild(); node; node = node->NextSibling()) {
-		target->InsertEndChild(node->DeepClone(target));
+		XMLNode* clone = node->DeepClone(target);
+		if (!clone) {
+			break;
+		}
+		target->InsertEndChild(clone);
 	}
 }
 
+void XMLDocument::Freeze()
+{
+    // Visits every node, in document order and without recursion;
+    // FirstChild() reads the children of lazy elements on the way.
+    XMLNode* node = FirstChild();
+    while ( node ) {
+        node->Value();
+        const XMLElement* element = node->ToElement();
+        if ( element ) {
+            for( const XMLAttribute* a = element->FirstAttribute(); a; a = a->Next() ) {
+                a->Name();
+                a->Value();
+            }
+        }
+        if ( node->FirstChild() ) {
+            node = node->FirstChild();
+            continue;
+        }
+        while ( node != this && !node->_next ) {
+            node = node->_parent;
+        }
+        node = ( node == this ) ? 0 : node->_next;
+    }
+}
+
+
 XMLElement* XMLDocument::NewElement( const char* name )
 {
     XMLElement* ele = CreateUnlinkedNode<XMLElement>( _elementPool );
-    ele->SetName( name );
+    if ( ele && !ele->SetValueStr( name, false ) ) {
+        DeleteNode( ele );
+        SetError( XML_ERROR_OUT_OF_MEMORY, 0, 0 );
+        return 0;
+    }
     return ele;
 }
 
@@ -2303,7 +3389,11 @@ XMLElement* XMLDocument::NewElement( const char* name )
 XMLComment* XMLDocument::NewComment( const char* str )
 {
     XMLComment* comment = CreateUnlinkedNode<XMLComment>( _commentPool );
-    comment->SetValue( str );
+    if ( comment && !comment->SetValueStr( str, false ) ) {
+        DeleteNode( comment );
+        SetError( XML_ERROR_OUT_OF_MEMORY, 0, 0 );
+        return 0;
+    }
     return comment;
 }
 
@@ -2311,7 +3401,11 @@ XMLComment* XMLDocument::NewComment( const char* str )
 XMLText* XMLDocument::NewText( const char* str )
 {
     XMLText* text = CreateUnlinkedNode<XMLText>( _textPool );
-    text->SetValue( str );
+    if ( text && !text->SetValueStr( str, false ) ) {
+        DeleteNode( text );
+        SetError( XML_ERROR_OUT_OF_MEMORY, 0, 0 );
+        return 0;
+    }
     return text;
 }
 
@@ -2319,7 +3413,11 @@ XMLText* XMLDocument::NewText( const char* str )
 XMLDeclaration* XMLDocument::NewDeclaration( const char* str )
 {
     XMLDeclaration* dec = CreateUnlinkedNode<XMLDeclaration>( _commentPool );
-    dec->SetValue( str ? str : "xml version=\"1.0\" encoding=\"UTF-8\"" );
+    if ( dec && !dec->SetValueStr( str ? str : "xml version=\"1.0\" encoding=\"UTF-8\"", false ) ) {
+        DeleteNode( dec );
+        SetError( XML_ERROR_OUT_OF_MEMORY, 0, 0 );
+        return 0;
+    }
     return dec;
 }
 
@@ -2327,7 +3425,11 @@ XMLDeclaration* XMLDocument::NewDeclaration( const char* str )
 XMLUnknown* XMLDocument::NewUnknown( const char* str )
 {
     XMLUnknown* unk = CreateUnlinkedNode<XMLUnknown>( _commentPool );
-    unk->SetValue( str );
+    if ( unk && !unk->SetValueStr( str, false ) ) {
+        DeleteNode( unk );
+        SetError( XML_ERROR_OUT_OF_MEMORY, 0, 0 );
+        return 0;
+    }
     return unk;
 }
 
@@ -2347,6 +3449,120 @@ static FILE* callfopen( const char* filepath, const char* mode )
     return fp;
 }
 
+// Sources of input of unknown length, for ReadToEnd(). Read() returns
+// the number of bytes read, 0 at the end of the input, or -1 on error.
+struct FileSource
+{
+    FILE* fp;
+
+    long long Read( char* buffer, size_t n ) {
+        const size_t read = fread( buffer, 1, n, fp );
+        if ( read == 0 && ferror( fp ) ) {
+            return -1;
+        }
+        return static_cast<long long>( read );
+    }
+};
+
+struct DescriptorSource
+{
+    int fd;
+
+    long long Read( char* buffer, size_t n ) {
+#if defined(TIXML_FD_WIN32)
+        const unsigned int max = 1u << 30;
+        return _read( fd, buffer, static_cast<unsigned int>( n < max ? n : max ) );
+#elif defined(TIXML_FD_POSIX)
+        for( ;; ) {
+            const ssize_t read = ::read( fd, buffer, n );
+            if ( read >= 0 || errno != EINTR ) {
+                return read;
+            }
+        }
+#else
+        (void)buffer;
+        (void)n;
+        return -1;
+#endif
+    }
+};
+
+// Reads no more than 'remaining' bytes of a file.
+struct RangeSource
+{
+    FILE* fp;
+    uint64_t remaining;
+
+    long long Read( char* buffer, size_t n ) {
+        if ( n > remaining ) {
+            n = static_cast<size_t>( remaining );
+        }
+        const size_t read = fread( buffer, 1, n, fp );
+        if ( read < n && ferror( fp ) ) {
+            return -1;
+        }
+        remaining -= read;
+        return static_cast<long long>( read );
+    }
+};
+
+/*
+	Reads 'source' to its end into a new, null terminated buffer from
+	'allocator'. The buffer starts big enough for 'sizeHint' bytes, and
+	doubles whenever it fills, so the copying stays linear in the length
+	of the input however wrong the hint is. Fails with
+	XML_ERROR_FILE_READ_ERROR if reading fails or the input can't be
+	sized, and XML_ERROR_OUT_OF_MEMORY if the allocator runs out.
+*/
+template< class SOURCE >
+static XMLError ReadToEnd( SOURCE& source, size_t sizeHint, XMLAllocator* allocator,
+                           char** result, size_t* length, size_t* resultCapacity )
+{
+    static const size_t MIN_CAPACITY = 4096;
+    const size_t maxSizeT = static_cast<size_t>(-1);
+    // Room for the terminator, and for the read that finds the end.
+    size_t capacity = ( sizeHint < maxSizeT / 2 ) ? sizeHint + 2 : MIN_CAPACITY;
+    if ( capacity < MIN_CAPACITY ) {
+        capacity = MIN_CAPACITY;
+    }
+    char* buffer = AllocChars( allocator, capacity );
+    if ( !buffer ) {
+        return XML_ERROR_OUT_OF_MEMORY;
+    }
+    size_t size = 0;
+    for( ;; ) {
+        if ( capacity - size < 2 ) {
+            if ( capacity > maxSizeT / 2 ) {
+                FreeChars( allocator, buffer, capacity );
+                return XML_ERROR_FILE_READ_ERROR;
+            }
+            char* grown = AllocChars( allocator, capacity * 2 );
+            if ( !grown ) {
+                FreeChars( allocator, buffer, capacity );
+                return XML_ERROR_OUT_OF_MEMORY;
+            }
+            memcpy( grown, buffer, size );
+            FreeChars( allocator, buffer, capacity );
+            buffer = grown;
+            capacity *= 2;
+        }
+        const long long read = source.Read( buffer + size, capacity - size - 1 );
+        if ( read < 0 ) {
+            FreeChars( allocator, buffer, capacity );
+            return XML_ERROR_FILE_READ_ERROR;
+        }
+        if ( read == 0 ) {
+            break;
+        }
+        size += static_cast<size_t>( read );
+    }
+    buffer[size] = 0;
+    *result = buffer;
+    *length = size;
+    *resultCapacity = capacity;
+    return XML_SUCCESS;
+}
+
 void XMLDocument::DeleteNode( XMLNode* node )	{   
     if(node == 0) {
         return; // check for null pointer
@@ -2390,7 +3606,11 @@ XMLError XMLDocument::LoadFile( FILE* fp )
 {
     Clear();
 
-    TIXML_FSEEK( fp, 0, SEEK_SET );
+    if ( TIXML_FSEEK( fp, 0, SEEK_SET ) != 0 ) {
+        // Pipes and the like can't seek, or be sized in advance.
+        FileSource source = { fp };
+        return ParseSource( source, 0 );
+    }
     if ( fgetc( fp ) == EOF && ferror( fp ) != 0 ) {
         SetError( XML_ERROR_FILE_READ_ERROR, 0, 0 );
         return _errorID;
@@ -2426,7 +3646,11 @@ XMLError XMLDocument::LoadFile( FILE* fp )
 
     const size_t size = static_cast<size_t>(filelength);
     TIXMLASSERT( _charBuffer == 0 );
-    _charBuffer = new char[size+1];
+    _charBuffer = NewCharBuffer( size );
+    if ( !_charBuffer ) {
+        SetError( XML_ERROR_OUT_OF_MEMORY, 0, 0 );
+        return _errorID;
+    }
     const size_t read = fread( _charBuffer, 1, size, fp );
     if ( read != size ) {
         SetError( XML_ERROR_FILE_READ_ERROR, 0, 0 );
@@ -2434,13 +3658,43 @@ XMLError XMLDocument::LoadFile( FILE* fp )
     }
 
     _charBuffer[size] = 0;
+    _charBufferSize = size;
 
     Parse();
     return _errorID;
 }
 
 
-XMLError XMLDocument::SaveFile( const char* filename, bool compact )
+XMLError XMLDocument::LoadFileDescriptor( int fd )
+{
+    Clear();
+
+    // The size of a regular file is a good guess at how much is left to
+    // read; other descriptors don't know.
+    size_t sizeHint = 0;
+#if defined(TIXML_FD_WIN32)
+    struct __stat64 st;
+    if ( _fstat64( fd, &st ) == 0 && ( st.st_mode & _S_IFREG ) ) {
+        const long long at = _lseeki64( fd, 0, SEEK_CUR );
+        if ( at >= 0 && at < st.st_size ) {
+            sizeHint = static_cast<size_t>( st.st_size - at );
+        }
+    }
+#elif defined(TIXML_FD_POSIX)
+    struct stat st;
+    if ( fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) ) {
+        const off_t at = lseek( fd, 0, SEEK_CUR );
+        if ( at >= 0 && at < st.st_size ) {
+            sizeHint = static_cast<size_t>( st.st_size - at );
+        }
+    }
+#endif
+    DescriptorSource source = { fd };
+    return ParseSource( source, sizeHint );
+}
+
+
+XMLError XMLDocument::LoadSubtree( const char* filename, const XMLIndex& index, const char* key )
 {
     if ( !filename ) {
         TIXMLASSERT( false );
@@ -2448,7 +3702,140 @@ XMLError XMLDocument::SaveFile( const char* filename, bool compact )
         return _errorID;
     }
 
-    FILE* fp = callfopen( filename, "w" );
+    Clear();
+    uint64_t start = 0;
+    uint64_t end = 0;
+    if ( !key || !index.Find( key, &start, &end ) ) {
+        SetError( XML_ERROR_KEY_NOT_FOUND, 0, "key=%s", key ? key : "<null>" );
+        return _errorID;
+    }
+    FILE* fp = callfopen( filename, "rb" );
+    if ( !fp ) {
+        SetError( XML_ERROR_FILE_NOT_FOUND, 0, "filename=%s", filename );
+        return _errorID;
+    }
+    // A file that has changed size has surely changed; the offsets are
+    // no good.
+    const bool sized = ( TIXML_FSEEK( fp, 0, SEEK_END ) == 0 );
+    const long long fileLength = sized ? static_cast<long long>( TIXML_FTELL( fp ) ) : -1;
+    if ( fileLength < 0 || static_cast<uint64_t>( fileLength ) != index.SourceSize() ) {
+        fclose( fp );
+        SetError( XML_ERROR_INDEX_OUT_OF_DATE, 0, "filename=%s", filename );
+        return _errorID;
+    }
+    if ( end - start >= static_cast<uint64_t>( static_cast<size_t>(-1) / 2 )
+         || TIXML_FSEEK( fp, static_cast<long long>( start ), SEEK_SET ) != 0 ) {
+        fclose( fp );
+        SetError( XML_ERROR_FILE_READ_ERROR, 0, 0 );
+        return _errorID;
+    }
+    RangeSource source = { fp, end - start };
+    ParseSource( source, static_cast<size_t>( end - start ) );
+    fclose( fp );
+    return _errorID;
+}
+
+
+template< class SOURCE >
+XMLError XMLDocument::ParseSource( SOURCE& source, size_t sizeHint )
+{
+    TIXMLASSERT( _charBuffer == 0 );
+    const XMLError error = ReadToEnd( source, sizeHint, _allocator, &_charBuffer, &_charBufferSize, &_charBufferCapacity );
+    if ( error != XML_SUCCESS ) {
+        SetError( error, 0, 0 );
+        return _errorID;
+    }
+    if ( _charBufferSize == 0 ) {
+        SetError( XML_ERROR_EMPTY_DOCUMENT, 0, 0 );
+        return _errorID;
+    }
+    Parse();
+    return _errorID;
+}
+
+
+XMLError XMLDocument::LoadFileMapped( const char* filename )
+{
+#ifdef TIXML_MMAP
+    if ( !filename ) {
+        TIXMLASSERT( false );
+        SetError( XML_ERROR_FILE_COULD_NOT_BE_OPENED, 0, "filename=<null>" );
+        return _errorID;
+    }
+
+    Clear();
+    const int fd = open( filename, O_RDONLY );
+    if ( fd < 0 ) {
+        SetError( XML_ERROR_FILE_NOT_FOUND, 0, "filename=%s", filename );
+        return _errorID;
+    }
+    struct stat st;
+    if ( fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode ) ) {
+        // Not something that can be mapped (a pipe, for instance.) Read
+        // it instead; from this descriptor, since a FIFO can't be opened
+        // a second time for the same writer.
+        LoadFileDescriptor( fd );
+        close( fd );
+        return _errorID;
+    }
+    if ( st.st_size == 0 ) {
+        close( fd );
+        SetError( XML_ERROR_EMPTY_DOCUMENT, 0, 0 );
+        return _errorID;
+    }
+    const unsigned long long fileLength = static_cast<unsigned long long>( st.st_size );
+    if ( fileLength >= static_cast<unsigned long long>( static_cast<size_t>(-1) / 2 ) ) {
+        close( fd );
+        SetError( XML_ERROR_FILE_READ_ERROR, 0, 0 );
+        return _errorID;
+    }
+    const size_t size = static_cast<size_t>( fileLength );
+
+    // The parser needs a null terminator after the last byte. Reserve
+    // an anonymous (zero filled) region one byte longer than the file,
+    // and map the file over the front of it. The bytes past the end of
+    // the file, in the last page of the file mapping or in the page after
+    // it, read as zero.
+    const size_t pageSize = static_cast<size_t>( sysconf( _SC_PAGESIZE ) );
+    const size_t mapLength = ( size + 1 + pageSize - 1 ) / pageSize * pageSize;
+    void* base = mmap( 0, mapLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( base == MAP_FAILED ) {
+        close( fd );
+        SetError( XML_ERROR_FILE_READ_ERROR, 0, 0 );
+        return _errorID;
+    }
+    void* mapped = mmap( base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0 );
+    close( fd );
+    if ( mapped == MAP_FAILED ) {
+        munmap( base, mapLength );
+        SetError( XML_ERROR_FILE_READ_ERROR, 0, 0 );
+        return _errorID;
+    }
+    TIXMLASSERT( mapped == base );
+
+    TIXMLASSERT( _charBuffer == 0 );
+    _charBuffer = static_cast<char*>( base );
+    _charBufferMapLength = mapLength;
+    _charBufferSize = size;
+    TIXMLASSERT( _charBuffer[size] == 0 );
+
+    Parse();
+    return _errorID;
+#else
+    return LoadFile( filename );
+#endif
+}
+
+
+XMLError XMLDocument::SaveFile( const char* filename, bool compact )
+{
+    if ( !filename ) {
+        TIXMLASSERT( false );
+        SetError( XML_ERROR_FILE_COULD_NOT_BE_OPENED, 0, "filename=<null>" );
+        return _errorID;
+    }
+
+    FILE* fp = callfopen( filename, "w" );
     if ( !fp ) {
         SetError( XML_ERROR_FILE_COULD_NOT_BE_OPENED, 0, "filename=%s", filename );
         return _errorID;
@@ -2482,25 +3869,215 @@ XMLError XMLDocument::Parse( const char* xml, size_t nBytes )
         nBytes = strlen( xml );
     }
     TIXMLASSERT( _charBuffer == 0 );
-    _charBuffer = new char[ nBytes+1 ];
+    _charBuffer = NewCharBuffer( nBytes );
+    if ( !_charBuffer ) {
+        SetError( XML_ERROR_OUT_OF_MEMORY, 0, 0 );
+        return _errorID;
+    }
     memcpy( _charBuffer, xml, nBytes );
     _charBuffer[nBytes] = 0;
+    _charBufferSize = nBytes;
+
+    Parse();
+    if ( Error() ) {
+        ReleasePoolsAfterError();
+    }
+    return _errorID;
+}
+
+
+XMLError XMLDocument::ParseInPlace( char* xml, size_t nBytes, bool transferOwnership )
+{
+    Clear();
+
+    if ( xml ) {
+        if ( nBytes == static_cast<size_t>(-1) ) {
+            nBytes = strlen( xml );
+        }
+        TIXMLASSERT( _charBuffer == 0 );
+        // Take the buffer even if it turns out to be empty, so that an
+        // ownership transfer is always honored.
+        _charBuffer = xml;
+        _charBufferOwned = transferOwnership;
+        _charBuffer[nBytes] = 0;
+        _charBufferSize = nBytes;
+    }
+    if ( nBytes == 0 || !xml || !*xml ) {
+        SetError( XML_ERROR_EMPTY_DOCUMENT, 0, 0 );
+        return _errorID;
+    }
 
     Parse();
     if ( Error() ) {
-        // clean up now essentially dangling memory.
-        // and the parse fail can put objects in the
-        // pools that are dead and inaccessible.
-        DeleteChildren();
-        _elementPool.Clear();
-        _attributePool.Clear();
-        _textPool.Clear();
-        _commentPool.Clear();
+        ReleasePoolsAfterError();
     }
     return _errorID;
 }
 
 
+int64_t XMLDocument::ByteOffset( const char* str ) const
+{
+    // Pointers into other allocations can't be ordered against the buffer
+    // portably, so compare them as integers.
+    const uintptr_t begin = reinterpret_cast<uintptr_t>( _charBuffer );
+    const uintptr_t at = reinterpret_cast<uintptr_t>( str );
+    if ( !_charBuffer || !str || at < begin || at - begin >= _charBufferSize ) {
+        return -1;
+    }
+    return static_cast<int64_t>( at - begin );
+}
+
+
+bool XMLDocument::LineColumn( int64_t offset, int* line, int* column ) const
+{
+    if ( !_buildLineIndex || !_charBuffer || offset < 0 || static_cast<uint64_t>( offset ) > _charBufferSize ) {
+        return false;
+    }
+    // The number of line feeds before 'offset' is the line, less one.
+    const size_t at = static_cast<size_t>( offset );
+    size_t lo = 0;
+    size_t hi = _lineIndex.Size();
+    while ( lo < hi ) {
+        const size_t mid = lo + ( hi - lo ) / 2;
+        if ( _lineIndex[mid] < at ) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    const size_t lineStart = lo ? _lineIndex[lo - 1] + 1 : 0;
+    if ( line ) {
+        *line = static_cast<int>( lo + 1 );
+    }
+    if ( column ) {
+        *column = static_cast<int>( at - lineStart + 1 );
+    }
+    return true;
+}
+
+
+char* XMLDocument::NewCharBuffer( size_t size )
+{
+    TIXMLASSERT( _charBuffer == 0 );
+    if ( _spareBuffer && _spareBufferCapacity > size ) {
+        char* const buffer = _spareBuffer;
+        _charBufferCapacity = _spareBufferCapacity;
+        _spareBuffer = 0;
+        _spareBufferCapacity = 0;
+        return buffer;
+    }
+    char* const buffer = AllocChars( _allocator, size + 1 );
+    _charBufferCapacity = buffer ? size + 1 : 0;
+    return buffer;
+}
+
+
+void XMLDocument::SetAllocator( XMLAllocator* allocator )
+{
+    // Everything from the old allocator goes back to it.
+    Clear();
+    FreeChars( _allocator, _spareBuffer, _spareBufferCapacity );
+    _spareBuffer = 0;
+    _spareBufferCapacity = 0;
+    _elementPool.SetAllocator( allocator );
+    _attributePool.SetAllocator( allocator );
+    _textPool.SetAllocator( allocator );
+    _commentPool.SetAllocator( allocator );
+    _unlinked.SetAllocator( allocator );
+    _lineIndex.SetAllocator( allocator );
+    _names.SetAllocator( allocator );
+    _strings.SetUpstream( allocator );
+    _allocator = allocator;
+    _attributePool.SetStrAllocator( StrAllocator() );
+}
+
+
+void XMLDocument::SetStringArena( bool arena )
+{
+    // Strings already in the arena stay there until Clear().
+    _stringArena = arena;
+    _attributePool.SetStrAllocator( StrAllocator() );
+}
+
+
+void XMLDocument::SetInternNames( bool intern )
+{
+    // Every name is interned, or none is.
+    Clear();
+    _internNames = intern;
+}
+
+
+const char* XMLDocument::FindName( const char* name, size_t length ) const
+{
+    if ( _names.Empty() ) {
+        return 0;
+    }
+    return _names[FindSlot( _names.Mem(), _names.Size(), name, length, StringSlots() )];
+}
+
+
+const char* XMLDocument::InternName( const char* name, size_t length )
+{
+    const char* found = FindName( name, length );
+    if ( found ) {
+        return found;
+    }
+    char* copy = static_cast<char*>( _strings.Allocate( length + 1 ) );
+    if ( !copy ) {
+        SetError( XML_ERROR_OUT_OF_MEMORY, _parseCurLineNum, 0 );
+        return 0;
+    }
+    memcpy( copy, name, length );
+    copy[length] = 0;
+
+    GrowTable( &_names, _nameCount, StringSlots(), _allocator );
+    _names[FindSlot( _names.Mem(), _names.Size(), copy, length, StringSlots() )] = copy;
+    ++_nameCount;
+    return copy;
+}
+
+
+bool XMLDocument::InternName( StrPair* name )
+{
+    const char* interned = InternName( name->Start(), name->NameLength() );
+    if ( !interned ) {
+        return false;
+    }
+    name->SetInternedStr( interned );
+    return true;
+}
+
+
+bool XMLDocument::NameKey( const char** name ) const
+{
+    if ( !_internNames || !*name ) {
+        return true;
+    }
+    *name = FindName( *name, strlen( *name ) );
+    return *name != 0;
+}
+
+
+void XMLDocument::ReleasePoolsAfterError()
+{
+    // clean up now essentially dangling memory.
+    // and the parse fail can put objects in the
+    // pools that are dead and inaccessible.
+    DeleteChildren();
+    if ( _recycleMemory && _elementPool.CurrentAllocs() == 0 && _attributePool.CurrentAllocs() == 0
+        && _textPool.CurrentAllocs() == 0 && _commentPool.CurrentAllocs() == 0 ) {
+        // Nothing was left behind, so the blocks can be kept.
+        return;
+    }
+    _elementPool.Clear();
+    _attributePool.Clear();
+    _textPool.Clear();
+    _commentPool.Clear();
+}
+
+
 void XMLDocument::Print( XMLPrinter* streamer ) const
 {
     if ( streamer ) {
@@ -2528,7 +4105,7 @@ void XMLDocument::SetError( XMLError error, int lineNum, const char* format, ...
 	_errorStr.Reset();
 
     const size_t BUFFER_SIZE = 1000;
-    char* buffer = new char[BUFFER_SIZE];
+    char buffer[BUFFER_SIZE];
 
     TIXMLASSERT(sizeof(error) <= sizeof(int));
     TIXML_SNPRINTF(buffer, BUFFER_SIZE, "Error=%s ErrorID=%d (0x%x) Line number=%d",
@@ -2544,8 +4121,7 @@ void XMLDocument::SetError( XMLError error, int lineNum, const char* format, ...
 		TIXML_VSNPRINTF(buffer + len, BUFFER_SIZE - len, format, va);
 		va_end(va);
 	}
-	_errorStr.SetStr(buffer);
-	delete[] buffer;
+	_errorStr.SetStr(buffer, 0, _allocator);
 }
 
 
@@ -2579,6 +4155,10 @@ void XMLDocument::Parse()
     TIXMLASSERT( _charBuffer );
     _parseCurLineNum = 1;
     _parseLineNum = 1;
+    if ( _buildLineIndex ) {
+        // Before the parse, which writes to the buffer.
+        IndexLines( _charBuffer, &_lineIndex );
+    }
     char* p = _charBuffer;
     p = XMLUtil::SkipWhiteSpace( p, &_parseCurLineNum );
     p = const_cast<char*>( XMLUtil::ReadBOM( p, &_writeBOM ) );
@@ -2586,462 +4166,2990 @@ void XMLDocument::Parse()
         SetError( XML_ERROR_EMPTY_DOCUMENT, 0, 0 );
         return;
     }
-    ParseDeep(p, 0, &_parseCurLineNum );
+    if ( _parseThreads != 1 && !_lazyParse && !_parseFilter && !_allocator && !_internNames && ParseParallel( p ) ) {
+        return;
+    }
+    ParseDeep(p, &_parseCurLineNum );
 }
 
-void XMLDocument::PushDepth()
-{
-	_parsingDepth++;
-	if (_parsingDepth == TINYXML2_MAX_ELEMENT_DEPTH) {
-		SetError(XML_ELEMENT_DEPTH_EXCEEDED, _parseCurLineNum, "Element nesting is too deep." );
-	}
-}
 
-void XMLDocument::PopDepth()
+#if defined(TIXML_PTHREADS) || defined(TIXML_WIN32_THREADS)
+
+// Each range of a parallel parse should be at least this big; below it,
+// starting a thread costs more than it saves.
+static const size_t PARALLEL_MIN_RANGE = 64 * 1024;
+
+static int ProcessorCount()
 {
-	TIXMLASSERT(_parsingDepth > 0);
-	--_parsingDepth;
+#if defined(TIXML_WIN32_THREADS)
+    SYSTEM_INFO info;
+    GetSystemInfo( &info );
+    return static_cast<int>( info.dwNumberOfProcessors );
+#elif defined(_SC_NPROCESSORS_ONLN)
+    return static_cast<int>( sysconf( _SC_NPROCESSORS_ONLN ) );
+#else
+    return 1;
+#endif
 }
 
-XMLPrinter::XMLPrinter( FILE* file, bool compact, int depth, EscapeAposCharsInAttributes aposInAttributes ) :
-    _elementJustOpened( false ),
-    _stack(),
-    _firstElement( true ),
-    _fp( file ),
-    _depth( depth ),
-    _textDepth( -1 ),
-    _processEntities( true ),
-    _compactMode( compact ),
-    _buffer()
+// A range of the children of the root, and the document it is parsed into.
+// Most ranges are parsed on threads of their own. A range can also be a
+// 'seam': a few children between two threaded ranges that are parsed
+// afterwards, on the calling thread, so that no thread reads the blocks
+// another is writing to.
+struct XMLDocument::ParallelRange
 {
-    for( int i=0; i<ENTITY_RANGE; ++i ) {
-        _entityFlag[i] = false;
-        _restrictedEntityFlag[i] = false;
-    }
-    for( int i=0; i<NUM_ENTITIES; ++i ) {
-        const char entityValue = entities[i].value;
-        if ((aposInAttributes == ESCAPE_APOS_CHARS_IN_ATTRIBUTES) || (entityValue != SINGLE_QUOTE)) {
-            const unsigned char flagIndex = static_cast<unsigned char>(entityValue);
-            TIXMLASSERT( flagIndex < ENTITY_RANGE );
-            _entityFlag[flagIndex] = true;
+    ParallelRange() : target( 0 ), root( 0 ), start( 0 ), end( 0 ), lineNum( 0 ),
+        first( 0 ), last( 0 ), doc( 0 ), seam( false ), started( false ) {}
+    ~ParallelRange() {
+        if ( doc != target ) {
+            delete doc;
         }
     }
-    _restrictedEntityFlag[static_cast<unsigned char>('&')] = true;
-    _restrictedEntityFlag[static_cast<unsigned char>('<')] = true;
-    _restrictedEntityFlag[static_cast<unsigned char>('>')] = true;	// not required, but consistency is nice
-    _buffer.Push( 0 );
-}
 
+    XMLDocument*	target;
+    XMLElement*		root;
+    char*			start;
+    char*			end;
+    int				lineNum;
+    XMLNode*		first;		// the parsed nodes, ready to be linked under 'root'
+    XMLNode*		last;
+    XMLDocument*	doc;
+    bool			seam;
+    bool			started;
 
-void XMLPrinter::Print( const char* format, ... )
-{
-    va_list     va;
-    va_start( va, format );
+#if defined(TIXML_WIN32_THREADS)
+    HANDLE			thread;
 
-    if ( _fp ) {
-        vfprintf( _fp, format, va );
-    }
-    else {
-        const int len = TIXML_VSCPRINTF( format, va );
-        // Close out and re-start the va-args
-        va_end( va );
-        TIXMLASSERT( len >= 0 );
-        va_start( va, format );
-        TIXMLASSERT( _buffer.Size() > 0 && _buffer[_buffer.Size() - 1] == 0 );
-        char* p = _buffer.PushArr( len ) - 1;	// back up over the null terminator.
-		TIXML_VSNPRINTF( p, len+1, format, va );
+    static unsigned __stdcall Run( void* arg ) {
+        ParallelRange* range = static_cast<ParallelRange*>( arg );
+        range->doc->ParseRange( range );
+        return 0;
     }
-    va_end( va );
-}
-
-
-void XMLPrinter::Write( const char* data, size_t size )
-{
-    if ( _fp ) {
-        fwrite ( data , sizeof(char), size, _fp);
+    void Start() {
+        thread = reinterpret_cast<HANDLE>( _beginthreadex( 0, 0, Run, this, 0, 0 ) );
+        started = ( thread != 0 );
     }
-    else {
-        char* p = _buffer.PushArr( size ) - 1;   // back up over the null terminator.
-        memcpy( p, data, size );
-        p[size] = 0;
+    void Join() {
+        WaitForSingleObject( thread, INFINITE );
+        CloseHandle( thread );
     }
-}
-
+#else
+    pthread_t		thread;
 
-void XMLPrinter::Putc( char ch )
-{
-    if ( _fp ) {
-        fputc ( ch, _fp);
+    static void* Run( void* arg ) {
+        ParallelRange* range = static_cast<ParallelRange*>( arg );
+        range->doc->ParseRange( range );
+        return 0;
     }
-    else {
-        char* p = _buffer.PushArr( sizeof(char) ) - 1;   // back up over the null terminator.
-        p[0] = ch;
-        p[1] = 0;
+    void Start() {
+        started = ( pthread_create( &thread, 0, Run, this ) == 0 );
     }
-}
+    void Join() {
+        pthread_join( thread, 0 );
+    }
+#endif
+
+private:
+    ParallelRange( const ParallelRange& );	// not supported
+    void operator=( const ParallelRange& );	// not supported
+};
 
 
-void XMLPrinter::PrintSpace( int depth )
+bool XMLDocument::ParseParallel( char* p )
 {
-    for( int i=0; i<depth; ++i ) {
-        Write( "    " );
+    // Returns false, having touched nothing, if the document should be
+    // parsed serially instead.
+    int threads = _parseThreads;
+    if ( threads < 1 ) {
+        threads = ProcessorCount();
+    }
+    if ( threads < 2 ) {
+        return false;
     }
-}
 
+    // Prescan for the start tag of the root element...
+    int lineNum = _parseCurLineNum;
+    int depth = 0;
+    char* q = p;
+    while ( depth == 0 ) {
+        q = const_cast<char*>( FindCharOrEnd( q, '<', &lineNum ) );
+        if ( !*q ) {
+            return false;
+        }
+        q = SkipMarkup( q, &depth, &lineNum );
+        if ( !q || depth < 0 ) {
+            return false;
+        }
+    }
+    char* const contentStart = q;
+
+    size_t nThreaded = static_cast<size_t>( threads );
+    const size_t length = strlen( contentStart );
+    if ( length / nThreaded < PARALLEL_MIN_RANGE ) {
+        nThreaded = length / PARALLEL_MIN_RANGE;
+    }
+    if ( nThreaded < 2 ) {
+        return false;
+    }
+    const size_t step = length / nThreaded;
+
+    // ...then for the places between its children where it can be split.
+    // A threaded range ends at least 'step' bytes after it starts, and the
+    // next one starts on the first child boundary that is in a new scan
+    // block; whatever is between them is a seam. Everything after the
+    // last child is left to the serial parse.
+    struct Split {
+        char* p;
+        int lineNum;
+        bool seam;
+    };
+    DynArray< Split, 64 > splits;
+    Split split = { contentStart, lineNum, false };
+    splits.Push( split );
+    size_t threaded = 1;
+    char* next = contentStart + step;
+    char* seamEnd = 0;
+    Split last = split;
+    for( ;; ) {
+        q = const_cast<char*>( FindCharOrEnd( q, '<', &lineNum ) );
+        if ( !*q ) {
+            return false;
+        }
+        q = SkipMarkup( q, &depth, &lineNum );
+        if ( !q ) {
+            return false;
+        }
+        if ( depth == 0 ) {
+            break;      // the end tag of the root
+        }
+        if ( depth != 1 ) {
+            continue;
+        }
+        last.p = q;
+        last.lineNum = lineNum;
+        if ( !seamEnd && q >= next && threaded < nThreaded ) {
+            seamEnd = q + ( SCAN_BLOCK - reinterpret_cast<uintptr_t>( q ) % SCAN_BLOCK ) % SCAN_BLOCK;
+            if ( q < seamEnd ) {
+                split.p = q;
+                split.lineNum = lineNum;
+                split.seam = true;
+                splits.Push( split );
+            }
+        }
+        if ( seamEnd && q >= seamEnd ) {
+            split.p = q;
+            split.lineNum = lineNum;
+            split.seam = false;
+            splits.Push( split );
+            ++threaded;
+            seamEnd = 0;
+            next = q + step;
+        }
+    }
+    while ( !splits.Empty() && splits.PeekTop().p == last.p ) {
+        if ( !splits.Pop().seam ) {
+            --threaded;
+        }
+    }
+    if ( threaded < 2 ) {
+        return false;
+    }
 
-void XMLPrinter::PrintString( const char* p, bool restricted )
-{
-    // Look for runs of bytes between entities to print.
-    const char* q = p;
+    // Parse up to the content of the root here; the root is left open.
+    XMLNode* open = 0;
+    _parseEnd = contentStart;
+    ParseNodes( p, &_parseCurLineNum, &open );
+    _parseEnd = 0;
+    if ( Error() ) {
+        return true;
+    }
+    TIXMLASSERT( open && open->ToElement() && open->_parent == this );
+    XMLElement* const root = open->ToElement();
+
+    const size_t nRanges = splits.Size();
+    ParallelRange* ranges = new ParallelRange[nRanges];
+    for( size_t i = 0; i < nRanges; ++i ) {
+        ParallelRange& range = ranges[i];
+        range.target = this;
+        range.root = root;
+        range.start = splits[i].p;
+        range.end = ( i + 1 < nRanges ) ? splits[i + 1].p : last.p;
+        range.lineNum = splits[i].lineNum;
+        range.seam = splits[i].seam;
+        if ( range.seam ) {
+            range.doc = this;
+        }
+        else {
+            range.doc = new XMLDocument( _processEntities, _whitespaceMode );
+            range.doc->_maxElementDepth = _maxElementDepth;
+        }
+    }
+    for( size_t i = 1; i < nRanges; ++i ) {
+        if ( !ranges[i].seam ) {
+            ranges[i].Start();
+            if ( !ranges[i].started ) {
+                ranges[i].doc->ParseRange( &ranges[i] );
+            }
+        }
+    }
+    ranges[0].doc->ParseRange( &ranges[0] );
+    for( size_t i = 1; i < nRanges; ++i ) {
+        if ( ranges[i].started ) {
+            ranges[i].Join();
+        }
+    }
 
-    if ( _processEntities ) {
-        const bool* flag = restricted ? _restrictedEntityFlag : _entityFlag;
-        while ( *q ) {
-            TIXMLASSERT( p <= q );
-            // Remember, char is sometimes signed. (How many times has that bitten me?)
-            if ( *q > 0 && *q < ENTITY_RANGE ) {
-                // Check for entities. If one is found, flush
-                // the stream up until the entity, write the
-                // entity, and keep looking.
-                if ( flag[static_cast<unsigned char>(*q)] ) {
-                    while ( p < q ) {
-                        const size_t delta = q - p;
-                        const int toPrint = ( INT_MAX < delta ) ? INT_MAX : static_cast<int>(delta);
-                        Write( p, toPrint );
-                        p += toPrint;
-                    }
-                    bool entityPatternPrinted = false;
-                    for( int i=0; i<NUM_ENTITIES; ++i ) {
-                        if ( entities[i].value == *q ) {
-                            Putc( '&' );
-                            Write( entities[i].pattern, entities[i].length );
-                            Putc( ';' );
-                            entityPatternPrinted = true;
-                            break;
-                        }
-                    }
-                    if ( !entityPatternPrinted ) {
-                        // TIXMLASSERT( entityPatternPrinted ) causes gcc -Wunused-but-set-variable in release
-                        TIXMLASSERT( false );
-                    }
-                    ++p;
-                }
+    // Join the ranges up in order, parsing the seams as they come. The
+    // first error is the one the serial parse would have stopped at.
+    // Ranges that failed delete their own nodes; the rest are joined
+    // up even after an error, to be deleted with the root.
+    for( size_t i = 0; i < nRanges; ++i ) {
+        ParallelRange& range = ranges[i];
+        if ( range.seam && !Error() ) {
+            ParseRange( &range );
+        }
+        if ( range.doc->Error() ) {
+            if ( !Error() ) {
+                _errorID = range.doc->_errorID;
+                _errorLineNum = range.doc->_errorLineNum;
+                _errorStr.SetStr( range.doc->ErrorStr(), 0, _allocator );
             }
-            ++q;
-            TIXMLASSERT( p <= q );
+            continue;
         }
-        // Flush the remaining string. This will be the entire
-        // string if an entity wasn't found.
-        if ( p < q ) {
-            const size_t delta = q - p;
-            const int toPrint = ( INT_MAX < delta ) ? INT_MAX : static_cast<int>(delta);
-            Write( p, toPrint );
+        if ( range.first ) {
+            if ( root->_lastChild ) {
+                root->_lastChild->_next = range.first;
+                range.first->_prev = root->_lastChild;
+            }
+            else {
+                root->_firstChild = range.first;
+            }
+            root->_lastChild = range.last;
+        }
+        if ( range.doc != this ) {
+            _elementPool.Splice( range.doc->_elementPool );
+            _attributePool.Splice( range.doc->_attributePool );
+            _textPool.Splice( range.doc->_textPool );
+            _commentPool.Splice( range.doc->_commentPool );
         }
     }
-    else {
-        Write( p );
+    delete [] ranges;
+    if ( Error() ) {
+        // Like the serial parse, drop the unfinished root.
+        DeleteChild( root );
+        PopDepth();
+        PopDepth();
+        return true;
     }
+
+    // The end of the root, and anything after it, is parsed here too.
+    _parseCurLineNum = last.lineNum;
+    ParseNodes( last.p, &_parseCurLineNum, &open );
+    return true;
 }
 
 
-void XMLPrinter::PushHeader( bool writeBOM, bool writeDec )
+void XMLDocument::ParseRange( ParallelRange* range )
 {
-    if ( writeBOM ) {
-        static const unsigned char bom[] = { TIXML_UTF_LEAD_0, TIXML_UTF_LEAD_1, TIXML_UTF_LEAD_2, 0 };
-        Write( reinterpret_cast< const char* >( bom ) );
+    // A stand-in for the root is the parent while parsing, so that the
+    // depth and context match the serial parse.
+    const int depth = _parsingDepth;
+    _parsingDepth = 1;
+    _parseCurLineNum = range->lineNum;
+    _parseEnd = range->end;
+    XMLElement* parent = CreateUnlinkedNode<XMLElement>( _elementPool );
+    parent->ParseNodes( range->start, &_parseCurLineNum, 0 );
+    _parseEnd = 0;
+    _parsingDepth = depth;
+
+    if ( !Error() ) {
+        range->first = parent->_firstChild;
+        range->last = parent->_lastChild;
+        parent->_firstChild = 0;
+        parent->_lastChild = 0;
+        for( XMLNode* node = range->first; node; node = node->_next ) {
+            node->_parent = range->root;
+        }
+        if ( range->target != this ) {
+            MoveNodesTo( range->first, range->target );
+        }
     }
-    if ( writeDec ) {
-        PushDeclaration( "xml version=\"1.0\"" );
+    DeleteNode( parent );
+}
+
+
+void XMLDocument::MoveNodesTo( XMLNode* node, XMLDocument* target )
+{
+    // Points 'node', its siblings, and all their descendants at 'target',
+    // which is about to take over the pools they were allocated from.
+    if ( !node ) {
+        return;
+    }
+    XMLNode* const stop = node->_parent;
+    for( ;; ) {
+        node->_document = target;
+        if ( node->_memPool == &_elementPool ) {
+            node->_memPool = &target->_elementPool;
+            for( XMLAttribute* a = static_cast<XMLElement*>( node )->_rootAttribute; a; a = a->_next ) {
+                a->_memPool = &target->_attributePool;
+            }
+        }
+        else if ( node->_memPool == &_textPool ) {
+            node->_memPool = &target->_textPool;
+        }
+        else {
+            TIXMLASSERT( node->_memPool == &_commentPool );
+            node->_memPool = &target->_commentPool;
+        }
+
+        if ( node->_firstChild ) {
+            node = node->_firstChild;
+            continue;
+        }
+        while ( !node->_next ) {
+            node = node->_parent;
+            if ( node == stop ) {
+                return;
+            }
+        }
+        node = node->_next;
     }
 }
 
-void XMLPrinter::PrepareForNewNode( bool compactMode )
+
+// --------- Pipelined loading ----------- //
+
+// The first chunk is small, so that the parse starts soon; later ones
+// grow, so that there are fewer hand-offs.
+static const size_t PIPELINE_FIRST_CHUNK = 64 * 1024;
+static const size_t PIPELINE_MAX_CHUNK = 4 * 1024 * 1024;
+
+/*
+	Reads a file into a buffer, a chunk at a time, on a thread of its own.
+	After each chunk, it steps over the markup that has fully arrived, and
+	publishes, under the lock, where the last of it ends: a node always
+	starts there. The parse can read everything before that point while
+	later bytes are being written.
+
+	The parse looks at the byte it stops on, and the vector scanners read
+	the whole aligned SCAN_BLOCK that a byte is in. So the boundary is
+	kept before the last block boundary of what has been read: nothing
+	the parse reads is still being written.
+*/
+class PipelinedReader
 {
-    SealElementIfJustOpened();
+public:
+    PipelinedReader( FILE* fp, char* buffer, size_t size ) :
+        _fp( fp ), _buffer( buffer ), _size( size ), _boundary( 0 ),
+        _done( false ), _failed( false ), _stop( false ), _started( false )
+    {
+#if defined(TIXML_WIN32_THREADS)
+        InitializeCriticalSection( &_lock );
+        InitializeConditionVariable( &_cond );
+#else
+        pthread_mutex_init( &_lock, 0 );
+        pthread_cond_init( &_cond, 0 );
+#endif
+    }
 
-    if ( compactMode ) {
-        return;
+    ~PipelinedReader() {
+        Stop();
+#if defined(TIXML_WIN32_THREADS)
+        DeleteCriticalSection( &_lock );
+#else
+        pthread_cond_destroy( &_cond );
+        pthread_mutex_destroy( &_lock );
+#endif
     }
 
-    if ( _firstElement ) {
-        PrintSpace (_depth);
-    } else if ( _textDepth < 0) {
-        Putc( '\n' );
-        PrintSpace( _depth );
+    // Starts reading. If a thread can't be started, the whole file is
+    // read before this returns.
+    void Start() {
+#if defined(TIXML_WIN32_THREADS)
+        _thread = reinterpret_cast<HANDLE>( _beginthreadex( 0, 0, Run, this, 0, 0 ) );
+        _started = ( _thread != 0 );
+#else
+        _started = ( pthread_create( &_thread, 0, Run, this ) == 0 );
+#endif
+        if ( !_started ) {
+            Read();
+        }
     }
 
-    _firstElement = false;
-}
+    // Waits until there is a boundary past 'seen', or the reading is
+    // over, and returns the last boundary.
+    size_t Wait( size_t seen, bool* done ) {
+        Lock();
+        while ( _boundary <= seen && !_done ) {
+#if defined(TIXML_WIN32_THREADS)
+            SleepConditionVariableCS( &_cond, &_lock, INFINITE );
+#else
+            pthread_cond_wait( &_cond, &_lock );
+#endif
+        }
+        const size_t boundary = _boundary;
+        *done = _done;
+        Unlock();
+        return boundary;
+    }
 
-void XMLPrinter::OpenElement( const char* name, bool compactMode )
+    // Stops reading after the current chunk, and waits for the thread.
+    void Stop() {
+        if ( !_started ) {
+            return;
+        }
+        Lock();
+        _stop = true;
+        Unlock();
+#if defined(TIXML_WIN32_THREADS)
+        WaitForSingleObject( _thread, INFINITE );
+        CloseHandle( _thread );
+#else
+        pthread_join( _thread, 0 );
+#endif
+        _started = false;
+    }
+
+    // Only meaningful once Wait() has said the reading is done.
+    bool Failed() {
+        Lock();
+        const bool failed = _failed;
+        Unlock();
+        return failed;
+    }
+
+private:
+    PipelinedReader( const PipelinedReader& );	// not supported
+    void operator=( const PipelinedReader& );	// not supported
+
+#if defined(TIXML_WIN32_THREADS)
+    static unsigned __stdcall Run( void* arg ) {
+        static_cast<PipelinedReader*>( arg )->Read();
+        return 0;
+    }
+    void Lock()		{ EnterCriticalSection( &_lock ); }
+    void Unlock()	{ LeaveCriticalSection( &_lock ); }
+#else
+    static void* Run( void* arg ) {
+        static_cast<PipelinedReader*>( arg )->Read();
+        return 0;
+    }
+    void Lock()		{ pthread_mutex_lock( &_lock ); }
+    void Unlock()	{ pthread_mutex_unlock( &_lock ); }
+#endif
+
+    void Read() {
+        size_t at = 0;
+        size_t chunk = PIPELINE_FIRST_CHUNK;
+        bool failed = false;
+        bool stop = false;
+        const char* lexed = _buffer;
+        while ( at < _size && !failed && !stop ) {
+            const size_t want = ( _size - at < chunk ) ? _size - at : chunk;
+            const size_t read = fread( _buffer + at, 1, want, _fp );
+            at += read;
+            failed = ( read != want );
+            if ( chunk < PIPELINE_MAX_CHUNK ) {
+                chunk *= 2;
+            }
+            // Markup that runs into the terminator hasn't all arrived. The
+            // parse doesn't read as far as 'end', and the next chunk
+            // overwrites the terminator.
+            char* const end = _buffer + at;
+            *end = 0;
+            const char* const limit = reinterpret_cast<const char*>( reinterpret_cast<uintptr_t>( end ) & ~static_cast<uintptr_t>( SCAN_BLOCK - 1 ) );
+            for( ;; ) {
+                char* const lt = static_cast<char*>( memchr( const_cast<char*>( lexed ), '<', static_cast<size_t>( end - lexed ) ) );
+                int depth = 0;
+                int newlines = 0;
+                const char* const next = lt ? SkipMarkup( lt, &depth, &newlines ) : 0;
+                if ( !next || next >= limit ) {
+                    break;
+                }
+                lexed = next;
+            }
+            Lock();
+            _boundary = static_cast<size_t>( lexed - _buffer );
+            stop = _stop;
+            _done = ( at == _size || failed || stop );
+            _failed = failed;
+#if defined(TIXML_WIN32_THREADS)
+            WakeConditionVariable( &_cond );
+#else
+            pthread_cond_signal( &_cond );
+#endif
+            Unlock();
+        }
+    }
+
+    FILE*	_fp;
+    char*	_buffer;
+    size_t	_size;
+    size_t	_boundary;
+    bool	_done;
+    bool	_failed;
+    bool	_stop;
+    bool	_started;
+#if defined(TIXML_WIN32_THREADS)
+    HANDLE				_thread;
+    CRITICAL_SECTION	_lock;
+    CONDITION_VARIABLE	_cond;
+#else
+    pthread_t		_thread;
+    pthread_mutex_t	_lock;
+    pthread_cond_t	_cond;
+#endif
+};
+
+XMLError XMLDocument::LoadFilePipelined( const char* filename )
 {
-    PrepareForNewNode( compactMode );
-    _stack.Push( name );
+    if ( !filename ) {
+        TIXMLASSERT( false );
+        SetError( XML_ERROR_FILE_COULD_NOT_BE_OPENED, 0, "filename=<null>" );
+        return _errorID;
+    }
+    if ( _lazyParse || _parseFilter || _buildLineIndex ) {
+        // These look at the whole buffer before, or while, it is parsed.
+        return LoadFile( filename );
+    }
 
-    Write ( "<" );
-    Write ( name );
+    Clear();
+    FILE* fp = callfopen( filename, "rb" );
+    if ( !fp ) {
+        SetError( XML_ERROR_FILE_NOT_FOUND, 0, "filename=%s", filename );
+        return _errorID;
+    }
+    long long length = -1;
+    if ( TIXML_FSEEK( fp, 0, SEEK_END ) == 0 ) {
+        length = TIXML_FTELL( fp );
+    }
+    if ( length <= 0 || TIXML_FSEEK( fp, 0, SEEK_SET ) != 0
+        || static_cast<unsigned long long>( length ) >= static_cast<unsigned long long>( static_cast<size_t>(-1) ) ) {
+        // Not a regular file, or nothing to overlap: LoadFile() knows
+        // what to do.
+        LoadFile( fp );
+        fclose( fp );
+        return _errorID;
+    }
+    const size_t size = static_cast<size_t>( length );
+    TIXMLASSERT( _charBuffer == 0 );
+    _charBuffer = NewCharBuffer( size );
+    if ( !_charBuffer ) {
+        fclose( fp );
+        SetError( XML_ERROR_OUT_OF_MEMORY, 0, 0 );
+        return _errorID;
+    }
+    _charBuffer[size] = 0;
+    _charBufferSize = size;
 
-    _elementJustOpened = true;
-    ++_depth;
+    PipelinedReader reader( fp, _charBuffer, size );
+    reader.Start();
+
+    // Each time the reader has a new boundary, parse up to it. The parse
+    // doesn't look past the node it is in, so it never reads what is still
+    // being written. It resumes from where it stopped, so the nodes and
+    // errors are the serial ones. Once everything has been read, the rest
+    // is parsed as usual.
+    _parseCurLineNum = 1;
+    _parseLineNum = 1;
+    char* p = 0;
+    XMLNode* open = 0;
+    bool finished = false;
+    size_t boundary = 0;
+    bool done = false;
+    while ( !finished ) {
+        boundary = reader.Wait( boundary, &done );
+        if ( done ) {
+            break;
+        }
+        if ( !p ) {
+            p = XMLUtil::SkipWhiteSpace( _charBuffer, &_parseCurLineNum );
+            p = const_cast<char*>( XMLUtil::ReadBOM( p, &_writeBOM ) );
+        }
+        _parseEnd = _charBuffer + boundary;
+        p = ParseNodes( p, &_parseCurLineNum, &open );
+        _parseEnd = 0;
+        finished = Error() || !open;
+    }
+    reader.Stop();
+    fclose( fp );
+
+    if ( reader.Failed() ) {
+        Clear();
+        SetError( XML_ERROR_FILE_READ_ERROR, 0, 0 );
+    }
+    else if ( !p ) {
+        Parse();
+    }
+    else if ( !finished ) {
+        ParseNodes( p, &_parseCurLineNum, &open );
+    }
+    return _errorID;
 }
 
+#else
 
-void XMLPrinter::PushAttribute( const char* name, const char* value )
+bool XMLDocument::ParseParallel( char* )
 {
-    TIXMLASSERT( _elementJustOpened );
-    Putc ( ' ' );
-    Write( name );
-    Write( "=\"" );
-    PrintString( value, false );
-    Putc ( '\"' );
+    return false;
+}
+
+XMLError XMLDocument::LoadFilePipelined( const char* filename )
+{
+    return LoadFile( filename );
 }
 
+#endif
 
-void XMLPrinter::PushAttribute( const char* name, int v )
+void XMLDocument::PushDepth()
 {
-    char buf[BUF_SIZE];
-    XMLUtil::ToStr( v, buf, BUF_SIZE );
-    PushAttribute( name, buf );
+	_parsingDepth++;
+	if (_parsingDepth == _maxElementDepth) {
+		SetError(XML_ELEMENT_DEPTH_EXCEEDED, _parseCurLineNum, "Element nesting is too deep." );
+	}
+}
+
+void XMLDocument::PopDepth()
+{
+	TIXMLASSERT(_parsingDepth > 0);
+	--_parsingDepth;
 }
 
+// --------- XMLArenaAllocator ----------- //
 
-void XMLPrinter::PushAttribute( const char* name, unsigned v )
+// Sizes are rounded up to this, so everything is aligned as well as the
+// start of its chunk is: as new aligns, or to this in a fixed buffer.
+static const size_t ARENA_ALIGN = 16;
+
+static size_t ArenaRound( size_t size )
 {
-    char buf[BUF_SIZE];
-    XMLUtil::ToStr( v, buf, BUF_SIZE );
-    PushAttribute( name, buf );
+    return ( size + ARENA_ALIGN - 1 ) & ~( ARENA_ALIGN - 1 );
 }
 
+// A chunk from the heap; its memory follows it.
+struct XMLArenaAllocator::Chunk
+{
+    Chunk*  next;
+    size_t  size;	// including this
+};
 
-void XMLPrinter::PushAttribute(const char* name, int64_t v)
+static const size_t ARENA_CHUNK_HEADER = ( sizeof( void* ) + sizeof( size_t ) + ARENA_ALIGN - 1 ) & ~( ARENA_ALIGN - 1 );
+
+
+XMLArenaAllocator::XMLArenaAllocator( size_t chunkSize, XMLAllocator* upstream ) :
+    _upstream( upstream ),
+    _chunks( 0 ),
+    _next( 0 ),
+    _end( 0 ),
+    _buffer( 0 ),
+    _bufferSize( 0 ),
+    _chunkSize( chunkSize < 1024 ? 1024 : chunkSize ),
+    _used( 0 )
 {
-	char buf[BUF_SIZE];
-	XMLUtil::ToStr(v, buf, BUF_SIZE);
-	PushAttribute(name, buf);
 }
 
 
-void XMLPrinter::PushAttribute(const char* name, uint64_t v)
+XMLArenaAllocator::XMLArenaAllocator( void* buffer, size_t size ) :
+    _upstream( 0 ),
+    _chunks( 0 ),
+    _next( 0 ),
+    _end( 0 ),
+    _buffer( static_cast<char*>( buffer ) ),
+    _bufferSize( size ),
+    _chunkSize( 0 ),
+    _used( 0 )
 {
-	char buf[BUF_SIZE];
-	XMLUtil::ToStr(v, buf, BUF_SIZE);
-	PushAttribute(name, buf);
+    Reset();
+}
+
+
+XMLArenaAllocator::~XMLArenaAllocator()
+{
+    SetUpstream( 0 );
+}
+
+
+void XMLArenaAllocator::FreeChunk( Chunk* chunk )
+{
+    if ( _upstream ) {
+        _upstream->Free( chunk, chunk->size );
+    }
+    else {
+        delete [] reinterpret_cast<char*>( chunk );
+    }
+}
+
+
+void XMLArenaAllocator::SetUpstream( XMLAllocator* upstream )
+{
+    while( _chunks ) {
+        Chunk* next = _chunks->next;
+        FreeChunk( _chunks );
+        _chunks = next;
+    }
+    _upstream = upstream;
+    Reset();
+}
+
+
+void* XMLArenaAllocator::Allocate( size_t size )
+{
+    if ( size > static_cast<size_t>(-1) / 2 ) {
+        return 0;
+    }
+    size = ArenaRound( size ? size : 1 );
+    if ( static_cast<size_t>( _end - _next ) < size ) {
+        if ( _buffer ) {
+            return 0;
+        }
+        // Big requests get a chunk of their own, so the current chunk
+        // isn't abandoned.
+        const bool own = size > ( _chunkSize - ARENA_CHUNK_HEADER ) / 2;
+        const size_t chunkSize = own ? ARENA_CHUNK_HEADER + size : _chunkSize;
+        char* mem = _upstream ? static_cast<char*>( _upstream->Allocate( chunkSize ) ) : new char[chunkSize];
+        if ( !mem ) {
+            return 0;
+        }
+        Chunk* chunk = reinterpret_cast<Chunk*>( mem );
+        chunk->size = chunkSize;
+        _used += size;
+        if ( own ) {
+            // Behind the current chunk, which stays current.
+            if ( _chunks ) {
+                chunk->next = _chunks->next;
+                _chunks->next = chunk;
+            }
+            else {
+                chunk->next = 0;
+                _chunks = chunk;
+            }
+            return mem + ARENA_CHUNK_HEADER;
+        }
+        chunk->next = _chunks;
+        _chunks = chunk;
+        _next = mem + ARENA_CHUNK_HEADER;
+        _end = mem + chunkSize;
+    }
+    else {
+        _used += size;
+    }
+    void* result = _next;
+    _next += size;
+    return result;
+}
+
+
+void XMLArenaAllocator::Reset()
+{
+    _used = 0;
+    if ( _buffer ) {
+        const uintptr_t at = reinterpret_cast<uintptr_t>( _buffer );
+        const size_t skip = static_cast<size_t>( ArenaRound( at ) - at );
+        _next = _buffer + ( skip < _bufferSize ? skip : _bufferSize );
+        _end = _buffer + _bufferSize;
+        return;
+    }
+    // Keep one chunk of the usual size, to start over in.
+    Chunk* keep = 0;
+    while( _chunks ) {
+        Chunk* next = _chunks->next;
+        if ( !keep && _chunks->size == _chunkSize ) {
+            keep = _chunks;
+            keep->next = 0;
+        }
+        else {
+            FreeChunk( _chunks );
+        }
+        _chunks = next;
+    }
+    _chunks = keep;
+    _next = keep ? reinterpret_cast<char*>( keep ) + ARENA_CHUNK_HEADER : 0;
+    _end = keep ? reinterpret_cast<char*>( keep ) + keep->size : 0;
+}
+
+
+// --------- XMLDocumentPool ----------- //
+
+XMLDocumentPool::XMLDocumentPool( size_t recycleBytes, int maxIdle ) :
+    _idle(),
+    _recycleBytes( recycleBytes ),
+    _maxIdle( maxIdle )
+{
+}
+
+
+XMLDocumentPool::~XMLDocumentPool()
+{
+    while( !_idle.Empty() ) {
+        delete _idle.Pop();
+    }
+}
+
+
+XMLDocument* XMLDocumentPool::Acquire()
+{
+    if ( !_idle.Empty() ) {
+        return _idle.Pop();
+    }
+    XMLDocument* doc = new XMLDocument();
+    doc->SetRecycleMemory( _recycleBytes );
+    return doc;
+}
+
+
+void XMLDocumentPool::Release( XMLDocument* doc )
+{
+    if ( !doc ) {
+        return;
+    }
+    if ( static_cast<int>( _idle.Size() ) >= _maxIdle ) {
+        delete doc;
+        return;
+    }
+    // Back to the settings of a new document: the filter or allocator
+    // the last user set may be gone before the next one acquires it.
+    doc->SetParseFilter( 0 );
+    if ( doc->Allocator() ) {
+        doc->SetAllocator( 0 );
+    }
+    if ( doc->InternNames() ) {
+        doc->SetInternNames( false );
+    }
+    doc->SetStringArena( false );
+    doc->SetLazyParse( false );
+    doc->SetLineIndex( false );
+    doc->SetParseThreads( 1 );
+    doc->SetMaxElementDepth( TINYXML2_MAX_ELEMENT_DEPTH );
+    doc->SetRecycleMemory( _recycleBytes );
+    doc->SetBOM( false );
+    doc->Clear();
+    _idle.Push( doc );
+}
+
+
+XMLDocumentPool& XMLDocumentPool::ForThread()
+{
+    static thread_local XMLDocumentPool pool;
+    return pool;
+}
+
+// --------- XMLCompactDocument ----------- //
+
+XMLCompactDocument::XMLCompactDocument() :
+    _memory( 0 ),
+    _memorySize( 0 ),
+    _mapping( 0 ),
+    _mappingSize( 0 ),
+    _nodes( 0 ),
+    _nodeCount( 0 ),
+    _attributes( 0 ),
+    _names( 0 ),
+    _nameTableSize( 0 ),
+    _strings( 0 ),
+    _stringsSize( 0 ),
+    _processEntities( true ),
+    _writeBOM( false )
+{
+}
+
+
+XMLCompactDocument::~XMLCompactDocument()
+{
+    Clear();
+}
+
+
+void XMLCompactDocument::Clear()
+{
+    delete [] _memory;
+    _memory = 0;
+    _memorySize = 0;
+#ifdef TIXML_MMAP
+    if ( _mapping ) {
+        munmap( _mapping, _mappingSize );
+    }
+#endif
+    _mapping = 0;
+    _mappingSize = 0;
+    _nodes = 0;
+    _nodeCount = 0;
+    _attributes = 0;
+    _names = 0;
+    _nameTableSize = 0;
+    _strings = 0;
+    _stringsSize = 0;
+}
+
+
+// Appends 'str' to 'strings', and returns its offset; NONE if the
+// offset wouldn't fit.
+static uint32_t CompactString( DynArray<char, 1024>* strings, const char* str )
+{
+    const size_t length = strlen( str );
+    const size_t offset = strings->Size();
+    if ( offset + length + 1 >= XMLCompactDocument::NONE ) {
+        return XMLCompactDocument::NONE;
+    }
+    memcpy( strings->PushArr( length + 1 ), str, length + 1 );
+    return static_cast<uint32_t>( offset );
+}
+
+
+// Like CompactString(), but names are kept once, with 'names' as the
+// set of them.
+static uint32_t CompactName( DynArray<char, 1024>* strings, DynArray<uint32_t, 64>* names, uint32_t* nameCount, const char* name )
+{
+    const size_t length = strlen( name );
+    const OffsetSlots slots = { strings->Mem() };
+    GrowTable( names, *nameCount, slots );
+    const size_t at = FindSlot( names->Mem(), names->Size(), name, length, slots );
+    if ( (*names)[at] != XMLCompactDocument::NONE ) {
+        return (*names)[at];
+    }
+    const uint32_t offset = CompactString( strings, name );
+    if ( offset != XMLCompactDocument::NONE ) {
+        (*names)[at] = offset;
+        ++*nameCount;
+    }
+    return offset;
+}
+
+
+XMLError XMLCompactDocument::Build( const XMLDocument& doc )
+{
+    Clear();
+    DynArray<NodeEntry, 64> nodes;
+    DynArray<AttributeEntry, 64> attributes;
+    DynArray<char, 1024> strings;
+    DynArray<uint32_t, 64> names;
+    uint32_t nameCount = 0;
+    strings.Push( 0 );	// offset 0 is the empty string
+
+    // In document order, without recursion. 'last' is the node last
+    // added at each depth, whose next sibling is the node after it.
+    DynArray<uint32_t, 32> last;
+    last.Push( NONE );
+    uint32_t parent = NONE;
+    const XMLNode* node = doc.FirstChild();
+    while( node ) {
+        if ( nodes.Size() >= NONE - 1 || attributes.Size() >= NONE ) {
+            return XML_ERROR_OUT_OF_MEMORY;
+        }
+        NodeEntry entry;
+        entry.parent = parent;
+        entry.next = NONE;
+        entry.firstAttribute = static_cast<uint32_t>( attributes.Size() );
+        entry.lineNum = node->GetLineNum();
+        if ( const XMLElement* element = node->ToElement() ) {
+            entry.type = ELEMENT;
+            entry.value = CompactName( &strings, &names, &nameCount, element->Name() );
+            for( const XMLAttribute* a = element->FirstAttribute(); a; a = a->Next() ) {
+                AttributeEntry attribute;
+                attribute.name = CompactName( &strings, &names, &nameCount, a->Name() );
+                attribute.value = CompactString( &strings, a->Value() );
+                if ( attribute.name == NONE || attribute.value == NONE ) {
+                    return XML_ERROR_OUT_OF_MEMORY;
+                }
+                attributes.Push( attribute );
+            }
+        }
+        else {
+            const XMLText* text = node->ToText();
+            entry.type = text ? ( text->CData() ? TEXT | CDATA : TEXT )
+                       : node->ToComment() ? COMMENT
+                       : node->ToDeclaration() ? DECLARATION : UNKNOWN;
+            entry.value = CompactString( &strings, node->Value() );
+        }
+        if ( entry.value == NONE ) {
+            return XML_ERROR_OUT_OF_MEMORY;
+        }
+        const uint32_t index = static_cast<uint32_t>( nodes.Size() );
+        nodes.Push( entry );
+        if ( last.PeekTop() != NONE ) {
+            nodes[last.PeekTop()].next = index;
+        }
+        last[last.Size() - 1] = index;
+
+        if ( node->FirstChild() ) {
+            parent = index;
+            last.Push( NONE );
+            node = node->FirstChild();
+            continue;
+        }
+        while( node && !node->NextSibling() ) {
+            node = node->Parent();
+            if ( node == &doc ) {
+                node = 0;
+            }
+            else {
+                last.Pop();
+                parent = nodes[parent].parent;
+            }
+        }
+        if ( node ) {
+            node = node->NextSibling();
+        }
+    }
+    // One past the end, for the attribute count of the last node.
+    NodeEntry end = { 0, NONE, NONE, static_cast<uint32_t>( attributes.Size() ), 0, 0 };
+    nodes.Push( end );
+
+    // All of it in one block, without the slack of the arrays.
+    const size_t nodeBytes = nodes.Size() * sizeof( NodeEntry );
+    const size_t attributeBytes = attributes.Size() * sizeof( AttributeEntry );
+    const size_t nameBytes = names.Size() * sizeof( uint32_t );
+    _memorySize = nodeBytes + attributeBytes + nameBytes + strings.Size();
+    _memory = new char[_memorySize];
+    char* p = _memory;
+    memcpy( p, nodes.Mem(), nodeBytes );
+    _nodes = reinterpret_cast<const NodeEntry*>( p );
+    p += nodeBytes;
+    if ( attributeBytes ) {
+        memcpy( p, attributes.Mem(), attributeBytes );
+    }
+    _attributes = reinterpret_cast<const AttributeEntry*>( p );
+    p += attributeBytes;
+    if ( nameBytes ) {
+        memcpy( p, names.Mem(), nameBytes );
+    }
+    _names = reinterpret_cast<const uint32_t*>( p );
+    p += nameBytes;
+    memcpy( p, strings.Mem(), strings.Size() );
+    _strings = p;
+    _stringsSize = static_cast<uint32_t>( strings.Size() );
+
+    _nodeCount = static_cast<uint32_t>( nodes.Size() - 1 );
+    _nameTableSize = static_cast<uint32_t>( names.Size() );
+    _processEntities = doc.ProcessEntities();
+    _writeBOM = doc.HasBOM();
+    return XML_SUCCESS;
+}
+
+
+// The header of a snapshot file. The tables follow it, as they are in
+// memory: the nodes (and the one past the end), the attributes, the
+// name table and the strings. The header keeps them aligned to 4 bytes.
+struct SnapshotHeader
+{
+    char     magic[8];
+    uint32_t byteOrder;			// SNAPSHOT_BYTE_ORDER, as the saving machine stores it
+    uint32_t version;
+    uint32_t nodeCount;
+    uint32_t attributeCount;
+    uint32_t nameTableSize;
+    uint32_t stringsSize;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+static const char SNAPSHOT_MAGIC[8] = { 'T', 'X', 'M', 'L', 'S', 'N', 'A', 'P' };
+static const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+static const uint32_t SNAPSHOT_VERSION = 1;
+static const uint32_t SNAPSHOT_PROCESS_ENTITIES = 0x1;
+static const uint32_t SNAPSHOT_BOM = 0x2;
+
+
+XMLError XMLCompactDocument::SaveSnapshot( const char* filename ) const
+{
+    if ( !filename ) {
+        TIXMLASSERT( false );
+        return XML_ERROR_FILE_COULD_NOT_BE_OPENED;
+    }
+    FILE* fp = callfopen( filename, "wb" );
+    if ( !fp ) {
+        return XML_ERROR_FILE_COULD_NOT_BE_OPENED;
+    }
+    const XMLError error = SaveSnapshot( fp );
+    if ( fclose( fp ) != 0 && error == XML_SUCCESS ) {
+        return XML_ERROR_FILE_COULD_NOT_BE_OPENED;
+    }
+    return error;
+}
+
+
+XMLError XMLCompactDocument::SaveSnapshot( FILE* fp ) const
+{
+    // An empty copy is saved as the copy of an empty document.
+    static const NodeEntry emptyEnd = { 0, NONE, NONE, 0, 0, 0 };
+    static const char emptyString = 0;
+    const NodeEntry* nodes = _nodes ? _nodes : &emptyEnd;
+    const char* strings = _strings ? _strings : &emptyString;
+    const uint32_t stringsSize = _strings ? _stringsSize : 1;
+
+    SnapshotHeader header;
+    memcpy( header.magic, SNAPSHOT_MAGIC, sizeof( header.magic ) );
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.version = SNAPSHOT_VERSION;
+    header.nodeCount = _nodeCount;
+    header.attributeCount = nodes[_nodeCount].firstAttribute;
+    header.nameTableSize = _nameTableSize;
+    header.stringsSize = stringsSize;
+    header.flags = ( _processEntities ? SNAPSHOT_PROCESS_ENTITIES : 0 ) | ( _writeBOM ? SNAPSHOT_BOM : 0 );
+    header.reserved = 0;
+
+    if (    fwrite( &header, sizeof( header ), 1, fp ) != 1
+         || fwrite( nodes, sizeof( NodeEntry ), _nodeCount + 1, fp ) != _nodeCount + 1
+         || ( header.attributeCount && fwrite( _attributes, sizeof( AttributeEntry ), header.attributeCount, fp ) != header.attributeCount )
+         || ( _nameTableSize && fwrite( _names, sizeof( uint32_t ), _nameTableSize, fp ) != _nameTableSize )
+         || fwrite( strings, 1, stringsSize, fp ) != stringsSize ) {
+        return XML_ERROR_FILE_COULD_NOT_BE_OPENED;
+    }
+    return XML_SUCCESS;
+}
+
+
+// A snapshot or an index file in memory: mapped, where that is
+// supported and the file can be, or read into a buffer from new[],
+// which is aligned for the tables, otherwise.
+struct TableFile
+{
+    char*   memory;
+    void*   mapping;
+    size_t  size;
+
+    // Fails with XML_ERROR_INVALID_SNAPSHOT for a file shorter than
+    // 'minSize', which can't be what is looked for.
+    XMLError Load( const char* filename, size_t minSize );
+    void Free();
+};
+
+
+XMLError TableFile::Load( const char* filename, size_t minSize )
+{
+    memory = 0;
+    mapping = 0;
+    size = 0;
+#ifdef TIXML_MMAP
+    const int fd = open( filename, O_RDONLY );
+    if ( fd < 0 ) {
+        return XML_ERROR_FILE_NOT_FOUND;
+    }
+    struct stat st;
+    if ( fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) ) {
+        const unsigned long long fileLength = static_cast<unsigned long long>( st.st_size );
+        if ( fileLength < minSize || fileLength >= static_cast<unsigned long long>( static_cast<size_t>(-1) / 2 ) ) {
+            close( fd );
+            return XML_ERROR_INVALID_SNAPSHOT;
+        }
+        void* mapped = mmap( 0, static_cast<size_t>( fileLength ), PROT_READ, MAP_PRIVATE, fd, 0 );
+        close( fd );
+        if ( mapped == MAP_FAILED ) {
+            return XML_ERROR_FILE_READ_ERROR;
+        }
+        mapping = mapped;
+        size = static_cast<size_t>( fileLength );
+        return XML_SUCCESS;
+    }
+    // Not something that can be mapped (a pipe, for instance.) Read it
+    // instead, from this descriptor: a FIFO can't be opened again.
+    DescriptorSource source = { fd };
+#else
+    FILE* fp = callfopen( filename, "rb" );
+    if ( !fp ) {
+        return XML_ERROR_FILE_NOT_FOUND;
+    }
+    FileSource source = { fp };
+#endif
+    size_t capacity = 0;
+    const XMLError error = ReadToEnd( source, 0, 0, &memory, &size, &capacity );
+#ifdef TIXML_MMAP
+    close( fd );
+#else
+    fclose( fp );
+#endif
+    return error;
+}
+
+
+void TableFile::Free()
+{
+    delete [] memory;
+#ifdef TIXML_MMAP
+    if ( mapping ) {
+        munmap( mapping, size );
+    }
+#endif
+    memory = 0;
+    mapping = 0;
+    size = 0;
+}
+
+
+XMLError XMLCompactDocument::LoadSnapshot( const char* filename )
+{
+    Clear();
+    if ( !filename ) {
+        TIXMLASSERT( false );
+        return XML_ERROR_FILE_COULD_NOT_BE_OPENED;
+    }
+    TableFile file;
+    XMLError error = file.Load( filename, sizeof( SnapshotHeader ) );
+    if ( error == XML_SUCCESS ) {
+        error = LoadSnapshot( file.mapping ? file.mapping : file.memory, file.size );
+    }
+    if ( error != XML_SUCCESS ) {
+        file.Free();
+        return error;
+    }
+    _memory = file.memory;
+    _mapping = file.mapping;
+    _mappingSize = file.mapping ? file.size : 0;
+    return XML_SUCCESS;
+}
+
+
+XMLError XMLCompactDocument::LoadSnapshot( const void* data, size_t size )
+{
+    Clear();
+    if ( !data || size < sizeof( SnapshotHeader ) || ( reinterpret_cast<size_t>( data ) & 3 ) != 0 ) {
+        return XML_ERROR_INVALID_SNAPSHOT;
+    }
+    SnapshotHeader header;
+    memcpy( &header, data, sizeof( header ) );
+    if (    memcmp( header.magic, SNAPSHOT_MAGIC, sizeof( header.magic ) ) != 0
+         || header.byteOrder != SNAPSHOT_BYTE_ORDER
+         || header.version != SNAPSHOT_VERSION
+         || header.nodeCount >= NONE - 1
+         || header.stringsSize == 0 ) {
+        return XML_ERROR_INVALID_SNAPSHOT;
+    }
+    // In 64 bits, so that none of it can overflow.
+    const unsigned long long nodeBytes = ( static_cast<unsigned long long>( header.nodeCount ) + 1 ) * sizeof( NodeEntry );
+    const unsigned long long attributeBytes = static_cast<unsigned long long>( header.attributeCount ) * sizeof( AttributeEntry );
+    const unsigned long long nameBytes = static_cast<unsigned long long>( header.nameTableSize ) * sizeof( uint32_t );
+    const unsigned long long tableBytes = nodeBytes + attributeBytes + nameBytes + header.stringsSize;
+    if ( tableBytes != static_cast<unsigned long long>( size - sizeof( SnapshotHeader ) ) ) {
+        return XML_ERROR_INVALID_SNAPSHOT;
+    }
+    const char* p = static_cast<const char*>( data ) + sizeof( SnapshotHeader );
+    _nodes = reinterpret_cast<const NodeEntry*>( p );
+    p += nodeBytes;
+    _attributes = reinterpret_cast<const AttributeEntry*>( p );
+    p += attributeBytes;
+    _names = reinterpret_cast<const uint32_t*>( p );
+    p += nameBytes;
+    _strings = p;
+
+    _memorySize = static_cast<size_t>( tableBytes );
+    _nodeCount = header.nodeCount;
+    _nameTableSize = header.nameTableSize;
+    _stringsSize = header.stringsSize;
+    _processEntities = ( header.flags & SNAPSHOT_PROCESS_ENTITIES ) != 0;
+    _writeBOM = ( header.flags & SNAPSHOT_BOM ) != 0;
+    if ( !Verify( header.attributeCount ) ) {
+        Clear();
+        return XML_ERROR_INVALID_SNAPSHOT;
+    }
+    return XML_SUCCESS;
+}
+
+
+bool XMLCompactDocument::Verify( uint32_t attributeCount ) const
+{
+    // Every string ends inside the block, and offset 0 is "".
+    if ( _strings[0] != 0 || _strings[_stringsSize - 1] != 0 ) {
+        return false;
+    }
+    // The lookups stop at an empty slot, so there has to be one.
+    if ( _nameTableSize & ( _nameTableSize - 1 ) ) {
+        return false;
+    }
+    bool emptySlot = ( _nameTableSize == 0 );
+    for( uint32_t i = 0; i < _nameTableSize; ++i ) {
+        if ( _names[i] == NONE ) {
+            emptySlot = true;
+        }
+        else if ( _names[i] >= _stringsSize ) {
+            return false;
+        }
+    }
+    if ( !emptySlot ) {
+        return false;
+    }
+    for( uint32_t i = 0; i < attributeCount; ++i ) {
+        if ( _attributes[i].name >= _stringsSize || _attributes[i].value >= _stringsSize ) {
+            return false;
+        }
+    }
+    if ( _nodes[_nodeCount].firstAttribute != attributeCount ) {
+        return false;
+    }
+
+    // Walk the nodes as Build() wrote them: each one's parent is the node
+    // before it or one of that node's ancestors, and each one is the next
+    // sibling of the node last seen under the same parent. 'path' is the
+    // ancestors of the node, with 'last' the last child seen of each.
+    DynArray<uint32_t, 32> path;
+    DynArray<uint32_t, 32> last;
+    path.Push( NONE );
+    last.Push( NONE );
+    for( uint32_t i = 0; i < _nodeCount; ++i ) {
+        const NodeEntry& node = _nodes[i];
+        if (    node.value >= _stringsSize
+             || ( node.type & TYPE_MASK ) > UNKNOWN
+             || node.firstAttribute > _nodes[i + 1].firstAttribute
+             || ( ( node.type & TYPE_MASK ) != ELEMENT && node.firstAttribute != _nodes[i + 1].firstAttribute ) ) {
+            return false;
+        }
+        if ( i > 0 && node.parent == i - 1 ) {
+            if ( ( _nodes[i - 1].type & TYPE_MASK ) != ELEMENT ) {
+                return false;
+            }
+            path.Push( i - 1 );
+            last.Push( NONE );
+        }
+        else {
+            while( path.PeekTop() != node.parent ) {
+                if ( path.Size() == 1 || _nodes[last.PeekTop()].next != NONE ) {
+                    return false;
+                }
+                path.Pop();
+                last.Pop();
+            }
+        }
+        if ( last.PeekTop() != NONE && _nodes[last.PeekTop()].next != i ) {
+            return false;
+        }
+        last[last.Size() - 1] = i;
+    }
+    for( size_t i = 0; i < last.Size(); ++i ) {
+        if ( last[i] != NONE && _nodes[last[i]].next != NONE ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+uint32_t XMLCompactDocument::FindName( const char* name ) const
+{
+    if ( _nameTableSize == 0 ) {
+        return NONE;
+    }
+    const OffsetSlots slots = { _strings };
+    return _names[FindSlot( _names, _nameTableSize, name, strlen( name ), slots )];
+}
+
+
+uint32_t XMLCompactDocument::FirstChildElement( uint32_t node, const char* name ) const
+{
+    // Names are kept once, so they compare by offset.
+    const uint32_t key = name ? FindName( name ) : NONE;
+    if ( name && key == NONE ) {
+        return NONE;
+    }
+    for( uint32_t child = FirstChild( node ); child != NONE; child = _nodes[child].next ) {
+        if ( ( _nodes[child].type & TYPE_MASK ) == ELEMENT && ( !name || _nodes[child].value == key ) ) {
+            return child;
+        }
+    }
+    return NONE;
+}
+
+
+uint32_t XMLCompactDocument::NextSiblingElement( uint32_t node, const char* name ) const
+{
+    const uint32_t key = name ? FindName( name ) : NONE;
+    if ( name && key == NONE ) {
+        return NONE;
+    }
+    for( uint32_t sibling = Node( node ).next; sibling != NONE; sibling = _nodes[sibling].next ) {
+        if ( ( _nodes[sibling].type & TYPE_MASK ) == ELEMENT && ( !name || _nodes[sibling].value == key ) ) {
+            return sibling;
+        }
+    }
+    return NONE;
+}
+
+
+const char* XMLCompactDocument::GetText( uint32_t element ) const
+{
+    const uint32_t child = FirstChild( element );
+    if ( child != NONE && Type( child ) == TEXT ) {
+        return Value( child );
+    }
+    return 0;
+}
+
+
+const char* XMLCompactDocument::Attribute( uint32_t element, const char* name ) const
+{
+    const uint32_t key = FindName( name );
+    if ( key == NONE ) {
+        return 0;
+    }
+    const uint32_t end = _nodes[element + 1].firstAttribute;
+    for( uint32_t i = Node( element ).firstAttribute; i < end; ++i ) {
+        if ( _attributes[i].name == key ) {
+            return _strings + _attributes[i].value;
+        }
+    }
+    return 0;
+}
+
+
+void XMLCompactDocument::Print( XMLPrinter* streamer ) const
+{
+    XMLPrinter stdoutStreamer( stdout );
+    XMLPrinter* printer = streamer ? streamer : &stdoutStreamer;
+    // What XMLPrinter::VisitEnter() does for a document. Compact mode is
+    // that of the printer, for all the elements.
+    printer->_processEntities = _processEntities;
+    if ( _writeBOM ) {
+        printer->PushHeader( true, false );
+    }
+    const bool compactMode = printer->_compactMode;
+
+    uint32_t node = _nodeCount ? 0 : NONE;
+    while( node != NONE ) {
+        switch( Type( node ) ) {
+            case ELEMENT:
+                printer->OpenElement( Value( node ), compactMode );
+                for( uint32_t i = 0; i < AttributeCount( node ); ++i ) {
+                    printer->PushAttribute( AttributeName( node, i ), AttributeValue( node, i ) );
+                }
+                break;
+            case TEXT:			printer->PushText( Value( node ), CData( node ) );	break;
+            case COMMENT:		printer->PushComment( Value( node ) );				break;
+            case DECLARATION:	printer->PushDeclaration( Value( node ) );			break;
+            default:			printer->PushUnknown( Value( node ) );				break;
+        }
+        const uint32_t child = FirstChild( node );
+        if ( child != NONE ) {
+            node = child;
+            continue;
+        }
+        // Close what ends here, up to the first node with a next sibling.
+        for( ;; ) {
+            if ( Type( node ) == ELEMENT ) {
+                printer->CloseElement( compactMode );
+            }
+            if ( _nodes[node].next != NONE ) {
+                node = _nodes[node].next;
+                break;
+            }
+            node = _nodes[node].parent;
+            if ( node == NONE ) {
+                break;
+            }
+        }
+    }
+}
+
+
+// --------- XMLPathFilter ----------- //
+
+XMLPathFilter::XMLPathFilter() :
+    _paths(),
+    _pathStart(),
+    _found(),
+    _keepComments( true ),
+    _stopWhenFound( false )
+{
+}
+
+
+void XMLPathFilter::AddPath( const char* path )
+{
+    TIXMLASSERT( path );
+    if ( *path == '/' ) {
+        ++path;
+    }
+    const int length = static_cast<int>( strlen( path ) );
+    _pathStart.Push( static_cast<int>( _paths.Size() ) );
+    memcpy( _paths.PushArr( length + 1 ), path, length + 1 );
+    _found.Push( false );
+}
+
+
+enum {
+    PATH_NONE,      // not on the path
+    PATH_ABOVE,     // an ancestor of the elements on the path
+    PATH_AT,        // on the path
+    PATH_BELOW      // a descendant of an element on the path
+};
+
+// Where 'element' is, relative to 'path'.
+static int PathRelation( const XMLElement& element, const char* path )
+{
+    int depth = 0;
+    for( const XMLNode* node = &element; node && node->ToElement(); node = node->Parent() ) {
+        ++depth;
+    }
+    int steps = 1;
+    for( const char* q = path; *q; ++q ) {
+        if ( *q == '/' ) {
+            ++steps;
+        }
+    }
+
+    // Compare the names from the deepest one that is on both, back up
+    // to the root.
+    const XMLNode* node = &element;
+    for( int i = depth; i > steps; --i ) {
+        node = node->Parent();
+    }
+    const int level = depth < steps ? depth : steps;
+    const char* end = path;
+    for( int i = 0; i < level; ++i ) {
+        if ( i > 0 ) {
+            ++end;
+        }
+        while ( *end && *end != '/' ) {
+            ++end;
+        }
+    }
+    for( int i = 0; i < level; ++i ) {
+        const char* start = end;
+        while ( start > path && start[-1] != '/' ) {
+            --start;
+        }
+        const char* name = node->Value();
+        const int length = static_cast<int>( end - start );
+        if ( !XMLUtil::StringEqual( name, start, length ) || name[length] ) {
+            return PATH_NONE;
+        }
+        node = node->Parent();
+        end = start - 1;
+    }
+    if ( depth < steps ) {
+        return PATH_ABOVE;
+    }
+    return depth == steps ? PATH_AT : PATH_BELOW;
+}
+
+
+XMLParseFilter::Action XMLPathFilter::OpenElement( const XMLElement& element )
+{
+    if ( _pathStart.Empty() ) {
+        return KEEP;
+    }
+    if ( element.Parent() && element.Parent()->ToDocument() ) {
+        // A new root: a new parse.
+        for( size_t i = 0; i < _found.Size(); ++i ) {
+            _found[i] = false;
+        }
+    }
+    for( size_t i = 0; i < _pathStart.Size(); ++i ) {
+        if ( PathRelation( element, &_paths[_pathStart[i]] ) != PATH_NONE ) {
+            return KEEP;
+        }
+    }
+    return SKIP;
+}
+
+
+bool XMLPathFilter::CloseElement( const XMLElement& element )
+{
+    if ( !_stopWhenFound || _pathStart.Empty() ) {
+        return true;
+    }
+    bool all = true;
+    for( size_t i = 0; i < _pathStart.Size(); ++i ) {
+        if ( !_found[i] && PathRelation( element, &_paths[_pathStart[i]] ) == PATH_AT ) {
+            _found[i] = true;
+        }
+        all = all && _found[i];
+    }
+    return !all;
+}
+
+
+bool XMLPathFilter::KeepNode( const XMLNode& node )
+{
+    if ( !_keepComments && !node.ToText() ) {
+        return false;
+    }
+    const XMLElement* parent = node.Parent() ? node.Parent()->ToElement() : 0;
+    if ( !parent || _pathStart.Empty() ) {
+        return true;
+    }
+    // In an ancestor, only the elements on the way down are kept.
+    for( size_t i = 0; i < _pathStart.Size(); ++i ) {
+        if ( PathRelation( *parent, &_paths[_pathStart[i]] ) >= PATH_AT ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+XMLPrinter::XMLPrinter( FILE* file, bool compact, int depth, EscapeAposCharsInAttributes aposInAttributes ) :
+    _elementJustOpened( false ),
+    _stack(),
+    _firstElement( true ),
+    _fp( file ),
+    _depth( depth ),
+    _textDepth( -1 ),
+    _processEntities( true ),
+    _compactMode( compact ),
+    _buffer()
+{
+    for( int i=0; i<ENTITY_RANGE; ++i ) {
+        _entityFlag[i] = false;
+        _restrictedEntityFlag[i] = false;
+    }
+    for( int i=0; i<NUM_ENTITIES; ++i ) {
+        const char entityValue = entities[i].value;
+        if ((aposInAttributes == ESCAPE_APOS_CHARS_IN_ATTRIBUTES) || (entityValue != SINGLE_QUOTE)) {
+            const unsigned char flagIndex = static_cast<unsigned char>(entityValue);
+            TIXMLASSERT( flagIndex < ENTITY_RANGE );
+            _entityFlag[flagIndex] = true;
+        }
+    }
+    _restrictedEntityFlag[static_cast<unsigned char>('&')] = true;
+    _restrictedEntityFlag[static_cast<unsigned char>('<')] = true;
+    _restrictedEntityFlag[static_cast<unsigned char>('>')] = true;	// not required, but consistency is nice
+    _buffer.Push( 0 );
+}
+
+
+void XMLPrinter::Print( const char* format, ... )
+{
+    va_list     va;
+    va_start( va, format );
+
+    if ( _fp ) {
+        vfprintf( _fp, format, va );
+    }
+    else {
+        const int len = TIXML_VSCPRINTF( format, va );
+        // Close out and re-start the va-args
+        va_end( va );
+        TIXMLASSERT( len >= 0 );
+        va_start( va, format );
+        TIXMLASSERT( _buffer.Size() > 0 && _buffer[_buffer.Size() - 1] == 0 );
+        char* p = _buffer.PushArr( len ) - 1;	// back up over the null terminator.
+		TIXML_VSNPRINTF( p, len+1, format, va );
+    }
+    va_end( va );
+}
+
+
+void XMLPrinter::Write( const char* data, size_t size )
+{
+    if ( _fp ) {
+        fwrite ( data , sizeof(char), size, _fp);
+    }
+    else {
+        char* p = _buffer.PushArr( size ) - 1;   // back up over the null terminator.
+        memcpy( p, data, size );
+        p[size] = 0;
+    }
+}
+
+
+void XMLPrinter::Putc( char ch )
+{
+    if ( _fp ) {
+        fputc ( ch, _fp);
+    }
+    else {
+        char* p = _buffer.PushArr( sizeof(char) ) - 1;   // back up over the null terminator.
+        p[0] = ch;
+        p[1] = 0;
+    }
+}
+
+
+void XMLPrinter::PrintSpace( int depth )
+{
+    for( int i=0; i<depth; ++i ) {
+        Write( "    " );
+    }
+}
+
+
+void XMLPrinter::PrintString( const char* p, bool restricted )
+{
+    // Look for runs of bytes between entities to print.
+    const char* q = p;
+
+    if ( _processEntities ) {
+        const bool* flag = restricted ? _restrictedEntityFlag : _entityFlag;
+        while ( *q ) {
+            TIXMLASSERT( p <= q );
+            // Remember, char is sometimes signed. (How many times has that bitten me?)
+            if ( *q > 0 && *q < ENTITY_RANGE ) {
+                // Check for entities. If one is found, flush
+                // the stream up until the entity, write the
+                // entity, and keep looking.
+                if ( flag[static_cast<unsigned char>(*q)] ) {
+                    while ( p < q ) {
+                        const size_t delta = q - p;
+                        const int toPrint = ( INT_MAX < delta ) ? INT_MAX : static_cast<int>(delta);
+                        Write( p, toPrint );
+                        p += toPrint;
+                    }
+                    bool entityPatternPrinted = false;
+                    for( int i=0; i<NUM_ENTITIES; ++i ) {
+                        if ( entities[i].value == *q ) {
+                            Putc( '&' );
+                            Write( entities[i].pattern, entities[i].length );
+                            Putc( ';' );
+                            entityPatternPrinted = true;
+                            break;
+                        }
+                    }
+                    if ( !entityPatternPrinted ) {
+                        // TIXMLASSERT( entityPatternPrinted ) causes gcc -Wunused-but-set-variable in release
+                        TIXMLASSERT( false );
+                    }
+                    ++p;
+                }
+            }
+            ++q;
+            TIXMLASSERT( p <= q );
+        }
+        // Flush the remaining string. This will be the entire
+        // string if an entity wasn't found.
+        if ( p < q ) {
+            const size_t delta = q - p;
+            const int toPrint = ( INT_MAX < delta ) ? INT_MAX : static_cast<int>(delta);
+            Write( p, toPrint );
+        }
+    }
+    else {
+        Write( p );
+    }
+}
+
+
+void XMLPrinter::PushHeader( bool writeBOM, bool writeDec )
+{
+    if ( writeBOM ) {
+        static const unsigned char bom[] = { TIXML_UTF_LEAD_0, TIXML_UTF_LEAD_1, TIXML_UTF_LEAD_2, 0 };
+        Write( reinterpret_cast< const char* >( bom ) );
+    }
+    if ( writeDec ) {
+        PushDeclaration( "xml version=\"1.0\"" );
+    }
+}
+
+void XMLPrinter::PrepareForNewNode( bool compactMode )
+{
+    SealElementIfJustOpened();
+
+    if ( compactMode ) {
+        return;
+    }
+
+    if ( _firstElement ) {
+        PrintSpace (_depth);
+    } else if ( _textDepth < 0) {
+        Putc( '\n' );
+        PrintSpace( _depth );
+    }
+
+    _firstElement = false;
+}
+
+void XMLPrinter::OpenElement( const char* name, bool compactMode )
+{
+    PrepareForNewNode( compactMode );
+    _stack.Push( name );
+
+    Write ( "<" );
+    Write ( name );
+
+    _elementJustOpened = true;
+    ++_depth;
+}
+
+
+void XMLPrinter::PushAttribute( const char* name, const char* value )
+{
+    TIXMLASSERT( _elementJustOpened );
+    Putc ( ' ' );
+    Write( name );
+    Write( "=\"" );
+    PrintString( value, false );
+    Putc ( '\"' );
+}
+
+
+void XMLPrinter::PushAttribute( const char* name, int v )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( v, buf, BUF_SIZE );
+    PushAttribute( name, buf );
+}
+
+
+void XMLPrinter::PushAttribute( const char* name, unsigned v )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( v, buf, BUF_SIZE );
+    PushAttribute( name, buf );
+}
+
+
+void XMLPrinter::PushAttribute(const char* name, int64_t v)
+{
+	char buf[BUF_SIZE];
+	XMLUtil::ToStr(v, buf, BUF_SIZE);
+	PushAttribute(name, buf);
+}
+
+
+void XMLPrinter::PushAttribute(const char* name, uint64_t v)
+{
+	char buf[BUF_SIZE];
+	XMLUtil::ToStr(v, buf, BUF_SIZE);
+	PushAttribute(name, buf);
+}
+
+
+void XMLPrinter::PushAttribute( const char* name, bool v )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( v, buf, BUF_SIZE );
+    PushAttribute( name, buf );
+}
+
+
+void XMLPrinter::PushAttribute( const char* name, double v )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( v, buf, BUF_SIZE );
+    PushAttribute( name, buf );
+}
+
+
+void XMLPrinter::CloseElement( bool compactMode )
+{
+    --_depth;
+    const char* name = _stack.Pop();
+
+    if ( _elementJustOpened ) {
+        Write( "/>" );
+    }
+    else {
+        if ( _textDepth < 0 && !compactMode) {
+            Putc( '\n' );
+            PrintSpace( _depth );
+        }
+        Write ( "</" );
+        Write ( name );
+        Write ( ">" );
+    }
+
+    if ( _textDepth == _depth ) {
+        _textDepth = -1;
+    }
+    if ( _depth == 0 && !compactMode) {
+        Putc( '\n' );
+    }
+    _elementJustOpened = false;
+}
+
+
+void XMLPrinter::SealElementIfJustOpened()
+{
+    if ( !_elementJustOpened ) {
+        return;
+    }
+    _elementJustOpened = false;
+    Putc( '>' );
+}
+
+
+void XMLPrinter::PushText( const char* text, bool cdata )
+{
+    _textDepth = _depth-1;
+
+    SealElementIfJustOpened();
+    if ( cdata ) {
+        Write( "<![CDATA[" );
+        Write( text );
+        Write( "]]>" );
+    }
+    else {
+        PrintString( text, true );
+    }
+}
+
+
+void XMLPrinter::PushText( int64_t value )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( value, buf, BUF_SIZE );
+    PushText( buf, false );
+}
+
+
+void XMLPrinter::PushText( uint64_t value )
+{
+	char buf[BUF_SIZE];
+	XMLUtil::ToStr(value, buf, BUF_SIZE);
+	PushText(buf, false);
+}
+
+
+void XMLPrinter::PushText( int value )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( value, buf, BUF_SIZE );
+    PushText( buf, false );
+}
+
+
+void XMLPrinter::PushText( unsigned value )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( value, buf, BUF_SIZE );
+    PushText( buf, false );
+}
+
+
+void XMLPrinter::PushText( bool value )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( value, buf, BUF_SIZE );
+    PushText( buf, false );
+}
+
+
+void XMLPrinter::PushText( float value )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( value, buf, BUF_SIZE );
+    PushText( buf, false );
+}
+
+
+void XMLPrinter::PushText( double value )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( value, buf, BUF_SIZE );
+    PushText( buf, false );
+}
+
+
+void XMLPrinter::PushComment( const char* comment )
+{
+    PrepareForNewNode( _compactMode );
+
+    Write( "<!--" );
+    Write( comment );
+    Write( "-->" );
+}
+
+
+void XMLPrinter::PushDeclaration( const char* value )
+{
+    PrepareForNewNode( _compactMode );
+
+    Write( "<?" );
+    Write( value );
+    Write( "?>" );
+}
+
+
+void XMLPrinter::PushUnknown( const char* value )
+{
+    PrepareForNewNode( _compactMode );
+
+    Write( "<!" );
+    Write( value );
+    Putc( '>' );
+}
+
+
+bool XMLPrinter::VisitEnter( const XMLDocument& doc )
+{
+    _processEntities = doc.ProcessEntities();
+    if ( doc.HasBOM() ) {
+        PushHeader( true, false );
+    }
+    return true;
+}
+
+
+bool XMLPrinter::VisitEnter( const XMLElement& element, const XMLAttribute* attribute )
+{
+    const XMLElement* parentElem = 0;
+    if ( element.Parent() ) {
+        parentElem = element.Parent()->ToElement();
+    }
+    const bool compactMode = parentElem ? CompactMode( *parentElem ) : _compactMode;
+    OpenElement( element.Name(), compactMode );
+    while ( attribute ) {
+        PushAttribute( attribute->Name(), attribute->Value() );
+        attribute = attribute->Next();
+    }
+    return true;
+}
+
+
+bool XMLPrinter::VisitExit( const XMLElement& element )
+{
+    CloseElement( CompactMode(element) );
+    return true;
+}
+
+
+bool XMLPrinter::Visit( const XMLText& text )
+{
+    PushText( text.Value(), text.CData() );
+    return true;
+}
+
+
+bool XMLPrinter::Visit( const XMLComment& comment )
+{
+    PushComment( comment.Value() );
+    return true;
+}
+
+bool XMLPrinter::Visit( const XMLDeclaration& declaration )
+{
+    PushDeclaration( declaration.Value() );
+    return true;
+}
+
+
+bool XMLPrinter::Visit( const XMLUnknown& unknown )
+{
+    PushUnknown( unknown.Value() );
+    return true;
+}
+
+
+// --------- XMLReader ----------- //
+
+XMLReader::XMLReader( bool processEntities, Whitespace whitespaceMode ) :
+    _processEntities( processEntities ),
+    _whitespaceMode( whitespaceMode ),
+    _hasBOM( false ),
+    _charBuffer( 0 ),
+    _charBufferOwned( true ),
+    _charBufferSize( 0 ),
+    _charBufferCapacity( 0 ),
+    _push( false ),
+    _finished( false ),
+    _started( false ),
+    _reading( false ),
+    _p( 0 ),
+    _restore( 0 ),
+    _token( END_DOCUMENT ),
+    _cdata( false ),
+    _first( true ),
+    _emptyElement( false ),
+    _nonDeclaration( false ),
+    _elementName( 0 ),
+    _value(),
+    _attributeIndex( 0 ),
+    _lineNum( 0 ),
+    _tokenLineNum( 0 ),
+    _tokenOffset( 0 ),
+    _consumed( 0 ),
+    _errorID( XML_SUCCESS ),
+    _errorLineNum( 0 ),
+    _rewindLineNum( 0 ),
+    _rewindFirst( false ),
+    _rewindNonDeclaration( false ),
+    _attributes(),
+    _names(),
+    _elementStack(),
+    _pending()
+{
+}
+
+
+XMLReader::~XMLReader()
+{
+    Clear();
+}
+
+
+void XMLReader::Clear()
+{
+    _value.Reset();
+    if ( _charBufferOwned ) {
+        delete [] _charBuffer;
+    }
+    _charBuffer = 0;
+    _charBufferOwned = true;
+    _charBufferSize = 0;
+    _charBufferCapacity = 0;
+    _hasBOM = false;
+    _push = false;
+    _finished = false;
+    _started = false;
+    _reading = false;
+    _p = 0;
+    _restore = 0;
+    _token = END_DOCUMENT;
+    _cdata = false;
+    _first = true;
+    _emptyElement = false;
+    _nonDeclaration = false;
+    _elementName = 0;
+    _attributeIndex = 0;
+    _lineNum = 1;
+    _tokenLineNum = 0;
+    _tokenOffset = 0;
+    _consumed = 0;
+    _errorID = XML_SUCCESS;
+    _errorLineNum = 0;
+    _attributes.Clear();
+    _names.Clear();
+    _elementStack.Clear();
+    _pending.Clear();
+}
+
+
+XMLError XMLReader::Parse( const char* xml, size_t nBytes )
+{
+    Clear();
+
+    if ( nBytes == 0 || !xml || !*xml ) {
+        SetError( XML_ERROR_EMPTY_DOCUMENT, 0 );
+        return _errorID;
+    }
+    if ( nBytes == static_cast<size_t>(-1) ) {
+        nBytes = strlen( xml );
+    }
+    _charBuffer = new char[ nBytes+1 ];
+    memcpy( _charBuffer, xml, nBytes );
+    _charBuffer[nBytes] = 0;
+    _charBufferSize = nBytes;
+    _p = _charBuffer;
+    _finished = true;
+    _reading = true;
+
+    Start();
+    return _errorID;
+}
+
+
+XMLError XMLReader::ParseInPlace( char* xml, size_t nBytes, bool transferOwnership )
+{
+    Clear();
+
+    if ( xml ) {
+        if ( nBytes == static_cast<size_t>(-1) ) {
+            nBytes = strlen( xml );
+        }
+        _charBuffer = xml;
+        _charBufferOwned = transferOwnership;
+        _charBuffer[nBytes] = 0;
+        _charBufferSize = nBytes;
+    }
+    if ( nBytes == 0 || !xml || !*xml ) {
+        SetError( XML_ERROR_EMPTY_DOCUMENT, 0 );
+        return _errorID;
+    }
+    _p = _charBuffer;
+    _finished = true;
+    _reading = true;
+
+    Start();
+    return _errorID;
+}
+
+
+void XMLReader::Feed( const char* data, size_t nBytes )
+{
+    if ( !_push || _finished ) {
+        Clear();
+        _push = true;
+        _reading = true;
+    }
+    if ( nBytes == 0 ) {
+        return;
+    }
+    TIXMLASSERT( data );
+    // Append in place if there is room; the buffer doesn't move, so
+    // the current token is untouched. Otherwise hold on to the data
+    // until Next() has finished with the current token.
+    if ( _pending.Empty() && _charBufferSize + nBytes < _charBufferCapacity ) {
+        memcpy( _charBuffer + _charBufferSize, data, nBytes );
+        _charBufferSize += nBytes;
+        _charBuffer[_charBufferSize] = 0;
+    }
+    else {
+        memcpy( _pending.PushArr( nBytes ), data, nBytes );
+    }
+}
+
+
+void XMLReader::Finish()
+{
+    if ( !_push ) {
+        Clear();
+        _push = true;
+        _reading = true;
+    }
+    _finished = true;
+}
+
+
+void XMLReader::Refill()
+{
+    // Drops what has been read, and moves the pending input in after
+    // what is left. Only called when no token refers to the buffer.
+    TIXMLASSERT( _push );
+    if ( _pending.Empty() ) {
+        return;
+    }
+    const size_t remaining = _charBufferSize - ( _p - _charBuffer );
+    const size_t needed = remaining + _pending.Size() + 1;
+    _consumed += static_cast<uint64_t>( _p - _charBuffer );
+    if ( needed > _charBufferCapacity ) {
+        const size_t capacity = needed > _charBufferCapacity * 2 ? needed : _charBufferCapacity * 2;
+        char* mem = new char[capacity];
+        if ( remaining ) {
+            memcpy( mem, _p, remaining );
+        }
+        delete [] _charBuffer;
+        _charBuffer = mem;
+        _charBufferCapacity = capacity;
+    }
+    else if ( remaining ) {
+        memmove( _charBuffer, _p, remaining );
+    }
+    memcpy( _charBuffer + remaining, _pending.Mem(), _pending.Size() );
+    _charBufferSize = remaining + _pending.Size();
+    _charBuffer[_charBufferSize] = 0;
+    _p = _charBuffer;
+    _pending.Clear();
+}
+
+
+bool XMLReader::Start()
+{
+    if ( !_p ) {
+        // Nothing has been fed yet.
+        if ( _finished ) {
+            SetError( XML_ERROR_EMPTY_DOCUMENT, 0 );
+        }
+        return false;
+    }
+    int lineNum = 1;
+    char* p = XMLUtil::SkipWhiteSpace( _p, &lineNum );
+    if ( !_finished && _charBufferSize - ( p - _charBuffer ) < 3 ) {
+        // Not enough to tell if there is a BOM.
+        return false;
+    }
+    p = const_cast<char*>( XMLUtil::ReadBOM( p, &_hasBOM ) );
+    if ( !*p ) {
+        if ( _finished ) {
+            SetError( XML_ERROR_EMPTY_DOCUMENT, 0 );
+        }
+        return false;
+    }
+    _lineNum = lineNum;
+    _p = p;
+    _started = true;
+    return true;
+}
+
+
+XMLReader::TokenType XMLReader::SetError( XMLError error, int lineNum )
+{
+    _errorID = error;
+    _errorLineNum = lineNum;
+    _token = PARSE_ERROR;
+    _reading = false;
+    _value.Reset();
+    _attributes.Clear();
+    return _token;
+}
+
+
+XMLReader::TokenType XMLReader::Truncated( XMLError error, int lineNum )
+{
+    // The token runs past the end of the input. That's an error, unless
+    // more input may come: then rewind, to read it again next time.
+    if ( _finished ) {
+        return SetError( error, lineNum );
+    }
+    _lineNum = _rewindLineNum;
+    _first = _rewindFirst;
+    _nonDeclaration = _rewindNonDeclaration;
+    _cdata = false;
+    _value.Reset();
+    _attributes.Clear();
+    _token = NEED_MORE_INPUT;
+    return _token;
+}
+
+
+const char* XMLReader::ErrorName() const
+{
+    return XMLDocument::ErrorIDToName( _errorID );
+}
+
+
+const char* XMLReader::Name() const
+{
+    switch( _token ) {
+        case START_ELEMENT:
+        case END_ELEMENT:
+            return _names.Mem() + _elementName;
+        case ATTRIBUTE:
+            return _attributes[_attributeIndex].name;
+        default:
+            return 0;
+    }
+}
+
+
+const char* XMLReader::Value() const
+{
+    switch( _token ) {
+        case ATTRIBUTE:
+            return AttributeValue( _attributeIndex );
+        case TEXT:
+        case COMMENT:
+        case DECLARATION:
+        case UNKNOWN:
+            return _value.GetStr();
+        default:
+            return 0;
+    }
 }
 
 
-void XMLPrinter::PushAttribute( const char* name, bool v )
+const char* XMLReader::Attribute( const char* name ) const
 {
-    char buf[BUF_SIZE];
-    XMLUtil::ToStr( v, buf, BUF_SIZE );
-    PushAttribute( name, buf );
+    for( size_t i = 0; i < _attributes.Size(); ++i ) {
+        if ( XMLUtil::StringEqual( _attributes[i].name, name ) ) {
+            return AttributeValue( i );
+        }
+    }
+    return 0;
 }
 
 
-void XMLPrinter::PushAttribute( const char* name, double v )
+const char* XMLReader::AttributeValue( size_t i ) const
 {
-    char buf[BUF_SIZE];
-    XMLUtil::ToStr( v, buf, BUF_SIZE );
-    PushAttribute( name, buf );
+    // Values are translated in place, the first time they are read.
+    // Record that, so they are not translated twice.
+    Attr& attr = _attributes[i];
+    StrPair value;
+    value.Set( attr.valueStart, attr.valueEnd, attr.valueFlags );
+    const char* str = value.GetStr();
+    attr.valueEnd = attr.valueStart + strlen( str );
+    attr.valueFlags = 0;
+    return str;
 }
 
 
-void XMLPrinter::CloseElement( bool compactMode )
+XMLReader::TokenType XMLReader::Next()
 {
-    --_depth;
-    const char* name = _stack.Pop();
+    if ( !_reading ) {
+        return _token;
+    }
+    if ( _restore ) {
+        *_restore = '<';
+        _restore = 0;
+    }
+    _value.Reset();
+    _cdata = false;
 
-    if ( _elementJustOpened ) {
-        Write( "/>" );
+    // The attributes of a start tag, and the end of an empty
+    // element, are returned before anything more is read.
+    if ( _token == START_ELEMENT || _token == ATTRIBUTE ) {
+        if ( _attributeIndex + 1 < static_cast<int>( _attributes.Size() ) ) {
+            ++_attributeIndex;
+            _token = ATTRIBUTE;
+            _tokenLineNum = _attributes[_attributeIndex].lineNum;
+            return _token;
+        }
+        _attributes.Clear();
+        if ( _emptyElement ) {
+            _emptyElement = false;
+            _first = false;
+            _tokenOffset = TokenEnd();
+            _elementName = _elementStack.Pop();
+            _names.PopArr( _names.Size() - _elementName );
+            _token = END_ELEMENT;
+            return _token;
+        }
     }
-    else {
-        if ( _textDepth < 0 && !compactMode) {
-            Putc( '\n' );
-            PrintSpace( _depth );
+
+    if ( _push ) {
+        Refill();
+    }
+    if ( !_started && !Start() ) {
+        _token = _reading ? NEED_MORE_INPUT : _token;
+        return _token;
+    }
+    _rewindLineNum = _lineNum;
+    _rewindFirst = _first;
+    _rewindNonDeclaration = _nonDeclaration;
+
+    char* const start = _p;
+    const int startLine = _lineNum;
+    char* p = XMLUtil::SkipWhiteSpace( start, &_lineNum );
+    if ( !*p ) {
+        if ( !_finished ) {
+            // Leave the white space to be read again.
+            return Truncated( XML_ERROR_PARSING, _lineNum );
         }
-        Write ( "</" );
-        Write ( name );
-        Write ( ">" );
+        if ( !_elementStack.Empty() ) {
+            return SetError( XML_ERROR_PARSING, _lineNum );
+        }
+        _reading = false;
+        _token = END_DOCUMENT;
+        return _token;
+    }
+    _tokenLineNum = _lineNum;
+    _tokenOffset = _consumed + static_cast<uint64_t>( p - _charBuffer );
+
+    const bool first = _first;
+    _first = false;
+
+    // The same patterns as XMLDocument::Identify(). Until the input is
+    // finished, a pattern cut short at the end may be taken for a shorter
+    // one; that token is then cut short too, and is read again later.
+    if ( XMLUtil::StringEqual( p, "<?", 2 ) ) {
+        // Declarations are only allowed at document level, before anything else.
+        if ( !_elementStack.Empty() || _nonDeclaration ) {
+            return SetError( XML_ERROR_PARSING_DECLARATION, _tokenLineNum );
+        }
+        return ReadText( p+2, "?>", StrPair::NEEDS_NEWLINE_NORMALIZATION, DECLARATION, XML_ERROR_PARSING_DECLARATION );
+    }
+    _nonDeclaration = true;
+    if ( XMLUtil::StringEqual( p, "<!--", 4 ) ) {
+        return ReadText( p+4, "-->", StrPair::COMMENT, COMMENT, XML_ERROR_PARSING_COMMENT );
+    }
+    if ( XMLUtil::StringEqual( p, "<![CDATA[", 9 ) ) {
+        _cdata = true;
+        return ReadText( p+9, "]]>", StrPair::NEEDS_NEWLINE_NORMALIZATION, TEXT, XML_ERROR_PARSING_CDATA );
+    }
+    if ( XMLUtil::StringEqual( p, "<!", 2 ) ) {
+        return ReadText( p+2, ">", StrPair::NEEDS_NEWLINE_NORMALIZATION, UNKNOWN, XML_ERROR_PARSING_UNKNOWN );
+    }
+    if ( *p == '<' ) {
+        if ( *(p+1) != '/' ) {
+            return ReadStartTag( p+1 );
+        }
+        // Preserve whitespace pedantically before closing tag, when it's immediately after opening tag
+        if ( !( _whitespaceMode == PEDANTIC_WHITESPACE && first && p != start ) ) {
+            return ReadEndTag( p+2 );
+        }
+        _tokenLineNum = startLine;
     }
 
-    if ( _textDepth == _depth ) {
-        _textDepth = -1;
+    // Text. Back it up, all the text counts.
+    _lineNum = startLine;
+    _tokenOffset = _consumed + static_cast<uint64_t>( start - _charBuffer );
+    int flags = _processEntities ? StrPair::TEXT_ELEMENT : StrPair::TEXT_ELEMENT_LEAVE_ENTITIES;
+    if ( _whitespaceMode == COLLAPSE_WHITESPACE ) {
+        flags |= StrPair::NEEDS_WHITESPACE_COLLAPSING;
     }
-    if ( _depth == 0 && !compactMode) {
-        Putc( '\n' );
+    p = _value.ParseText( start, "<", flags, &_lineNum );
+    if ( !p ) {
+        return Truncated( XML_ERROR_PARSING_TEXT, _tokenLineNum );
     }
-    _elementJustOpened = false;
+    if ( !*p ) {
+        return Truncated( XML_ERROR_PARSING, _tokenLineNum );
+    }
+    // Reading the value overwrites the '<' with the null terminator.
+    _restore = p-1;
+    _p = p-1;
+    _token = TEXT;
+    return _token;
 }
 
 
-void XMLPrinter::SealElementIfJustOpened()
+XMLReader::TokenType XMLReader::ReadText( char* p, const char* endTag, int flags, TokenType token, XMLError error )
 {
-    if ( !_elementJustOpened ) {
-        return;
+    p = _value.ParseText( p, endTag, flags, &_lineNum );
+    if ( !p ) {
+        return Truncated( error, _tokenLineNum );
     }
-    _elementJustOpened = false;
-    Putc( '>' );
+    _p = p;
+    _token = token;
+    return _token;
 }
 
 
-void XMLPrinter::PushText( const char* text, bool cdata )
+XMLReader::TokenType XMLReader::ReadStartTag( char* p )
 {
-    _textDepth = _depth-1;
-
-    SealElementIfJustOpened();
-    if ( cdata ) {
-        Write( "<![CDATA[" );
-        Write( text );
-        Write( "]]>" );
+    if ( !*p ) {
+        return Truncated( XML_ERROR_PARSING_ELEMENT, _tokenLineNum );
     }
-    else {
-        PrintString( text, true );
+    StrPair scratch;
+    char* const name = p;
+    p = scratch.ParseName( p );
+    if ( !p ) {
+        return SetError( XML_ERROR_PARSING_ELEMENT, _tokenLineNum );
     }
-}
+    char* const nameEnd = p;
 
+    // Scan the whole tag first: the null terminators
+    // land on characters the scan still needs.
+    _attributes.Clear();
+    while( true ) {
+        p = XMLUtil::SkipWhiteSpace( p, &_lineNum );
+        if ( !*p ) {
+            return Truncated( XML_ERROR_PARSING_ELEMENT, _tokenLineNum );
+        }
+        if ( XMLUtil::IsNameStartChar( static_cast<unsigned char>(*p) ) ) {
+            Attr* attr = _attributes.PushArr( 1 );
+            attr->lineNum = _lineNum;
+            attr->name = p;
+            p = scratch.ParseName( p );
+            TIXMLASSERT( p );
+            attr->nameEnd = p;
+
+            p = XMLUtil::SkipWhiteSpace( p, &_lineNum );
+            if ( *p != '=' ) {
+                return *p ? SetError( XML_ERROR_PARSING_ATTRIBUTE, attr->lineNum ) : Truncated( XML_ERROR_PARSING_ATTRIBUTE, attr->lineNum );
+            }
+            ++p;
+            p = XMLUtil::SkipWhiteSpace( p, &_lineNum );
+            if ( *p != '\"' && *p != '\'' ) {
+                return *p ? SetError( XML_ERROR_PARSING_ATTRIBUTE, attr->lineNum ) : Truncated( XML_ERROR_PARSING_ATTRIBUTE, attr->lineNum );
+            }
+            const char endTag[2] = { *p, 0 };
+            ++p;
+            attr->valueStart = p;
+            attr->valueFlags = _processEntities ? StrPair::ATTRIBUTE_VALUE : StrPair::ATTRIBUTE_VALUE_LEAVE_ENTITIES;
+            p = scratch.ParseText( p, endTag, attr->valueFlags, &_lineNum );
+            if ( !p ) {
+                return Truncated( XML_ERROR_PARSING_ATTRIBUTE, attr->lineNum );
+            }
+            attr->valueEnd = p-1;
+        }
+        else if ( *p == '>' ) {
+            _emptyElement = false;
+            ++p;
+            break;
+        }
+        else if ( *p == '/' && *(p+1) == '>' ) {
+            _emptyElement = true;
+            p += 2;
+            break;
+        }
+        else if ( *p == '/' && !*(p+1) ) {
+            return Truncated( XML_ERROR_PARSING_ELEMENT, _tokenLineNum );
+        }
+        else {
+            return SetError( XML_ERROR_PARSING_ELEMENT, _tokenLineNum );
+        }
+    }
+    scratch.Reset();
 
-void XMLPrinter::PushText( int64_t value )
-{
-    char buf[BUF_SIZE];
-    XMLUtil::ToStr( value, buf, BUF_SIZE );
-    PushText( buf, false );
-}
-
+    *nameEnd = 0;
+    for( size_t i = 0; i < _attributes.Size(); ++i ) {
+        *_attributes[i].nameEnd = 0;
+        for( size_t j = 0; j < i; ++j ) {
+            if ( XMLUtil::StringEqual( _attributes[i].name, _attributes[j].name ) ) {
+                return SetError( XML_ERROR_PARSING_ATTRIBUTE, _attributes[i].lineNum );
+            }
+        }
+    }
 
-void XMLPrinter::PushText( uint64_t value )
-{
-	char buf[BUF_SIZE];
-	XMLUtil::ToStr(value, buf, BUF_SIZE);
-	PushText(buf, false);
+    const size_t nameLen = nameEnd - name;
+    _elementName = _names.Size();
+    memcpy( _names.PushArr( nameLen + 1 ), name, nameLen + 1 );
+    _elementStack.Push( _elementName );
+    _attributeIndex = -1;
+    _first = true;
+    _p = p;
+    _token = START_ELEMENT;
+    return _token;
 }
 
 
-void XMLPrinter::PushText( int value )
+XMLReader::TokenType XMLReader::ReadEndTag( char* p )
 {
-    char buf[BUF_SIZE];
-    XMLUtil::ToStr( value, buf, BUF_SIZE );
-    PushText( buf, false );
+    if ( !*p ) {
+        return Truncated( XML_ERROR_PARSING_ELEMENT, _tokenLineNum );
+    }
+    char* const name = p;
+    StrPair scratch;
+    p = scratch.ParseName( p );
+    if ( !p ) {
+        return SetError( XML_ERROR_PARSING_ELEMENT, _tokenLineNum );
+    }
+    char* const nameEnd = p;
+    p = XMLUtil::SkipWhiteSpace( p, &_lineNum );
+    if ( *p != '>' ) {
+        return *p ? SetError( XML_ERROR_PARSING_ELEMENT, _tokenLineNum ) : Truncated( XML_ERROR_PARSING_ELEMENT, _tokenLineNum );
+    }
+    *nameEnd = 0;
+    if ( _elementStack.Empty() || !XMLUtil::StringEqual( name, _names.Mem() + _elementStack.PeekTop() ) ) {
+        return SetError( XML_ERROR_MISMATCHED_ELEMENT, _tokenLineNum );
+    }
+    _elementName = _elementStack.Pop();
+    _names.PopArr( _names.Size() - _elementName );
+    _p = p+1;
+    _token = END_ELEMENT;
+    return _token;
 }
 
 
-void XMLPrinter::PushText( unsigned value )
+// --------- XMLIndex ----------- //
+
+// The header of an index file. The tables follow it, as they are in
+// memory: the entries, the hash table of them, and the keys.
+struct IndexHeader
 {
-    char buf[BUF_SIZE];
-    XMLUtil::ToStr( value, buf, BUF_SIZE );
-    PushText( buf, false );
-}
+    char     magic[8];
+    uint32_t byteOrder;			// SNAPSHOT_BYTE_ORDER, as the saving machine stores it
+    uint32_t version;
+    uint32_t entryCount;
+    uint32_t tableSize;
+    uint32_t stringsSize;
+    uint32_t reserved;
+    uint64_t sourceSize;
+};
 
+static const char INDEX_MAGIC[8] = { 'T', 'X', 'M', 'L', 'I', 'N', 'D', 'X' };
+static const uint32_t INDEX_VERSION = 1;
 
-void XMLPrinter::PushText( bool value )
+
+struct XMLIndex::Builder
 {
-    char buf[BUF_SIZE];
-    XMLUtil::ToStr( value, buf, BUF_SIZE );
-    PushText( buf, false );
-}
+    DynArray<Entry, 64> entries;
+    DynArray<uint32_t, 64> table;
+    DynArray<char, 1024> strings;
 
+    // Slots of the table, which are indices of the entries.
+    struct EntrySlots
+    {
+        const Entry* entries;
+        const char* strings;
 
-void XMLPrinter::PushText( float value )
-{
-    char buf[BUF_SIZE];
-    XMLUtil::ToStr( value, buf, BUF_SIZE );
-    PushText( buf, false );
-}
+        static uint32_t Empty() {
+            return NONE;
+        }
+        const char* Key( uint32_t slot ) const {
+            return strings + entries[slot].key;
+        }
+    };
+
+    // Adds 'key' for an element starting at 'start', unless it is
+    // already there. Returns false if the index is too big.
+    bool Add( const char* key, size_t length, uint64_t start ) {
+        const EntrySlots slots = { entries.Mem(), strings.Mem() };
+        GrowTable( &table, entries.Size(), slots );
+        const size_t at = FindSlot( table.Mem(), table.Size(), key, length, slots );
+        if ( table[at] != NONE ) {
+            return true;
+        }
+        if ( entries.Size() >= NONE - 1 || strings.Size() + length + 1 >= NONE ) {
+            return false;
+        }
+        Entry entry = { start, 0, static_cast<uint32_t>( strings.Size() ), 0 };
+        char* str = strings.PushArr( length + 1 );
+        memcpy( str, key, length );
+        str[length] = 0;
+        table[at] = static_cast<uint32_t>( entries.Size() );
+        entries.Push( entry );
+        return true;
+    }
+};
 
 
-void XMLPrinter::PushText( double value )
+XMLIndex::XMLIndex() :
+    _memory( 0 ),
+    _mapping( 0 ),
+    _mappingSize( 0 ),
+    _entries( 0 ),
+    _entryCount( 0 ),
+    _table( 0 ),
+    _tableSize( 0 ),
+    _strings( 0 ),
+    _stringsSize( 0 ),
+    _sourceSize( 0 )
 {
-    char buf[BUF_SIZE];
-    XMLUtil::ToStr( value, buf, BUF_SIZE );
-    PushText( buf, false );
 }
 
 
-void XMLPrinter::PushComment( const char* comment )
+XMLIndex::~XMLIndex()
 {
-    PrepareForNewNode( _compactMode );
-
-    Write( "<!--" );
-    Write( comment );
-    Write( "-->" );
+    Clear();
 }
 
 
-void XMLPrinter::PushDeclaration( const char* value )
+void XMLIndex::Clear()
 {
-    PrepareForNewNode( _compactMode );
-
-    Write( "<?" );
-    Write( value );
-    Write( "?>" );
+    delete [] _memory;
+    _memory = 0;
+#ifdef TIXML_MMAP
+    if ( _mapping ) {
+        munmap( _mapping, _mappingSize );
+    }
+#endif
+    _mapping = 0;
+    _mappingSize = 0;
+    _entries = 0;
+    _entryCount = 0;
+    _table = 0;
+    _tableSize = 0;
+    _strings = 0;
+    _stringsSize = 0;
+    _sourceSize = 0;
 }
 
 
-void XMLPrinter::PushUnknown( const char* value )
+XMLError XMLIndex::Build( const char* filename, const char* keyAttribute, int pathDepth )
 {
-    PrepareForNewNode( _compactMode );
+    Clear();
+    if ( !filename ) {
+        TIXMLASSERT( false );
+        return XML_ERROR_FILE_COULD_NOT_BE_OPENED;
+    }
+    FILE* fp = callfopen( filename, "rb" );
+    if ( !fp ) {
+        return XML_ERROR_FILE_NOT_FOUND;
+    }
+
+    Builder builder;
+    XMLReader reader;
+    // The path of the open element, with where it started; and for each
+    // open element, the entries it added, to be given its end.
+    DynArray<char, 256> path;
+    DynArray<size_t, 32> pathLengths;
+    DynArray<size_t, 64> openEntries;
+    DynArray<char, 256> key;
+    const size_t keyAttributeLength = keyAttribute ? strlen( keyAttribute ) : 0;
+
+    static const size_t CHUNK_SIZE = 64 * 1024;
+    char* const chunk = new char[CHUNK_SIZE];
+    uint64_t sourceSize = 0;
+    XMLError error = XML_SUCCESS;
+    bool done = false;
+    while( !done && error == XML_SUCCESS ) {
+        const size_t read = fread( chunk, 1, CHUNK_SIZE, fp );
+        if ( read ) {
+            reader.Feed( chunk, read );
+            sourceSize += read;
+        }
+        else if ( ferror( fp ) ) {
+            error = XML_ERROR_FILE_READ_ERROR;
+            break;
+        }
+        else {
+            reader.Finish();
+        }
+        while( error == XML_SUCCESS ) {
+            const XMLReader::TokenType token = reader.Next();
+            if ( token == XMLReader::NEED_MORE_INPUT ) {
+                break;
+            }
+            if ( token == XMLReader::END_DOCUMENT ) {
+                done = true;
+                break;
+            }
+            if ( token == XMLReader::PARSE_ERROR ) {
+                error = reader.ErrorID();
+            }
+            else if ( token == XMLReader::START_ELEMENT ) {
+                pathLengths.Push( path.Size() );
+                const char* name = reader.Name();
+                const size_t nameLength = strlen( name );
+                char* p = path.PushArr( nameLength + 1 );
+                p[0] = '/';
+                memcpy( p + 1, name, nameLength );
+
+                openEntries.Push( builder.entries.Size() );
+                bool added = true;
+                if ( static_cast<int>( pathLengths.Size() ) <= pathDepth ) {
+                    added = builder.Add( path.Mem(), path.Size(), reader.TokenOffset() );
+                }
+                const char* value = keyAttribute ? reader.Attribute( keyAttribute ) : 0;
+                if ( added && value ) {
+                    // path[@keyAttribute='value']
+                    const size_t valueLength = strlen( value );
+                    key.Clear();
+                    memcpy( key.PushArr( path.Size() ), path.Mem(), path.Size() );
+                    memcpy( key.PushArr( 2 ), "[@", 2 );
+                    memcpy( key.PushArr( keyAttributeLength ), keyAttribute, keyAttributeLength );
+                    memcpy( key.PushArr( 2 ), "='", 2 );
+                    memcpy( key.PushArr( valueLength ), value, valueLength );
+                    memcpy( key.PushArr( 2 ), "']", 2 );
+                    added = builder.Add( key.Mem(), key.Size(), reader.TokenOffset() );
+                }
+                if ( !added ) {
+                    error = XML_ERROR_OUT_OF_MEMORY;
+                }
+                openEntries.Push( builder.entries.Size() );
+            }
+            else if ( token == XMLReader::END_ELEMENT ) {
+                const size_t last = openEntries.Pop();
+                for( size_t i = openEntries.Pop(); i < last; ++i ) {
+                    builder.entries[i].end = reader.TokenEnd();
+                }
+                path.PopArr( path.Size() - pathLengths.Pop() );
+            }
+        }
+    }
+    delete [] chunk;
+    fclose( fp );
+    if ( error != XML_SUCCESS ) {
+        return error;
+    }
 
-    Write( "<!" );
-    Write( value );
-    Putc( '>' );
+    // All of it in one block, without the slack of the arrays.
+    const size_t entryBytes = builder.entries.Size() * sizeof( Entry );
+    const size_t tableBytes = builder.table.Size() * sizeof( uint32_t );
+    _memory = new char[entryBytes + tableBytes + builder.strings.Size()];
+    char* p = _memory;
+    if ( entryBytes ) {
+        memcpy( p, builder.entries.Mem(), entryBytes );
+    }
+    _entries = reinterpret_cast<const Entry*>( p );
+    p += entryBytes;
+    if ( tableBytes ) {
+        memcpy( p, builder.table.Mem(), tableBytes );
+    }
+    _table = reinterpret_cast<const uint32_t*>( p );
+    p += tableBytes;
+    if ( builder.strings.Size() ) {
+        memcpy( p, builder.strings.Mem(), builder.strings.Size() );
+    }
+    _strings = p;
+
+    _entryCount = static_cast<uint32_t>( builder.entries.Size() );
+    _tableSize = static_cast<uint32_t>( builder.table.Size() );
+    _stringsSize = static_cast<uint32_t>( builder.strings.Size() );
+    _sourceSize = sourceSize;
+    return XML_SUCCESS;
 }
 
 
-bool XMLPrinter::VisitEnter( const XMLDocument& doc )
+bool XMLIndex::Find( const char* key, uint64_t* start, uint64_t* end ) const
 {
-    _processEntities = doc.ProcessEntities();
-    if ( doc.HasBOM() ) {
-        PushHeader( true, false );
+    TIXMLASSERT( key );
+    if ( _tableSize == 0 ) {
+        return false;
     }
+    const Builder::EntrySlots slots = { _entries, _strings };
+    const uint32_t found = _table[FindSlot( _table, _tableSize, key, strlen( key ), slots )];
+    if ( found == NONE ) {
+        return false;
+    }
+    *start = _entries[found].start;
+    *end = _entries[found].end;
     return true;
 }
 
 
-bool XMLPrinter::VisitEnter( const XMLElement& element, const XMLAttribute* attribute )
+XMLError XMLIndex::Save( const char* filename ) const
 {
-    const XMLElement* parentElem = 0;
-    if ( element.Parent() ) {
-        parentElem = element.Parent()->ToElement();
+    if ( !filename ) {
+        TIXMLASSERT( false );
+        return XML_ERROR_FILE_COULD_NOT_BE_OPENED;
     }
-    const bool compactMode = parentElem ? CompactMode( *parentElem ) : _compactMode;
-    OpenElement( element.Name(), compactMode );
-    while ( attribute ) {
-        PushAttribute( attribute->Name(), attribute->Value() );
-        attribute = attribute->Next();
+    FILE* fp = callfopen( filename, "wb" );
+    if ( !fp ) {
+        return XML_ERROR_FILE_COULD_NOT_BE_OPENED;
     }
-    return true;
-}
-
+    IndexHeader header;
+    memcpy( header.magic, INDEX_MAGIC, sizeof( header.magic ) );
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.version = INDEX_VERSION;
+    header.entryCount = _entryCount;
+    header.tableSize = _tableSize;
+    header.stringsSize = _stringsSize;
+    header.reserved = 0;
+    header.sourceSize = _sourceSize;
 
-bool XMLPrinter::VisitExit( const XMLElement& element )
-{
-    CloseElement( CompactMode(element) );
-    return true;
+    bool written =    fwrite( &header, sizeof( header ), 1, fp ) == 1
+                   && ( !_entryCount || fwrite( _entries, sizeof( Entry ), _entryCount, fp ) == _entryCount )
+                   && ( !_tableSize || fwrite( _table, sizeof( uint32_t ), _tableSize, fp ) == _tableSize )
+                   && ( !_stringsSize || fwrite( _strings, 1, _stringsSize, fp ) == _stringsSize );
+    if ( fclose( fp ) != 0 ) {
+        written = false;
+    }
+    return written ? XML_SUCCESS : XML_ERROR_FILE_COULD_NOT_BE_OPENED;
 }
 
 
-bool XMLPrinter::Visit( const XMLText& text )
+XMLError XMLIndex::Load( const char* filename )
 {
-    PushText( text.Value(), text.CData() );
-    return true;
+    Clear();
+    if ( !filename ) {
+        TIXMLASSERT( false );
+        return XML_ERROR_FILE_COULD_NOT_BE_OPENED;
+    }
+    TableFile file;
+    XMLError error = file.Load( filename, sizeof( IndexHeader ) );
+    if ( error == XML_SUCCESS ) {
+        error = Attach( file.mapping ? file.mapping : file.memory, file.size );
+    }
+    if ( error != XML_SUCCESS ) {
+        file.Free();
+        return error;
+    }
+    _memory = file.memory;
+    _mapping = file.mapping;
+    _mappingSize = file.mapping ? file.size : 0;
+    return XML_SUCCESS;
 }
 
 
-bool XMLPrinter::Visit( const XMLComment& comment )
-{
-    PushComment( comment.Value() );
-    return true;
-}
-
-bool XMLPrinter::Visit( const XMLDeclaration& declaration )
+XMLError XMLIndex::Attach( const void* data, size_t size )
 {
-    PushDeclaration( declaration.Value() );
-    return true;
-}
+    TIXMLASSERT( ( reinterpret_cast<size_t>( data ) & 7 ) == 0 );
+    if ( size < sizeof( IndexHeader ) ) {
+        return XML_ERROR_INVALID_SNAPSHOT;
+    }
+    IndexHeader header;
+    memcpy( &header, data, sizeof( header ) );
+    if (    memcmp( header.magic, INDEX_MAGIC, sizeof( header.magic ) ) != 0
+         || header.byteOrder != SNAPSHOT_BYTE_ORDER
+         || header.version != INDEX_VERSION ) {
+        return XML_ERROR_INVALID_SNAPSHOT;
+    }
+    // In 64 bits, so that none of it can overflow.
+    const unsigned long long entryBytes = static_cast<unsigned long long>( header.entryCount ) * sizeof( Entry );
+    const unsigned long long tableBytes = static_cast<unsigned long long>( header.tableSize ) * sizeof( uint32_t );
+    if ( entryBytes + tableBytes + header.stringsSize != static_cast<unsigned long long>( size - sizeof( IndexHeader ) ) ) {
+        return XML_ERROR_INVALID_SNAPSHOT;
+    }
+    const char* p = static_cast<const char*>( data ) + sizeof( IndexHeader );
+    const Entry* entries = reinterpret_cast<const Entry*>( p );
+    const uint32_t* table = reinterpret_cast<const uint32_t*>( p + entryBytes );
+    const char* strings = p + entryBytes + tableBytes;
 
+    // Every key ends inside the block, every range inside the file, and
+    // the lookups stop at an empty slot of the table.
+    if ( header.stringsSize && strings[header.stringsSize - 1] != 0 ) {
+        return XML_ERROR_INVALID_SNAPSHOT;
+    }
+    if ( header.tableSize & ( header.tableSize - 1 ) ) {
+        return XML_ERROR_INVALID_SNAPSHOT;
+    }
+    for( uint32_t i = 0; i < header.entryCount; ++i ) {
+        if (    entries[i].key >= header.stringsSize
+             || entries[i].start >= entries[i].end
+             || entries[i].end > header.sourceSize ) {
+            return XML_ERROR_INVALID_SNAPSHOT;
+        }
+    }
+    bool emptySlot = ( header.tableSize == 0 );
+    for( uint32_t i = 0; i < header.tableSize; ++i ) {
+        if ( table[i] == NONE ) {
+            emptySlot = true;
+        }
+        else if ( table[i] >= header.entryCount ) {
+            return XML_ERROR_INVALID_SNAPSHOT;
+        }
+    }
+    if ( !emptySlot ) {
+        return XML_ERROR_INVALID_SNAPSHOT;
+    }
 
-bool XMLPrinter::Visit( const XMLUnknown& unknown )
-{
-    PushUnknown( unknown.Value() );
-    return true;
+    _entries = entries;
+    _entryCount = header.entryCount;
+    _table = table;
+    _tableSize = header.tableSize;
+    _strings = strings;
+    _stringsSize = header.stringsSize;
+    _sourceSize = header.sourceSize;
+    return XML_SUCCESS;
 }
 
+
 }   // namespace tinyxml2
@@ -104,16 +104,16 @@ static const int TIXML2_PATCH_VERSION = 0;
 #define TINYXML2_MINOR_VERSION 0
 #define TINYXML2_PATCH_VERSION 0
 
-// A fixed element depth limit is problematic. There needs to be a
-// limit to avoid a stack overflow. However, that limit varies per
-// system, and the capacity of the stack. On the other hand, it's a trivial
-// attack that can result from ill, malicious, or even correctly formed XML,
-// so there needs to be a limit in place.
+// The default element depth limit. The parser itself doesn't recurse, but
+// Accept(), DeepClone() and DeepCopy() do, so a default limit is still in
+// place against ill, malicious, or even correctly formed XML that nests
+// deeply. XMLDocument::SetMaxElementDepth() changes it per document.
 static const int TINYXML2_MAX_ELEMENT_DEPTH = 500;
 
 namespace tinyxml2
 {
 class XMLDocument;
+class XMLNode;
 class XMLElement;
 class XMLAttribute;
 class XMLComment;
@@ -121,6 +121,86 @@ class XMLText;
 class XMLDeclaration;
 class XMLUnknown;
 class XMLPrinter;
+class XMLIndex;
+
+/**
+	Where a document gets its memory. By default it comes from the
+	global new; XMLDocument::SetAllocator() routes the memory of a
+	document through an XMLAllocator instead: the blocks of the node
+	pools, the copy of the XML text, strings set on nodes and attributes,
+	and the document's own bookkeeping.
+
+	Allocate() may return null, which the document reports as
+	XML_ERROR_OUT_OF_MEMORY. Free() is given the size that was
+	allocated. Memory is aligned as the global new would align it.
+
+	Override it to allocate from huge pages, from the local NUMA node,
+	and so on. XMLArenaAllocator is an arena, over the heap or over a
+	fixed buffer.
+*/
+class TINYXML2_LIB XMLAllocator
+{
+public:
+    virtual ~XMLAllocator() {}
+
+    virtual void* Allocate( size_t size ) = 0;
+    virtual void Free( void* mem, size_t size ) = 0;
+};
+
+
+/**
+	An arena. Allocation bumps a pointer, and Free() does nothing: the
+	memory is given back all at once, by Reset() or the destructor, so
+	deleting a document that allocates from an arena frees nothing piece
+	by piece. Delete the document first; see XMLDocument::SetAllocator().
+
+	Over the heap, or over another allocator, the arena grows in chunks
+	of at least 'chunkSize'. Over a fixed buffer it never touches the
+	heap, and Allocate() returns null once the buffer is full.
+
+	@verbatim
+	static char memory[256 * 1024];
+	XMLArenaAllocator arena( memory, sizeof( memory ) );
+	XMLDocument doc;
+	doc.SetAllocator( &arena );
+	@endverbatim
+*/
+class TINYXML2_LIB XMLArenaAllocator : public XMLAllocator
+{
+public:
+    explicit XMLArenaAllocator( size_t chunkSize = 64 * 1024, XMLAllocator* upstream = 0 );
+    XMLArenaAllocator( void* buffer, size_t size );
+    virtual ~XMLArenaAllocator();
+
+    virtual void* Allocate( size_t size ) override;
+    virtual void Free( void* /*mem*/, size_t /*size*/ ) override {}
+
+    /// Makes all the memory available again. Whatever used it must be gone.
+    void Reset();
+    /// Frees all the chunks, and takes them from 'upstream' (the heap if null) from now on.
+    void SetUpstream( XMLAllocator* upstream );
+    /// The number of bytes handed out since the last Reset().
+    size_t Used() const {
+        return _used;
+    }
+
+private:
+    XMLArenaAllocator( const XMLArenaAllocator& );	// not supported
+    void operator=( const XMLArenaAllocator& );	// not supported
+
+    struct Chunk;
+    void FreeChunk( Chunk* chunk );
+
+    XMLAllocator* _upstream;
+    Chunk*  _chunks;	// chunks from the heap or _upstream, newest first
+    char*   _next;
+    char*   _end;
+    char*   _buffer;	// the fixed buffer, if there is one
+    size_t  _bufferSize;
+    size_t  _chunkSize;
+    size_t  _used;
+};
+
 
 /*
 	A class that wraps strings. Normally stores the start and end
@@ -167,9 +247,23 @@ public:
     void SetInternedStr( const char* str ) {
         Reset();
         _start = const_cast<char*>(str);
+        _end = _start + strlen( str );
     }
 
-    void SetStr( const char* str, int flags=0 );
+    // Copies 'str'; from 'allocator' if it isn't null. Returns false,
+    // leaving the string as it was, if the allocator is out of memory.
+    bool SetStr( const char* str, int flags=0, XMLAllocator* allocator=0 );
+
+    // Compare and hash names without flushing them, so that the
+    // buffer under them isn't written to.
+    bool NameEqual( const StrPair& other ) const;
+    unsigned NameHash() const;
+    size_t NameLength() const;
+
+    // Where the string starts, without flushing it.
+    const char* Start() const {
+        return _start;
+    }
 
     char* ParseText( char* in, const char* endTag, int strFlags, int* curLineNumPtr );
     char* ParseName( char* in );
@@ -178,11 +272,12 @@ public:
 	void Reset();
 
 private:
-    void CollapseWhitespace();
+    void Normalize();
 
     enum {
         NEEDS_FLUSH = 0x100,
-        NEEDS_DELETE = 0x200
+        NEEDS_DELETE = 0x200,	// from new[]
+        NEEDS_FREE = 0x400		// from an XMLAllocator, which is in front of it
     };
 
     int     _flags;
@@ -206,14 +301,25 @@ public:
     DynArray() :
         _mem( _pool ),
         _allocated( INITIAL_SIZE ),
-        _size( 0 )
+        _size( 0 ),
+        _allocator( 0 ),
+        _memFromAllocator( false )
     {
     }
 
     ~DynArray() {
-        if ( _mem != _pool ) {
-            delete [] _mem;
-        }
+        FreeMem();
+    }
+
+    // Grows from 'allocator', or from new[] if it is null or refuses.
+    // Frees what has grown so far.
+    void SetAllocator( XMLAllocator* allocator ) {
+        FreeMem();
+        _mem = _pool;
+        _allocated = INITIAL_SIZE;
+        _size = 0;
+        _allocator = allocator;
+        _memFromAllocator = false;
     }
 
     void Clear() {
@@ -300,14 +406,33 @@ private:
         if ( cap > _allocated ) {
             TIXMLASSERT( cap <= SIZE_MAX / 2 / sizeof(T));
             const size_t newAllocated = cap * 2;
-            T* newMem = new T[newAllocated];
+            T* newMem = 0;
+            bool fromAllocator = false;
+            if ( _allocator ) {
+                newMem = static_cast<T*>( _allocator->Allocate( sizeof(T) * newAllocated ) );
+                fromAllocator = ( newMem != 0 );
+            }
+            if ( !newMem ) {
+                newMem = new T[newAllocated];
+            }
             TIXMLASSERT( newAllocated >= _size );
             memcpy( newMem, _mem, sizeof(T) * _size );	// warning: not using constructors, only works for PODs
-            if ( _mem != _pool ) {
-                delete [] _mem;
-            }
+            FreeMem();
             _mem = newMem;
             _allocated = newAllocated;
+            _memFromAllocator = fromAllocator;
+        }
+    }
+
+    void FreeMem() {
+        if ( _mem == _pool ) {
+            return;
+        }
+        if ( _memFromAllocator ) {
+            _allocator->Free( _mem, sizeof(T) * _allocated );
+        }
+        else {
+            delete [] _mem;
         }
     }
 
@@ -315,6 +440,8 @@ private:
     T   _pool[INITIAL_SIZE];
     size_t _allocated;		// objects allocated
     size_t _size;			// number objects in use
+    XMLAllocator* _allocator;
+    bool _memFromAllocator;
 };
 
 
@@ -325,13 +452,30 @@ private:
 class MemPool
 {
 public:
-    MemPool() {}
+    MemPool() : _allocator( 0 ), _strAllocator( 0 ) {}
     virtual ~MemPool() {}
 
+    // Where blocks come from. Null for the global new.
+    XMLAllocator* Allocator() const {
+        return _allocator;
+    }
+    // Where strings copied into what is allocated come from. Null for
+    // the global new.
+    XMLAllocator* StrAllocator() const {
+        return _strAllocator;
+    }
+    void SetStrAllocator( XMLAllocator* allocator ) {
+        _strAllocator = allocator;
+    }
+
     virtual size_t ItemSize() const = 0;
     virtual void* Alloc() = 0;
     virtual void Free( void* ) = 0;
     virtual void SetTracked() = 0;
+
+protected:
+    XMLAllocator* _allocator;
+    XMLAllocator* _strAllocator;
 };
 
 
@@ -342,24 +486,31 @@ template< size_t ITEM_SIZE >
 class MemPoolT : public MemPool
 {
 public:
-    MemPoolT() : _blockPtrs(), _root(0), _currentAllocs(0), _nAllocs(0), _maxAllocs(0), _nUntracked(0)	{}
+    MemPoolT() : _blocks(), _root(0), _capacity(0), _currentAllocs(0), _nAllocs(0), _maxAllocs(0), _nUntracked(0)	{}
     ~MemPoolT() {
         MemPoolT< ITEM_SIZE >::Clear();
     }
 
     void Clear() {
         // Delete the blocks.
-        while( !_blockPtrs.Empty()) {
-            Block* lastBlock = _blockPtrs.Pop();
-            delete lastBlock;
+        while( !_blocks.Empty()) {
+            FreeBlock( _blocks.Pop() );
         }
         _root = 0;
+        _capacity = 0;
         _currentAllocs = 0;
         _nAllocs = 0;
         _maxAllocs = 0;
         _nUntracked = 0;
     }
 
+    // Clears the pool, and takes blocks from 'allocator' from now on.
+    void SetAllocator( XMLAllocator* allocator ) {
+        Clear();
+        _blocks.SetAllocator( allocator );
+        _allocator = allocator;
+    }
+
     virtual size_t ItemSize() const override {
         return ITEM_SIZE;
     }
@@ -367,18 +518,27 @@ public:
         return _currentAllocs;
     }
 
+    // Returns null if the allocator is out of memory.
     virtual void* Alloc() override{
         if ( !_root ) {
-            // Need a new block.
-            Block* block = new Block;
-            _blockPtrs.Push( block );
-
-            Item* blockItems = block->items;
-            for( size_t i = 0; i < ITEMS_PER_BLOCK - 1; ++i ) {
-                blockItems[i].next = &(blockItems[i + 1]);
+            // Need a new block. It holds as many items as the pool has
+            // had in use at once, so a pool that keeps filling doubles,
+            // and a big document takes a few big blocks, not many small ones.
+            size_t count = _maxAllocs < ITEMS_PER_BLOCK ? static_cast<size_t>( ITEMS_PER_BLOCK ) : _maxAllocs;
+            if ( count > MAX_ITEMS_PER_BLOCK ) {
+                count = MAX_ITEMS_PER_BLOCK;
+            }
+            Block block = { NewItems( count ), count };
+            if ( !block.items && count > ITEMS_PER_BLOCK ) {
+                block.count = ITEMS_PER_BLOCK;
+                block.items = NewItems( block.count );
+            }
+            if ( !block.items ) {
+                return 0;
             }
-            blockItems[ITEMS_PER_BLOCK - 1].next = 0;
-            _root = blockItems;
+            _blocks.Push( block );
+            _capacity += block.count;
+            ThreadBlock( block );
         }
         Item* const result = _root;
         TIXMLASSERT( result != 0 );
@@ -406,9 +566,9 @@ public:
         _root = item;
     }
     void Trace( const char* name ) {
-        printf( "Mempool %s watermark=%d [%dk] current=%d size=%d nAlloc=%d blocks=%d\n",
+        printf( "Mempool %s watermark=%d [%dk] current=%d size=%d nAlloc=%d blocks=%d [%dk]\n",
                 name, _maxAllocs, _maxAllocs * ITEM_SIZE / 1024, _currentAllocs,
-                ITEM_SIZE, _nAllocs, _blockPtrs.Size() );
+                ITEM_SIZE, _nAllocs, _blocks.Size(), _capacity * sizeof( Item ) / 1024 );
     }
 
     void SetTracked() override {
@@ -419,6 +579,109 @@ public:
         return _nUntracked;
     }
 
+    // The bytes held in blocks.
+    size_t Held() const {
+        return _capacity * sizeof( Item );
+    }
+
+    // Frees blocks until no more than 'bytes' are held, and returns what
+    // is still held. Only possible when nothing is allocated.
+    size_t Trim( size_t bytes ) {
+        if ( _currentAllocs == 0 && Held() > bytes ) {
+            while( !_blocks.Empty() && Held() > bytes ) {
+                _capacity -= _blocks.PeekTop().count;
+                FreeBlock( _blocks.Pop() );
+            }
+            // Thread the free list through the blocks that are left.
+            _root = 0;
+            for( size_t i = 0; i < _blocks.Size(); ++i ) {
+                ThreadBlock( _blocks[i] );
+            }
+        }
+        return Held();
+    }
+
+    // Frees the blocks that nothing is allocated from, and returns the
+    // bytes freed. What is allocated doesn't move.
+    size_t ShrinkToFit() {
+        if ( _currentAllocs == _capacity ) {
+            return 0;
+        }
+        // Count the free items in each block. Sorted by address, the
+        // block an item is in is found by a binary search.
+        for( size_t i = 1; i < _blocks.Size(); ++i ) {
+            const Block block = _blocks[i];
+            size_t j = i;
+            for( ; j > 0 && block.items < _blocks[j - 1].items; --j ) {
+                _blocks[j] = _blocks[j - 1];
+            }
+            _blocks[j] = block;
+        }
+        DynArray< size_t, 10 > freeCounts;
+        memset( freeCounts.PushArr( _blocks.Size() ), 0, _blocks.Size() * sizeof( size_t ) );
+        for( Item* item = _root; item; item = item->next ) {
+            ++freeCounts[BlockOf( item )];
+        }
+
+        // Take the items of the empty blocks off the free list, then free the blocks.
+        Item* root = 0;
+        Item** tail = &root;
+        for( Item* item = _root; item; item = item->next ) {
+            const size_t i = BlockOf( item );
+            if ( freeCounts[i] != _blocks[i].count ) {
+                *tail = item;
+                tail = &item->next;
+            }
+        }
+        *tail = 0;
+        _root = root;
+
+        const size_t held = Held();
+        size_t kept = 0;
+        for( size_t i = 0; i < _blocks.Size(); ++i ) {
+            if ( freeCounts[i] == _blocks[i].count ) {
+                _capacity -= _blocks[i].count;
+                FreeBlock( _blocks[i] );
+            }
+            else {
+                _blocks[kept++] = _blocks[i];
+            }
+        }
+        _blocks.PopArr( _blocks.Size() - kept );
+        return held - Held();
+    }
+
+    // Takes over the blocks of 'other', along with everything allocated
+    // from them. 'other' is left empty.
+    void Splice( MemPoolT& other ) {
+        TIXMLASSERT( _allocator == other._allocator );
+        while( !other._blocks.Empty() ) {
+            _blocks.Push( other._blocks.Pop() );
+        }
+        if ( other._root ) {
+            Item* last = other._root;
+            while( last->next ) {
+                last = last->next;
+            }
+            last->next = _root;
+            _root = other._root;
+        }
+        _capacity += other._capacity;
+        _currentAllocs += other._currentAllocs;
+        if ( _currentAllocs > _maxAllocs ) {
+            _maxAllocs = _currentAllocs;
+        }
+        _nAllocs += other._nAllocs;
+        _nUntracked += other._nUntracked;
+
+        other._root = 0;
+        other._capacity = 0;
+        other._currentAllocs = 0;
+        other._nAllocs = 0;
+        other._maxAllocs = 0;
+        other._nUntracked = 0;
+    }
+
 	// This number is perf sensitive. 4k seems like a good tradeoff on my machine.
 	// The test file is large, 170k.
 	// Release:		VS2010 gcc(no opt)
@@ -428,9 +691,13 @@ public:
 	//		16k:	5200
 	//		32k:	4300
 	//		64k:	4000	21000
+	// That is the first block; later ones grow, to no more than 256k.
     // Declared public because some compilers do not accept to use ITEMS_PER_BLOCK
     // in private part if ITEMS_PER_BLOCK is private
-    enum { ITEMS_PER_BLOCK = (4 * 1024) / ITEM_SIZE };
+    enum {
+        ITEMS_PER_BLOCK = (4 * 1024) / ITEM_SIZE,
+        MAX_ITEMS_PER_BLOCK = 64 * ITEMS_PER_BLOCK
+    };
 
 private:
     MemPoolT( const MemPoolT& ); // not supported
@@ -441,11 +708,54 @@ private:
         char    itemData[static_cast<size_t>(ITEM_SIZE)];
     };
     struct Block {
-        Item items[ITEMS_PER_BLOCK];
+        Item*   items;
+        size_t  count;
     };
-    DynArray< Block*, 10 > _blockPtrs;
+
+    Item* NewItems( size_t count ) {
+        if ( _allocator ) {
+            return static_cast<Item*>( _allocator->Allocate( count * sizeof( Item ) ) );
+        }
+        return new Item[count];
+    }
+    void FreeBlock( const Block& block ) {
+        if ( _allocator ) {
+            _allocator->Free( block.items, block.count * sizeof( Item ) );
+        }
+        else {
+            delete [] block.items;
+        }
+    }
+    // Puts all of 'block' on the front of the free list.
+    void ThreadBlock( const Block& block ) {
+        Item* blockItems = block.items;
+        for( size_t i = 0; i < block.count - 1; ++i ) {
+            blockItems[i].next = &(blockItems[i + 1]);
+        }
+        blockItems[block.count - 1].next = _root;
+        _root = blockItems;
+    }
+    // The block 'item' is in; the blocks must be sorted by address.
+    size_t BlockOf( const Item* item ) const {
+        size_t low = 0;
+        size_t high = _blocks.Size();
+        while( high - low > 1 ) {
+            const size_t mid = ( low + high ) / 2;
+            if ( item < _blocks[mid].items ) {
+                high = mid;
+            }
+            else {
+                low = mid;
+            }
+        }
+        TIXMLASSERT( item >= _blocks[low].items && item < _blocks[low].items + _blocks[low].count );
+        return low;
+    }
+
+    DynArray< Block, 10 > _blocks;
     Item* _root;
 
+    size_t _capacity;		// items in all the blocks
     size_t _currentAllocs;
     size_t _nAllocs;
     size_t _maxAllocs;
@@ -514,6 +824,103 @@ public:
     }
 };
 
+/**
+	Chooses what a parse keeps (see XMLDocument::SetParseFilter().) As each
+	element's start tag is read, OpenElement() says whether to keep it, to
+	skip it - with all of its content, which is stepped over without being
+	parsed - or to stop the parse there. The element is already linked into
+	the document, so its attributes and its Parent() chain can be looked at;
+	its children have not been read yet.
+
+	CloseElement() is called when a kept element is complete, and can stop
+	the parse too. KeepNode() is called for the other nodes: text, comments,
+	declarations and unknowns.
+
+	A stopped parse is not an error. The document holds what was read up to
+	that point, with any elements that were still open left as they are.
+
+	Like XMLVisitor, all the methods have defaults that keep everything.
+	You should never change the document from a callback.
+*/
+class TINYXML2_LIB XMLParseFilter
+{
+public:
+    enum Action {
+        KEEP,	///< Keep the element, and read its content.
+        SKIP,	///< Leave the element, and its content, out of the document.
+        STOP	///< Leave the element out, and stop the parse.
+    };
+
+    virtual ~XMLParseFilter() {}
+
+    /// Called after an element's start tag, with its attributes, is read.
+    virtual Action OpenElement( const XMLElement& /*element*/ )		{
+        return KEEP;
+    }
+    /// Called when a kept element is complete. Return false to stop the parse.
+    virtual bool CloseElement( const XMLElement& /*element*/ )		{
+        return true;
+    }
+    /// Return false to leave a text, comment, declaration or unknown out.
+    virtual bool KeepNode( const XMLNode& /*node*/ )				{
+        return true;
+    }
+};
+
+
+/**
+	An XMLParseFilter that keeps the elements on a set of paths. A path is
+	the names of the elements from the root down, separated by '/':
+
+	@verbatim
+	XMLPathFilter filter;
+	filter.AddPath( "Envelope/Header" );
+	filter.SetStopWhenFound( true );
+	doc.SetParseFilter( &filter );
+	doc.LoadFile( "message.xml" );
+	@endverbatim
+
+	An element on a path is kept with everything in it. Its ancestors are
+	kept, so the document has the same shape, but their other children
+	are skipped. With no paths, everything is kept.
+*/
+class TINYXML2_LIB XMLPathFilter : public XMLParseFilter
+{
+public:
+    XMLPathFilter();
+
+    /// Adds a path to keep. The string is copied.
+    void AddPath( const char* path );
+
+    /** Sets whether comments, declarations and unknowns are kept.
+        Defaults to true.
+    */
+    void SetKeepComments( bool keep )	{
+        _keepComments = keep;
+    }
+    /** Stops the parse as soon as an element has been read for every
+        path. Later matches are then not read at all. Defaults to false.
+    */
+    void SetStopWhenFound( bool stop )	{
+        _stopWhenFound = stop;
+    }
+
+    virtual Action OpenElement( const XMLElement& element ) override;
+    virtual bool CloseElement( const XMLElement& element ) override;
+    virtual bool KeepNode( const XMLNode& node ) override;
+
+private:
+    XMLPathFilter( const XMLPathFilter& );	// not supported
+    void operator=( const XMLPathFilter& );	// not supported
+
+    DynArray< char, 64 > _paths;	// null terminated, one after another
+    DynArray< int, 4 > _pathStart;
+    DynArray< bool, 4 > _found;
+    bool _keepComments;
+    bool _stopWhenFound;
+};
+
+
 // WARNING: must match XMLDocument::_errorNames[]
 enum XMLError {
     XML_SUCCESS = 0,
@@ -535,6 +942,10 @@ enum XMLError {
     XML_CAN_NOT_CONVERT_TEXT,
     XML_NO_TEXT_NODE,
 	XML_ELEMENT_DEPTH_EXCEEDED,
+	XML_ERROR_OUT_OF_MEMORY,
+	XML_ERROR_INVALID_SNAPSHOT,
+	XML_ERROR_KEY_NOT_FOUND,
+	XML_ERROR_INDEX_OUT_OF_DATE,
 
 	XML_ERROR_COUNT
 };
@@ -565,25 +976,17 @@ public:
     // Anything in the high order range of UTF-8 is assumed to not be whitespace. This isn't
     // correct, but simple, and usually works.
     static bool IsWhiteSpace( char p )					{
-        return !IsUTF8Continuation(p) && isspace( static_cast<unsigned char>(p) );
+        return ( _charClass[static_cast<unsigned char>(p)] & CHAR_CLASS_WHITESPACE ) != 0;
     }
 
+    // Anything in the high order range of UTF-8 is assumed to be a name character.
+    // This is a heuristic guess in attempt to not implement Unicode-aware isalpha()
     inline static bool IsNameStartChar( unsigned char ch ) {
-        if ( ch >= 128 ) {
-            // This is a heuristic guess in attempt to not implement Unicode-aware isalpha()
-            return true;
-        }
-        if ( isalpha( ch ) ) {
-            return true;
-        }
-        return ch == ':' || ch == '_';
+        return ( _charClass[ch] & CHAR_CLASS_NAME_START ) != 0;
     }
 
     inline static bool IsNameChar( unsigned char ch ) {
-        return IsNameStartChar( ch )
-               || isdigit( ch )
-               || ch == '.'
-               || ch == '-';
+        return ( _charClass[ch] & CHAR_CLASS_NAME ) != 0;
     }
 
     inline static bool IsPrefixHex( const char* p) {
@@ -638,6 +1041,15 @@ public:
 private:
 	static const char* writeBoolTrue;
 	static const char* writeBoolFalse;
+
+    // Character classes, indexed by byte value. The table replaces the <cctype>
+    // calls: it is faster, and is independent of the (process wide) C locale.
+    enum {
+        CHAR_CLASS_WHITESPACE	= 0x01,		// isspace() in the "C" locale
+        CHAR_CLASS_NAME_START	= 0x02,		// letters, ':', '_', and 128-255
+        CHAR_CLASS_NAME			= 0x04		// name start, digits, '.', '-'
+    };
+    static const unsigned char _charClass[256];
 };
 
 
@@ -752,6 +1164,12 @@ public:
     /// Gets the line number the node is in, if the document was parsed from a file.
     int GetLineNum() const { return _parseLineNum; }
 
+    /** Gets where the node's Value() starts in the parsed input, in bytes,
+        or -1 if the node wasn't parsed or its value has been set since.
+        See XMLDocument::ByteOffset().
+    */
+    int64_t GetByteOffset() const;
+
     /// Get the parent of this node on the DOM.
     const XMLNode*	Parent() const			{
         return _parent;
@@ -763,15 +1181,18 @@ public:
 
     /// Returns true if this node has no children.
     bool NoChildren() const					{
+        Expand();
         return !_firstChild;
     }
 
     /// Get the first child node, or null if none exists.
     const XMLNode*  FirstChild() const		{
+        Expand();
         return _firstChild;
     }
 
     XMLNode*		FirstChild()			{
+        Expand();
         return _firstChild;
     }
 
@@ -786,10 +1207,12 @@ public:
 
     /// Get the last child node, or null if none exists.
     const XMLNode*	LastChild() const						{
+        Expand();
         return _lastChild;
     }
 
     XMLNode*		LastChild()								{
+        Expand();
         return _lastChild;
     }
 
@@ -950,12 +1373,13 @@ protected:
     explicit XMLNode( XMLDocument* );
     virtual ~XMLNode();
 
-    virtual char* ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr);
+    virtual char* ParseDeep( char* p, int* curLineNumPtr);
 
     XMLDocument*	_document;
     XMLNode*		_parent;
     mutable StrPair	_value;
     int             _parseLineNum;
+    bool            _lazy;          // children not parsed yet; see XMLDocument::SetLazyParse()
 
     XMLNode*		_firstChild;
     XMLNode*		_lastChild;
@@ -967,10 +1391,21 @@ protected:
 
 private:
     MemPool*		_memPool;
+    size_t			_unlinkedSlot;	// index in XMLDocument::_unlinked plus one; 0 if not there
+    char* ParseNodes( char* p, int* curLineNumPtr, XMLNode** open );
+    void Expand() const {
+        if ( _lazy ) {
+            ParseLazy();
+        }
+    }
+    void ParseLazy() const;
     void Unlink( XMLNode* child );
     static void DeleteNode( XMLNode* node );
     void InsertChildPreamble( XMLNode* insertThis ) const;
-    const XMLElement* ToElementWithName( const char* name ) const;
+    // SetValue(), returning false if the value couldn't be copied.
+    bool SetValueStr( const char* str, bool staticMem );
+    // 'interned' if 'name' is a key from XMLDocument::NameKey().
+    const XMLElement* ToElementWithName( const char* name, bool interned ) const;
 
     XMLNode( const XMLNode& );	// not supported
     XMLNode& operator=( const XMLNode& );	// not supported
@@ -1018,7 +1453,7 @@ protected:
     explicit XMLText( XMLDocument* doc )	: XMLNode( doc ), _isCData( false )	{}
     virtual ~XMLText()												{}
 
-    char* ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr ) override;
+    char* ParseDeep( char* p, int* curLineNumPtr ) override;
 
 private:
     bool _isCData;
@@ -1049,7 +1484,7 @@ protected:
     explicit XMLComment( XMLDocument* doc );
     virtual ~XMLComment();
 
-    char* ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr) override;
+    char* ParseDeep( char* p, int* curLineNumPtr ) override;
 
 private:
     XMLComment( const XMLComment& );	// not supported
@@ -1088,7 +1523,7 @@ protected:
     explicit XMLDeclaration( XMLDocument* doc );
     virtual ~XMLDeclaration();
 
-    char* ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr ) override;
+    char* ParseDeep( char* p, int* curLineNumPtr ) override;
 
 private:
     XMLDeclaration( const XMLDeclaration& );	// not supported
@@ -1123,7 +1558,7 @@ protected:
     explicit XMLUnknown( XMLDocument* doc );
     virtual ~XMLUnknown();
 
-    char* ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr ) override;
+    char* ParseDeep( char* p, int* curLineNumPtr ) override;
 
 private:
     XMLUnknown( const XMLUnknown& );	// not supported
@@ -1141,6 +1576,7 @@ private:
 class TINYXML2_LIB XMLAttribute
 {
     friend class XMLElement;
+    friend class XMLDocument;
 public:
     /// The name of the attribute.
     const char* Name() const;
@@ -1241,18 +1677,20 @@ public:
 private:
     enum { BUF_SIZE = 200 };
 
-    XMLAttribute() : _name(), _value(),_parseLineNum( 0 ), _next( 0 ), _memPool( 0 ) {}
+    XMLAttribute() : _name(), _value(),_parseLineNum( 0 ), _outOfMemory( false ), _next( 0 ), _memPool( 0 ) {}
     virtual ~XMLAttribute()	{}
 
     XMLAttribute( const XMLAttribute& );	// not supported
     void operator=( const XMLAttribute& );	// not supported
     void SetName( const char* name );
+    void SetValueStr( const char* value );
 
     char* ParseDeep( char* p, bool processEntities, int* curLineNumPtr );
 
     mutable StrPair _name;
     mutable StrPair _value;
     int             _parseLineNum;
+    bool            _outOfMemory;	// the last SetName() or SetAttribute() couldn't copy its string
     XMLAttribute*   _next;
     MemPool*        _memPool;
 };
@@ -1265,6 +1703,7 @@ private:
 class TINYXML2_LIB XMLElement : public XMLNode
 {
     friend class XMLDocument;
+    friend class XMLNode;
 public:
     /// Get the name of an element (which is the Value() of the node.)
     const char* Name() const		{
@@ -1465,45 +1904,69 @@ public:
 	/// Sets the named attribute to value.
     void SetAttribute( const char* name, const char* value )	{
         XMLAttribute* a = FindOrCreateAttribute( name );
-        a->SetAttribute( value );
+        if ( a ) {
+            a->SetAttribute( value );
+            CheckAttributeValue( a );
+        }
     }
     /// Sets the named attribute to value.
     void SetAttribute( const char* name, int value )			{
         XMLAttribute* a = FindOrCreateAttribute( name );
-        a->SetAttribute( value );
+        if ( a ) {
+            a->SetAttribute( value );
+            CheckAttributeValue( a );
+        }
     }
     /// Sets the named attribute to value.
     void SetAttribute( const char* name, unsigned value )		{
         XMLAttribute* a = FindOrCreateAttribute( name );
-        a->SetAttribute( value );
+        if ( a ) {
+            a->SetAttribute( value );
+            CheckAttributeValue( a );
+        }
     }
 
 	/// Sets the named attribute to value.
 	void SetAttribute(const char* name, int64_t value) {
 		XMLAttribute* a = FindOrCreateAttribute(name);
-		a->SetAttribute(value);
+		if (a) {
+			a->SetAttribute(value);
+			CheckAttributeValue( a );
+		}
 	}
 
     /// Sets the named attribute to value.
     void SetAttribute(const char* name, uint64_t value) {
         XMLAttribute* a = FindOrCreateAttribute(name);
-        a->SetAttribute(value);
+        if (a) {
+            a->SetAttribute(value);
+            CheckAttributeValue( a );
+        }
     }
 
     /// Sets the named attribute to value.
     void SetAttribute( const char* name, bool value )			{
         XMLAttribute* a = FindOrCreateAttribute( name );
-        a->SetAttribute( value );
+        if ( a ) {
+            a->SetAttribute( value );
+            CheckAttributeValue( a );
+        }
     }
     /// Sets the named attribute to value.
     void SetAttribute( const char* name, double value )		{
         XMLAttribute* a = FindOrCreateAttribute( name );
-        a->SetAttribute( value );
+        if ( a ) {
+            a->SetAttribute( value );
+            CheckAttributeValue( a );
+        }
     }
     /// Sets the named attribute to value.
     void SetAttribute( const char* name, float value )		{
         XMLAttribute* a = FindOrCreateAttribute( name );
-        a->SetAttribute( value );
+        if ( a ) {
+            a->SetAttribute( value );
+            CheckAttributeValue( a );
+        }
     }
 
     /**
@@ -1681,7 +2144,7 @@ public:
     virtual bool ShallowEqual( const XMLNode* compare ) const override;
 
 protected:
-    char* ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr ) override;
+    char* ParseDeep( char* p, int* curLineNumPtr ) override;
 
 private:
     XMLElement( XMLDocument* doc );
@@ -1690,12 +2153,16 @@ private:
     void operator=( const XMLElement& );	// not supported
 
     XMLAttribute* FindOrCreateAttribute( const char* name );
+    // Sets the error if the attribute's value couldn't be copied.
+    void CheckAttributeValue( XMLAttribute* attribute );
     char* ParseAttributes( char* p, int* curLineNumPtr );
     static void DeleteAttribute( XMLAttribute* attribute );
     XMLAttribute* CreateAttribute();
 
     enum { BUF_SIZE = 200 };
     ElementClosingType _closingType;
+    int _lazyLineNum;
+    char* _lazyContent;     // where the unparsed children start, if lazy
     // The attribute list is ordered; there is no 'lastAttribute'
     // because the list needs to be scanned for dupes before adding
     // a new attribute.
@@ -1751,6 +2218,26 @@ public:
     */
     XMLError Parse( const char* xml, size_t nBytes=static_cast<size_t>(-1) );
 
+    /**
+    	Parse an XML document directly in a caller supplied, writable
+    	buffer, without the allocation and copy done by Parse(). The
+    	strings of the DOM point into the buffer, and are normalized
+    	in place, so the buffer contents will be modified.
+
+    	If 'nBytes' is specified, xml[nBytes] must be writable; the
+    	null terminator is written there. If not specified, 'xml' must
+    	be null terminated.
+
+    	If 'transferOwnership' is false (the default) the buffer is
+    	borrowed, and must outlive the document, or at least the
+    	next call to Clear(), Parse() or LoadFile(). If true, the buffer
+    	must have been allocated with new char[], and the document
+    	will delete[] it.
+
+    	Returns XML_SUCCESS (0) on success, or an errorID.
+    */
+    XMLError ParseInPlace( char* xml, size_t nBytes=static_cast<size_t>(-1), bool transferOwnership=false );
+
     /**
     	Load an XML file from disk.
     	Returns XML_SUCCESS (0) on success, or
@@ -1766,11 +2253,71 @@ public:
         not text in order for TinyXML-2 to correctly
         do newline normalization.
 
+        A FILE* that can't seek, such as a pipe or stdin, is
+        read from where it is to its end.
+
     	Returns XML_SUCCESS (0) on success, or
     	an errorID.
     */
     XMLError LoadFile( FILE* );
 
+    /**
+    	Load an XML document from a file descriptor, reading from
+    	where it is to its end. It doesn't need to seek, so pipes,
+    	FIFOs and sockets work. The buffer grows as the input
+    	arrives, starting from the file size when there is one.
+    	You are responsible for closing the descriptor.
+
+    	Returns XML_SUCCESS (0) on success, or
+    	an errorID.
+    */
+    XMLError LoadFileDescriptor( int fd );
+
+    /**
+    	Load an XML file from disk by mapping it into memory,
+    	rather than reading it into an allocated buffer. The file is
+    	mapped privately (copy-on-write) and parsed in place, so
+    	parsing starts immediately and pages are only read from disk
+    	as they are touched. Normalization writes stay private to
+    	the mapping; the file itself is never modified. The mapping is
+    	released by Clear(), or when the document is deleted.
+
+    	On platforms without mmap() this is the same as LoadFile().
+
+    	Returns XML_SUCCESS (0) on success, or
+    	an errorID.
+    */
+    XMLError LoadFileMapped( const char* filename );
+
+    /**
+    	Load an XML file from disk, reading it on a thread of its
+    	own while it is parsed. The file is read in chunks, and the
+    	parse follows just behind, so reading and parsing overlap;
+    	this helps most when the disk, or network, is slow. The
+    	nodes and errors are the same as for LoadFile().
+
+    	With lazy parsing, a parse filter or a line index, or on
+    	platforms without threads, this is the same as LoadFile().
+    	So is it for files that can't seek, such as pipes.
+
+    	Returns XML_SUCCESS (0) on success, or
+    	an errorID.
+    */
+    XMLError LoadFilePipelined( const char* filename );
+
+    /**
+    	Load just one element of an XML file, found with an index of the
+    	file built by XMLIndex::Build(). Only that element's bytes are
+    	read; it becomes the root element of the document. Line numbers
+    	count from the start of the element.
+
+    	Returns XML_ERROR_KEY_NOT_FOUND if nothing is indexed as 'key', or
+    	XML_ERROR_INDEX_OUT_OF_DATE if the file has changed size since it
+    	was indexed. Otherwise returns XML_SUCCESS (0) on success, or
+    	an errorID.
+    */
+    XMLError LoadSubtree( const char* filename, const XMLIndex& index, const char* key );
+
     /**
     	Save the XML file to disk.
     	Returns XML_SUCCESS (0) on success, or
@@ -1794,6 +2341,174 @@ public:
         return _whitespaceMode;
     }
 
+    /** Sets the maximum nesting depth of elements accepted by the
+        parser; deeper documents fail with XML_ELEMENT_DEPTH_EXCEEDED.
+        The parser doesn't recurse, so this is a resource budget rather
+        than a stack guard. 0 means unlimited. Defaults to
+        TINYXML2_MAX_ELEMENT_DEPTH. Applies to subsequent parses.
+    */
+    void SetMaxElementDepth( int depth ) {
+        _maxElementDepth = depth;
+    }
+    /// Returns the maximum element depth. See SetMaxElementDepth().
+    int MaxElementDepth() const {
+        return _maxElementDepth;
+    }
+
+    /** Sets the number of threads used to parse large documents. The
+        children of the root element are split into ranges, which are
+        parsed at the same time and then joined, in document order, under
+        the root. The result, including line numbers and errors, is the
+        same as a serial parse. 0 uses one thread per processor. Documents
+        too small to benefit are always parsed serially. Defaults to 1.
+    */
+    void SetParseThreads( int threads ) {
+        _parseThreads = threads;
+    }
+    /// Returns the number of parse threads. See SetParseThreads().
+    int ParseThreads() const {
+        return _parseThreads;
+    }
+
+    /** Sets lazy parsing. When on, the parse checks that each element's
+        end tag is where it should be, and records where the content is,
+        but doesn't parse it. The children are created the first time they
+        are asked for: by FirstChild(), FirstChildElement(), Accept(), and
+        so on. Loading is then fast, and only what is read uses memory.
+
+        Errors in the content of an element are found when it's parsed,
+        and are reported by the document, as for Parse(); the element is
+        left with the children read before the error. Other elements are
+        still read; the document reports the last error found, until
+        ClearError(). Since reading a
+        lazy document can change it, it can't be shared between threads
+        without a lock. Applies to subsequent parses. Defaults to off.
+    */
+    void SetLazyParse( bool lazy ) {
+        _lazyParse = lazy;
+    }
+    /// Returns true if parsing is lazy. See SetLazyParse().
+    bool LazyParse() const {
+        return _lazyParse;
+    }
+
+    /** Sets a filter that chooses which parts of the document are kept
+        by subsequent parses; see XMLParseFilter and XMLPathFilter. What
+        is skipped is only checked for the balance of its tags, so errors
+        inside it are not reported. A parse with a filter is never lazy,
+        and is always done on the calling thread. The filter is not owned
+        by the document. Null, the default, keeps everything.
+    */
+    void SetParseFilter( XMLParseFilter* filter ) {
+        _parseFilter = filter;
+    }
+    /// Returns the parse filter. See SetParseFilter().
+    XMLParseFilter* ParseFilter() const {
+        return _parseFilter;
+    }
+
+    /** Sets how much memory, in bytes, the document keeps for the next
+        parse when it is cleared: the buffer the input was copied or read
+        into, and the blocks of the node pools, even after a parse error.
+        Parse() and LoadFile() start by clearing the document, so one used
+        for message after message stops allocating once it has seen the
+        largest; anything over the limit is freed. 0, the default, keeps
+        the pool blocks (as long as there was no error) but not the buffer.
+        See also XMLDocumentPool.
+    */
+    void SetRecycleMemory( size_t bytes ) {
+        _recycleMemory = bytes;
+    }
+    /// Returns how much memory is kept between parses. See SetRecycleMemory().
+    size_t RecycleMemory() const {
+        return _recycleMemory;
+    }
+
+    /** Routes the memory of the document through 'allocator', or back
+        to the global new if it is null. Clears the document, and frees
+        what it kept from the last allocator. The allocator must outlive
+        the document, or the next SetAllocator().
+
+        When the allocator runs out, parsing fails with
+        XML_ERROR_OUT_OF_MEMORY, and NewElement() and the like return
+        null. SetValue(), SetAttribute() and SetText() set the error, and
+        leave the old value, or no attribute, in place. The document's
+        small bookkeeping arrays fall back to the global new rather than
+        fail. The parse doesn't run in parallel (see SetParseThreads())
+        with an allocator set.
+    */
+    void SetAllocator( XMLAllocator* allocator );
+    /// Returns the allocator set with SetAllocator(), or null.
+    XMLAllocator* Allocator() const {
+        return _allocator;
+    }
+
+    /** Sets whether strings copied into the document, by SetAttribute(),
+        SetText(), SetName(), NewElement(), ShallowClone() and the like,
+        come from an arena owned by the document rather than each from
+        its own allocation. The arena is freed all at once by Clear(),
+        which makes building large documents much cheaper; but a string
+        that is replaced, or whose node is deleted, isn't freed until then.
+        Defaults to off.
+    */
+    void SetStringArena( bool arena );
+    /// Returns true if copied strings come from an arena. See SetStringArena().
+    bool StringArena() const {
+        return _stringArena;
+    }
+
+    /** Sets whether element and attribute names are interned: kept once
+        per document, in a table, however many nodes have them. Names
+        are interned as they are parsed, and by NewElement(), SetName()
+        and SetAttribute(). FirstChildElement(), NextSiblingElement(),
+        FindAttribute() and the other lookups by name then find the name
+        in the table once, and compare pointers rather than strings.
+        Clones share the names of the document they are cloned into.
+        Clears the document; defaults to off.
+
+        Interned names don't point into the parsed input, so
+        GetByteOffset() of an element is -1.
+    */
+    void SetInternNames( bool intern );
+    /// Returns true if names are interned. See SetInternNames().
+    bool InternNames() const {
+        return _internNames;
+    }
+
+    /** Sets whether subsequent parses build a line index: the offset
+        of every line feed in the input, found in one pass before the
+        parse starts. With it, LineColumn() can turn any byte offset into
+        a line and column. Costs a pointer-sized entry per line. Defaults
+        to off.
+    */
+    void SetLineIndex( bool index ) {
+        _buildLineIndex = index;
+    }
+    /// Returns true if parses build a line index. See SetLineIndex().
+    bool LineIndex() const {
+        return _buildLineIndex;
+    }
+
+    /** Returns where 'str' starts in the parsed input, in bytes, or -1
+        if it isn't in the input. 'str' is a string this document returned:
+        the Value() of a node, the Name() or Value() of an attribute, or
+        GetText(). Strings are decoded in place, so the offset is that of
+        the raw text, which can be longer than the string itself.
+    */
+    int64_t ByteOffset( const char* str ) const;
+
+    /** Finds the line and column of a byte offset in the input of the
+        last parse, both counted from 1; the column is in bytes. Needs the
+        line index (see SetLineIndex()). Returns false if there is no index,
+        or the offset is out of range.
+
+        @verbatim
+        int line = 0, column = 0;
+        doc.LineColumn( element->GetByteOffset(), &line, &column );
+        @endverbatim
+    */
+    bool LineColumn( int64_t offset, int* line, int* column ) const;
+
     /**
     	Returns true if this document has a leading Byte Order Mark of UTF8.
     */
@@ -1907,6 +2622,17 @@ public:
     /// Clear the document, resetting it to the initial state.
     void Clear();
 
+    /**
+    	Frees the memory the document holds for nodes and attributes that
+    	have been deleted, where it can: the node pools give back the
+    	blocks that nothing in use is allocated from. Nodes and attributes
+    	don't move, so pointers to them stay good. Returns the number of
+    	bytes freed.
+
+    	To pack a document into the least memory, DeepCopy() it into a new one.
+    */
+    size_t ShrinkToFit();
+
 	/**
 		Copies this document to a target document.
 		The target will be completely cleared before the copy.
@@ -1916,11 +2642,23 @@ public:
 	*/
 	void DeepCopy(XMLDocument* target) const;
 
+	/**
+		Finishes reading the document, so that it can be shared by threads
+		that only read it. Parsing leaves strings to be decoded (entities,
+		whitespace) in place in the buffer the first time they are asked
+		for, and a lazy parse leaves children to be read the same way, so
+		that even const calls such as Value() and Attribute() can write to
+		the document. Freeze() does all of that work up front: afterwards,
+		const calls don't change anything until the document is modified
+		or parsed again.
+	*/
+	void Freeze();
+
 	// internal
     char* Identify( char* p, XMLNode** node, bool first );
 
 	// internal
-	void MarkInUse(const XMLNode* const);
+	void MarkInUse(XMLNode* node);
 
     virtual XMLNode* ShallowClone( XMLDocument* /*document*/ ) const override{
         return 0;
@@ -1940,14 +2678,31 @@ private:
     mutable StrPair	_errorStr;
     int             _errorLineNum;
     char*			_charBuffer;
+    bool			_charBufferOwned;
+    size_t			_charBufferMapLength;	// non-zero if _charBuffer is a file mapping
+    size_t			_charBufferSize;
+    size_t			_charBufferCapacity;	// if it came from NewCharBuffer() or ReadToEnd()
+    char*			_spareBuffer;		// kept for the next parse; see SetRecycleMemory()
+    size_t			_spareBufferCapacity;
+    size_t			_recycleMemory;
+    XMLAllocator*	_allocator;
+    XMLArenaAllocator _strings;			// see SetStringArena(); also holds the interned names
+    bool			_stringArena;
+    bool			_internNames;
+    DynArray<const char*, 64> _names;	// open addressed, by HashName()
+    size_t			_nameCount;
+    bool			_buildLineIndex;
+    DynArray<size_t, 16> _lineIndex;	// offsets of the line feeds in _charBuffer
     int				_parseCurLineNum;
 	int				_parsingDepth;
-	// Memory tracking does add some overhead.
-	// However, the code assumes that you don't
-	// have a bunch of unlinked nodes around.
-	// Therefore it takes less memory to track
-	// in the document vs. a linked list in the XMLNode,
-	// and the performance is the same.
+	int				_maxElementDepth;
+	int				_parseThreads;
+	bool			_lazyParse;
+	XMLParseFilter*	_parseFilter;
+	char*			_parseEnd;		// if set, the parse stops here; see XMLNode::ParseNodes()
+	// Nodes created but not yet in the tree, deleted by Clear(). Each
+	// knows where it is in here (XMLNode::_unlinkedSlot), so a node is
+	// taken out in constant time however many are waiting.
 	DynArray<XMLNode*, 10> _unlinked;
 
     MemPoolT< sizeof(XMLElement) >	 _elementPool;
@@ -1958,24 +2713,36 @@ private:
 	static const char* _errorNames[XML_ERROR_COUNT];
 
     void Parse();
+    void ReleasePoolsAfterError();
+    // The interned copy of a name; null if memory ran out.
+    const char* InternName( const char* name, size_t length );
+    // Replaces a parsed name with its interned copy.
+    bool InternName( StrPair* name );
+    const char* FindName( const char* name, size_t length ) const;
+    // For a lookup by name: with names interned, replaces 'name' with
+    // its interned copy, and returns false if no node can have it.
+    bool NameKey( const char** name ) const;
+
+    // Where strings copied into nodes come from.
+    XMLAllocator* StrAllocator() {
+        return _stringArena ? &_strings : _allocator;
+    }
+    // Room for 'size' bytes and a terminator; the spare buffer if it fits.
+    // Null if the allocator is out of memory.
+    char* NewCharBuffer( size_t size );
+    // Reads 'source' with ReadToEnd(), and parses what it read.
+    template< class SOURCE >
+    XMLError ParseSource( SOURCE& source, size_t sizeHint );
+
+    struct ParallelRange;
+    bool ParseParallel( char* p );
+    void ParseRange( ParallelRange* range );
+    void MoveNodesTo( XMLNode* node, XMLDocument* target );
 
     void SetError( XMLError error, int lineNum, const char* format, ... );
 
-	// Something of an obvious security hole, once it was discovered.
-	// Either an ill-formed XML or an excessively deep one can overflow
-	// the stack. Track stack depth, and error out if needed.
-	class DepthTracker {
-	public:
-		explicit DepthTracker(XMLDocument * document) {
-			this->_document = document;
-			document->PushDepth();
-		}
-		~DepthTracker() {
-			_document->PopDepth();
-		}
-	private:
-		XMLDocument * _document;
-	};
+	// The parser tracks how deeply elements are nested, and errors
+	// out past _maxElementDepth.
 	void PushDepth();
 	void PopDepth();
 
@@ -1983,16 +2750,254 @@ private:
     NodeType* CreateUnlinkedNode( MemPoolT<PoolElementSize>& pool );
 };
 
+/**
+	Keeps documents for reuse, so that a handler that parses a message
+	per request doesn't allocate a document, or its memory, each time.
+	Acquire() hands out a cleared document, and Release() takes it back.
+	The documents recycle their memory (see XMLDocument::SetRecycleMemory()),
+	so after a while parsing allocates nothing.
+
+	@verbatim
+	XMLDocumentPool& pool = XMLDocumentPool::ForThread();
+	XMLDocument* doc = pool.Acquire();
+	doc->Parse( message, length );
+	...
+	pool.Release( doc );
+	@endverbatim
+
+	A pool isn't thread safe; ForThread() gives each thread its own.
+	Release() puts the settings of a document, such as SetLazyParse()
+	and SetAllocator(), back to those of a new one.
+*/
+class TINYXML2_LIB XMLDocumentPool
+{
+public:
+    /** 'recycleBytes' is the XMLDocument::SetRecycleMemory() of each
+        document, and 'maxIdle' the most documents kept between uses.
+    */
+    XMLDocumentPool( size_t recycleBytes = 1024 * 1024, int maxIdle = 4 );
+    ~XMLDocumentPool();
+
+    /// Returns an empty document: a kept one, or a new one.
+    XMLDocument* Acquire();
+    /// Clears and resets the document, and keeps it, or deletes it if enough are kept.
+    void Release( XMLDocument* doc );
+
+    /// Returns the number of documents kept for reuse.
+    int Idle() const {
+        return static_cast<int>( _idle.Size() );
+    }
+
+    /// Returns a pool for the calling thread, with the default settings.
+    static XMLDocumentPool& ForThread();
+
+private:
+    XMLDocumentPool( const XMLDocumentPool& );	// not supported
+    void operator=( const XMLDocumentPool& );	// not supported
+
+    DynArray<XMLDocument*, 4> _idle;
+    size_t _recycleBytes;
+    int _maxIdle;
+};
+
+
+/**
+	A read-only copy of a parsed document, built for reading it quickly,
+	and in much less memory. The nodes are kept in document order in one
+	array, and refer to each other by index; the names and values are
+	copied into one block of strings, with each name kept once. A scan
+	of the whole tree is a pass over the array.
+
+	A node is its index; the nodes are 0 to NodeCount()-1. NONE is "no
+	node" where a node is returned, and the document itself where one is
+	passed: FirstChild( NONE ) is the first top level node.
+
+	@verbatim
+	XMLCompactDocument compact;
+	compact.Build( doc );
+	for( uint32_t item = compact.FirstChildElement( compact.RootElement(), "item" );
+	     item != XMLCompactDocument::NONE;
+	     item = compact.NextSiblingElement( item, "item" ) ) {
+		printf( "%s\n", compact.Attribute( item, "id" ) );
+	}
+	@endverbatim
+
+	The copy doesn't depend on the document once built. It is immutable,
+	so it can be read from many threads at once.
+
+	A copy can be saved as a snapshot file with SaveSnapshot(), and read
+	back with LoadSnapshot(). The file is the copy as it is in memory,
+	after a small header, so loading it is a check of the tables, not a
+	parse; where it can, LoadSnapshot() maps the file rather than reading
+	it. Print() writes the copy out as XML again. Snapshots are in the
+	byte order of the machine that saved them, and another machine's
+	don't load.
+*/
+class TINYXML2_LIB XMLCompactDocument
+{
+public:
+    enum NodeType {
+        ELEMENT,
+        TEXT,
+        COMMENT,
+        DECLARATION,
+        UNKNOWN
+    };
+    static const uint32_t NONE = 0xffffffff;
+
+    XMLCompactDocument();
+    ~XMLCompactDocument();
+
+    /** Copies 'doc'. Fails with XML_ERROR_OUT_OF_MEMORY if it is too
+        big for 32-bit indices.
+    */
+    XMLError Build( const XMLDocument& doc );
+    /// Frees the copy.
+    void Clear();
+
+    /// Saves the copy as a snapshot file.
+    XMLError SaveSnapshot( const char* filename ) const;
+    /// Saves the copy as a snapshot to an open file, which should be opened for binary writing.
+    XMLError SaveSnapshot( FILE* fp ) const;
+    /**
+        Loads a snapshot file, mapping it into memory where that is
+        supported. Fails with XML_ERROR_INVALID_SNAPSHOT if it isn't a
+        snapshot of this version and byte order, or the tables in it
+        don't hold together.
+    */
+    XMLError LoadSnapshot( const char* filename );
+    /**
+        Uses the snapshot in 'data' in place, without copying it. The
+        memory must be aligned to 4 bytes, and stay as it is until the
+        copy is cleared or loaded again.
+    */
+    XMLError LoadSnapshot( const void* data, size_t size );
+
+    /// The number of nodes.
+    uint32_t NodeCount() const {
+        return _nodeCount;
+    }
+    /// The memory the copy takes, in bytes.
+    size_t MemoryUsed() const {
+        return _memorySize;
+    }
+
+    NodeType Type( uint32_t node ) const {
+        return static_cast<NodeType>( Node( node ).type & TYPE_MASK );
+    }
+    /// The name of an element, or the value of another node.
+    const char* Value( uint32_t node ) const {
+        return _strings + Node( node ).value;
+    }
+    /// True for a text node that was a CDATA section.
+    bool CData( uint32_t node ) const {
+        return ( Node( node ).type & CDATA ) != 0;
+    }
+    int GetLineNum( uint32_t node ) const {
+        return Node( node ).lineNum;
+    }
+
+    uint32_t Parent( uint32_t node ) const {
+        return Node( node ).parent;
+    }
+    uint32_t FirstChild( uint32_t node ) const {
+        // Children follow their parent.
+        const uint32_t next = ( node == NONE ) ? 0 : node + 1;
+        return ( next < _nodeCount && _nodes[next].parent == node ) ? next : NONE;
+    }
+    uint32_t NextSibling( uint32_t node ) const {
+        return Node( node ).next;
+    }
+    /// The first element under 'node' (or the document), with 'name' if it isn't null.
+    uint32_t FirstChildElement( uint32_t node, const char* name = 0 ) const;
+    /// The next element after 'node', with 'name' if it isn't null.
+    uint32_t NextSiblingElement( uint32_t node, const char* name = 0 ) const;
+    /// The first top level element.
+    uint32_t RootElement() const {
+        return FirstChildElement( NONE );
+    }
+    /// The text of an element's first child, if it is text; like XMLElement::GetText().
+    const char* GetText( uint32_t element ) const;
+
+    uint32_t AttributeCount( uint32_t node ) const {
+        return _nodes[node + 1].firstAttribute - Node( node ).firstAttribute;
+    }
+    const char* AttributeName( uint32_t node, uint32_t i ) const {
+        TIXMLASSERT( i < AttributeCount( node ) );
+        return _strings + _attributes[Node( node ).firstAttribute + i].name;
+    }
+    const char* AttributeValue( uint32_t node, uint32_t i ) const {
+        TIXMLASSERT( i < AttributeCount( node ) );
+        return _strings + _attributes[Node( node ).firstAttribute + i].value;
+    }
+    /// The value of the attribute 'name' of an element, or null.
+    const char* Attribute( uint32_t element, const char* name ) const;
+
+    /// Prints the copy, as XMLDocument::Print() would print the document.
+    void Print( XMLPrinter* printer ) const;
+
+private:
+    XMLCompactDocument( const XMLCompactDocument& );	// not supported
+    void operator=( const XMLCompactDocument& );	// not supported
+
+    enum {
+        TYPE_MASK = 0xff,
+        CDATA = 0x100
+    };
+    // Fixed size, so that the layout is the same everywhere.
+    struct NodeEntry {
+        uint32_t value;				// offset into _strings
+        uint32_t parent;
+        uint32_t next;
+        uint32_t firstAttribute;	// they run to the next node's
+        int32_t  lineNum;
+        uint32_t type;				// NodeType, and CDATA
+    };
+    struct AttributeEntry {
+        uint32_t name;
+        uint32_t value;
+    };
+
+    const NodeEntry& Node( uint32_t node ) const {
+        TIXMLASSERT( node < _nodeCount );
+        return _nodes[node];
+    }
+    // The offset of 'name' in _strings, or NONE if nothing has that name.
+    uint32_t FindName( const char* name ) const;
+    // Whether the tables are safe to walk: in bounds, and a tree in document order.
+    bool Verify( uint32_t attributeCount ) const;
+
+    char*                   _memory;	// everything below is in here, if it is owned
+    size_t                  _memorySize;
+    void*                   _mapping;	// or in here, for a mapped snapshot
+    size_t                  _mappingSize;
+    const NodeEntry*        _nodes;		// _nodeCount, and one past the end for the attribute count
+    uint32_t                _nodeCount;
+    const AttributeEntry*   _attributes;
+    const uint32_t*         _names;		// open addressed, offsets of the names, NONE if empty
+    uint32_t                _nameTableSize;
+    const char*             _strings;
+    uint32_t                _stringsSize;
+    bool                    _processEntities;
+    bool                    _writeBOM;
+};
+
+
 template<class NodeType, size_t PoolElementSize>
 inline NodeType* XMLDocument::CreateUnlinkedNode( MemPoolT<PoolElementSize>& pool )
 {
     TIXMLASSERT( sizeof( NodeType ) == PoolElementSize );
     TIXMLASSERT( sizeof( NodeType ) == pool.ItemSize() );
-    NodeType* returnNode = new (pool.Alloc()) NodeType( this );
-    TIXMLASSERT( returnNode );
+    void* mem = pool.Alloc();
+    if ( !mem ) {
+        SetError( XML_ERROR_OUT_OF_MEMORY, _parseCurLineNum, 0 );
+        return 0;
+    }
+    NodeType* returnNode = new (mem) NodeType( this );
     returnNode->_memPool = &pool;
 
 	_unlinked.Push(returnNode);
+	returnNode->_unlinkedSlot = _unlinked.Size();
     return returnNode;
 }
 
@@ -2238,6 +3243,7 @@ private:
 */
 class TINYXML2_LIB XMLPrinter : public XMLVisitor
 {
+    friend class XMLCompactDocument;
 public:
     enum EscapeAposCharsInAttributes {
         ESCAPE_APOS_CHARS_IN_ATTRIBUTES,
@@ -2378,6 +3384,322 @@ private:
 };
 
 
+/**
+	A pull parser. XMLReader reads XML one token at a time, without building
+	a DOM: no nodes or attributes are allocated, and memory use depends on
+	the nesting depth of the document rather than its size. It is useful
+	when only a few values are needed from a large document.
+
+	@verbatim
+	XMLReader reader;
+	reader.Parse( xml );
+	XMLReader::TokenType token = reader.Next();
+	while( token != XMLReader::END_DOCUMENT && token != XMLReader::PARSE_ERROR ) {
+	    if ( token == XMLReader::START_ELEMENT && XMLUtil::StringEqual( reader.Name(), "item" ) ) {
+	        const char* id = reader.Attribute( "id" );
+	        ...
+	    }
+	    token = reader.Next();
+	}
+	@endverbatim
+
+	Like the DOM, the strings returned point into the parse buffer, and
+	are normalized and have entities translated in place, only when
+	they are asked for. Strings returned by Name(), Value() and Attribute()
+	are valid until the next call to Next().
+
+	An empty element, <foo/>, is returned as START_ELEMENT followed
+	by END_ELEMENT. The attributes of an element follow its START_ELEMENT
+	as ATTRIBUTE tokens; they can also be looked up by name with Attribute()
+	while the reader is on the element or its attributes.
+
+	Input that arrives in pieces, from a pipe or socket, can be pushed
+	with Feed() instead of Parse(). When Next() runs out of input, even in
+	the middle of a tag, entity or CDATA section, it returns NEED_MORE_INPUT
+	and picks up where it left off once more has been fed. Call Finish()
+	after the last piece. Only the unread part of the input is buffered.
+
+	@verbatim
+	XMLReader reader;
+	while( ... ) {
+	    reader.Feed( chunk, chunkSize );
+	    while( reader.Next() != XMLReader::NEED_MORE_INPUT ) {
+	        ...
+	    }
+	}
+	reader.Finish();
+	while( reader.Next() != XMLReader::END_DOCUMENT && !reader.Error() ) {
+	    ...
+	}
+	@endverbatim
+*/
+class TINYXML2_LIB XMLReader
+{
+public:
+    enum TokenType {
+        START_ELEMENT,	///< Name() is the element name.
+        ATTRIBUTE,		///< Name() and Value() are the attribute name and value.
+        END_ELEMENT,	///< Name() is the element name.
+        TEXT,			///< Value() is the text. CData() is true for a CDATA section.
+        COMMENT,		///< Value() is the comment.
+        DECLARATION,	///< Value() is the declaration, such as: xml version="1.0"
+        UNKNOWN,		///< Value() is the contents of the unknown tag, such as: !DOCTYPE
+        END_DOCUMENT,	///< The document was read successfully.
+        PARSE_ERROR,	///< See ErrorID().
+        NEED_MORE_INPUT	///< Only returned in push mode; Feed() more, or Finish().
+    };
+
+    /// constructor
+    XMLReader( bool processEntities = true, Whitespace whitespaceMode = PRESERVE_WHITESPACE );
+    ~XMLReader();
+
+    /**
+    	Starts reading a copy of 'xml'. If 'nBytes' is not specified,
+    	'xml' must be null terminated. Returns XML_SUCCESS, or
+    	XML_ERROR_EMPTY_DOCUMENT. Other errors are returned by Next().
+    */
+    XMLError Parse( const char* xml, size_t nBytes=static_cast<size_t>(-1) );
+    /**
+    	Starts reading 'xml' without copying it; the buffer is modified as
+    	it is read. See XMLDocument::ParseInPlace() for the buffer rules.
+    */
+    XMLError ParseInPlace( char* xml, size_t nBytes=static_cast<size_t>(-1), bool transferOwnership=false );
+
+    /**
+    	Pushes the next piece of the input; the data is copied. The
+    	first call after construction, Parse(), Finish() or Clear() starts
+    	a new document. Strings returned for the current token stay valid.
+    */
+    void Feed( const char* data, size_t nBytes );
+    /// Marks the end of the input pushed with Feed().
+    void Finish();
+
+    /// Advances to the next token, and returns its type.
+    TokenType Next();
+
+    /// The type of the current token.
+    TokenType Token() const {
+        return _token;
+    }
+    /// The name of the current element or attribute, or null for other tokens.
+    const char* Name() const;
+    /// The value of the current attribute, text, comment, declaration or unknown; otherwise null.
+    const char* Value() const;
+    /// True if the current TEXT token is a CDATA section.
+    bool CData() const {
+        return _cdata;
+    }
+    /**
+    	The value of the named attribute of the current element, or null
+    	if there is no such attribute. Only valid on the START_ELEMENT
+    	token, or its ATTRIBUTE tokens.
+    */
+    const char* Attribute( const char* name ) const;
+    /// The number of attributes of the current element.
+    int AttributeCount() const {
+        return static_cast<int>( _attributes.Size() );
+    }
+    /// Nesting depth of the current token; the root element is at depth 1.
+    int Depth() const {
+        return static_cast<int>( _elementStack.Size() ) + ( _token == END_ELEMENT ? 1 : 0 );
+    }
+    /// The line number the current token starts on.
+    int LineNum() const {
+        return _tokenLineNum;
+    }
+    /**
+    	The byte offset in the input where the current token starts. The
+    	ATTRIBUTE tokens have the offset of their start tag; the END_ELEMENT
+    	of an empty element, <foo/>, starts where its tag ends.
+    */
+    uint64_t TokenOffset() const {
+        return _tokenOffset;
+    }
+    /// The byte offset in the input just past the end of the current token.
+    uint64_t TokenEnd() const {
+        return _consumed + static_cast<uint64_t>( _p - _charBuffer );
+    }
+    /// Returns true if the document starts with a UTF-8 BOM.
+    bool HasBOM() const {
+        return _hasBOM;
+    }
+
+    /// Return true if there was an error reading the document.
+    bool Error() const {
+        return _errorID != XML_SUCCESS;
+    }
+    /// Return the errorID.
+    XMLError ErrorID() const {
+        return _errorID;
+    }
+    const char* ErrorName() const;
+    /// Return the line where the error occurred, or zero if unknown.
+    int ErrorLineNum() const {
+        return _errorLineNum;
+    }
+
+    /// Releases the buffer and resets the reader.
+    void Clear();
+
+private:
+    XMLReader( const XMLReader& );	// not supported
+    void operator=( const XMLReader& );	// not supported
+
+    struct Attr {
+        char*	name;
+        char*	nameEnd;
+        char*	valueStart;
+        char*	valueEnd;
+        int		valueFlags;
+        int		lineNum;
+    };
+
+    bool Start();
+    void Refill();
+    TokenType Truncated( XMLError error, int lineNum );
+    TokenType SetError( XMLError error, int lineNum );
+    TokenType ReadStartTag( char* p );
+    TokenType ReadEndTag( char* p );
+    TokenType ReadText( char* p, const char* endTag, int flags, TokenType token, XMLError error );
+    const char* AttributeValue( size_t i ) const;
+
+    bool			_processEntities;
+    Whitespace		_whitespaceMode;
+    bool			_hasBOM;
+    char*			_charBuffer;
+    bool			_charBufferOwned;
+    size_t			_charBufferSize;
+    size_t			_charBufferCapacity;	// push mode only
+    bool			_push;
+    bool			_finished;		// all of the input is in the buffer
+    bool			_started;		// white space and BOM at the start have been read
+    bool			_reading;		// more tokens to come
+    char*			_p;				// where reading resumes
+    char*			_restore;		// '<' to put back, after a text value was terminated
+    TokenType		_token;
+    bool			_cdata;
+    bool			_first;			// no token yet in the current element
+    bool			_emptyElement;	// the current START_ELEMENT was <foo/>
+    bool			_nonDeclaration;// something other than a declaration was read at document level
+    size_t			_elementName;	// offset in _names
+    mutable StrPair	_value;
+    int				_attributeIndex;
+    int				_lineNum;
+    int				_tokenLineNum;
+    uint64_t		_tokenOffset;
+    uint64_t		_consumed;		// input dropped from the front of the buffer, in push mode
+    XMLError		_errorID;
+    int				_errorLineNum;
+    // Where to rewind to, when a token turns out to be incomplete.
+    int				_rewindLineNum;
+    bool			_rewindFirst;
+    bool			_rewindNonDeclaration;
+
+    mutable DynArray< Attr, 10 >	_attributes;
+    // The names of the open elements are copied out, since in push
+    // mode the buffer moves. _elementStack holds offsets into _names.
+    DynArray< char, 256 >			_names;
+    DynArray< size_t, 10 >			_elementStack;
+    DynArray< char, 20 >			_pending;	// fed, but not yet moved into the buffer
+};
+
+
+/**
+	An index of where the elements of a large XML file are, so that one
+	can be read without reading the file. Build() reads the file once;
+	the index can then be saved beside it, and loaded (mapped, where that
+	is supported) whenever the file is read. XMLDocument::LoadSubtree()
+	reads one indexed element into a document.
+
+	Elements are indexed by key. An element with the key attribute is
+	indexed as its path, and the attribute's value:
+	@verbatim
+	/archive/record[@id='42']
+	@endverbatim
+	and the elements up to a depth are indexed by path alone:
+	@verbatim
+	/archive/header
+	@endverbatim
+	The value is as Attribute() returns it, with entities translated.
+	If more than one element has the same key, the first is found.
+
+	@verbatim
+	XMLIndex index;
+	if ( index.Load( "archive.xml.idx" ) != XML_SUCCESS ) {
+		index.Build( "archive.xml" );
+		index.Save( "archive.xml.idx" );
+	}
+	XMLDocument record;
+	record.LoadSubtree( "archive.xml", index, "/archive/record[@id='42']" );
+	@endverbatim
+*/
+class TINYXML2_LIB XMLIndex
+{
+public:
+    XMLIndex();
+    ~XMLIndex();
+
+    /**
+    	Reads 'filename', and indexes the elements with 'keyAttribute',
+    	and the elements no deeper than 'pathDepth' (the root element is
+    	at depth 1.) The file is read in pieces, so it can be any size.
+    	Returns XML_SUCCESS (0) on success, or an errorID.
+    */
+    XMLError Build( const char* filename, const char* keyAttribute = "id", int pathDepth = 2 );
+    /// Saves the index to a file.
+    XMLError Save( const char* filename ) const;
+    /**
+    	Loads an index saved with Save(), mapping it into memory where
+    	that is supported. Fails with XML_ERROR_INVALID_SNAPSHOT if it
+    	isn't an index of this version and byte order, or is damaged.
+    */
+    XMLError Load( const char* filename );
+    /// Frees the index.
+    void Clear();
+
+    /**
+    	Finds the element indexed as 'key'. Returns false if there is
+    	none; otherwise sets the offsets in the file of the first byte of
+    	the element, and the byte after it.
+    */
+    bool Find( const char* key, uint64_t* start, uint64_t* end ) const;
+    /// The number of keys.
+    uint32_t KeyCount() const {
+        return _entryCount;
+    }
+    /// The size of the indexed file, when it was indexed.
+    uint64_t SourceSize() const {
+        return _sourceSize;
+    }
+
+private:
+    XMLIndex( const XMLIndex& );	// not supported
+    void operator=( const XMLIndex& );	// not supported
+
+    static const uint32_t NONE = 0xffffffff;
+    struct Entry {
+        uint64_t start;
+        uint64_t end;
+        uint32_t key;		// offset into _strings
+        uint32_t reserved;
+    };
+
+    struct Builder;	// the tables, as Build() makes them
+    XMLError Attach( const void* data, size_t size );
+
+    char*           _memory;	// everything below is in here, if it is owned
+    void*           _mapping;	// or in here, for a mapped index
+    size_t          _mappingSize;
+    const Entry*    _entries;
+    uint32_t        _entryCount;
+    const uint32_t* _table;		// open addressed, indices of the entries, NONE if empty
+    uint32_t        _tableSize;
+    const char*     _strings;
+    uint32_t        _stringsSize;
+    uint64_t        _sourceSize;
+};
+
+
 } // namespace tinyxml2
 
 #if defined(_MSC_VER)
@@ -17,8 +17,11 @@
 	_CrtMemState startMemState;
 	_CrtMemState endMemState;
 #else
+	#include <fcntl.h>
 	#include <sys/stat.h>
 	#include <sys/types.h>
+	#include <sys/wait.h>
+	#include <unistd.h>
 #endif
 
 using namespace tinyxml2;
@@ -112,6 +115,105 @@ void NullLineEndings( char* p )
 }
 
 
+// Prints the current token of an XMLReader; printing all of them
+// reproduces the document.
+void PrintToken( const XMLReader& reader, XMLPrinter* printer )
+{
+	switch( reader.Token() ) {
+		case XMLReader::START_ELEMENT:	printer->OpenElement( reader.Name() );						break;
+		case XMLReader::ATTRIBUTE:		printer->PushAttribute( reader.Name(), reader.Value() );	break;
+		case XMLReader::END_ELEMENT:	printer->CloseElement();									break;
+		case XMLReader::TEXT:			printer->PushText( reader.Value(), reader.CData() );		break;
+		case XMLReader::COMMENT:		printer->PushComment( reader.Value() );						break;
+		case XMLReader::DECLARATION:	printer->PushDeclaration( reader.Value() );					break;
+		case XMLReader::UNKNOWN:		printer->PushUnknown( reader.Value() );						break;
+		default:																					break;
+	}
+}
+
+
+#if !defined( _MSC_VER ) && !defined( WIN32 )
+// Makes a FIFO at 'path', and a child process that writes 'size' bytes
+// of 'data' to it once it is opened. Returns the child.
+pid_t WriteFifo( const char* path, const void* data, size_t size )
+{
+	unlink( path );
+	if ( mkfifo( path, 0600 ) != 0 ) {
+		return -1;
+	}
+	const pid_t child = fork();
+	if ( child == 0 ) {
+		const int fd = open( path, O_WRONLY );
+		const char* p = static_cast<const char*>( data );
+		while( fd >= 0 && size > 0 ) {
+			const ssize_t written = write( fd, p, size );
+			if ( written <= 0 ) {
+				break;
+			}
+			p += written;
+			size -= static_cast<size_t>( written );
+		}
+		_exit( size == 0 ? 0 : 1 );
+	}
+	return child;
+}
+
+
+// Waits for a WriteFifo() child; true if it wrote everything.
+bool FinishFifo( const char* path, pid_t child )
+{
+	int status = 0;
+	const bool wrote = child > 0 && waitpid( child, &status, 0 ) == child && WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+	unlink( path );
+	return wrote;
+}
+#endif
+
+
+// Keeps the play up to the end of its first act.
+class FirstActFilter : public XMLParseFilter
+{
+public:
+	FirstActFilter() : _acts( 0 ) {}
+
+	virtual Action OpenElement( const XMLElement& element ) {
+		return XMLUtil::StringEqual( element.Name(), "ACT" ) && _acts > 0 ? STOP : KEEP;
+	}
+	virtual bool CloseElement( const XMLElement& element ) {
+		if ( XMLUtil::StringEqual( element.Name(), "ACT" ) ) {
+			++_acts;
+		}
+		return true;
+	}
+
+private:
+	int _acts;
+};
+
+
+// Counts what goes through it, on its way to and from the heap.
+class CountingAllocator : public XMLAllocator
+{
+public:
+	CountingAllocator() : allocs( 0 ), frees( 0 ), bytes( 0 ) {}
+
+	virtual void* Allocate( size_t size ) {
+		++allocs;
+		bytes += size;
+		return malloc( size );
+	}
+	virtual void Free( void* mem, size_t size ) {
+		++frees;
+		bytes -= size;
+		free( mem );
+	}
+
+	int allocs;
+	int frees;
+	size_t bytes;
+};
+
+
 int example_1()
 {
 	XMLDocument doc;
@@ -1292,6 +1394,37 @@ int main( int argc, const char ** argv )
 		doc.PrintError();
 	}
 
+	{
+		// Repeated attributes, among many. Names that are prefixes of
+		// each other are different attributes.
+		XMLDocument doc;
+		doc.Parse( "<element ab='1' a='2' abc='3'/>" );
+		XMLTest( "Attribute names that are prefixes", false, doc.Error() );
+
+		const int COUNT = 1000;
+		char* xml = new char[COUNT * 16 + 32];
+		char* q = xml;
+		q += sprintf( q, "<element" );
+		for ( int i = 0; i < COUNT; ++i ) {
+			q += sprintf( q, " a%d='%d'", i, i );
+		}
+		sprintf( q, "/>" );
+		doc.Parse( xml );
+		XMLTest( "Many attributes", false, doc.Error() );
+		XMLTest( "Many attributes", "999", doc.RootElement()->Attribute( "a999" ) );
+		int count = 0;
+		for ( const XMLAttribute* a = doc.RootElement()->FirstAttribute(); a; a = a->Next() ) {
+			++count;
+		}
+		XMLTest( "Many attributes", COUNT, count );
+
+		sprintf( q, "\n a500='x'/>" );
+		doc.Parse( xml );
+		XMLTest( "Repeated attribute among many", XML_ERROR_PARSING_ATTRIBUTE, doc.ErrorID() );
+		XMLTest( "Repeated attribute among many", 2, doc.ErrorLineNum() );
+		delete [] xml;
+	}
+
 	{
 		// Embedded null in stream.
 		const char* doctype = "<element att\0r='red' attr='blue' />";
@@ -1869,6 +2002,24 @@ int main( int argc, const char ** argv )
 		XMLTest( "Whitespace  all space", true, 0 == doc.FirstChildElement()->FirstChild() );
 	}
 
+	{
+		// Character references to whitespace collapse like whitespace.
+		const char* xml = "<element>&#32; a&#x9;&#10; b &#x4e2d;\r\n</element>";
+		XMLDocument doc( true, COLLAPSE_WHITESPACE );
+		doc.Parse( xml );
+		XMLTest( "Whitespace collapse of references", "a b \xe4\xb8\xad", doc.FirstChildElement()->GetText() );
+	}
+
+	{
+		// Line endings, entities, and an '&' that isn't an entity, which
+		// is kept as it is.
+		const char* xml = "<element a='1\r\n2\n\r3\r4'>&lt;&amp; &bogus; &#65;&#x42; &lt</element>";
+		XMLDocument doc;
+		doc.Parse( xml );
+		XMLTest( "Normalize line endings", "1\n2\n3\n4", doc.FirstChildElement()->Attribute( "a" ) );
+		XMLTest( "Decode entities", "<& &bogus; AB &lt", doc.FirstChildElement()->GetText() );
+	}
+
 	// ----------- Preserve Whitespace ------------
 	{
 		const char* xml = "<element>This  is  &apos;  \n\n text &apos;</element>";
@@ -2421,9 +2572,9 @@ int main( int argc, const char ** argv )
 		//      text would be leaked. An edge case, but annoying.
 		// Now:
 		//      The XMLElement destructor is called. But the unlinked nodes
-		//      have to be tracked using a list. This has a minor performance
-		//      impact that can become significant if you have a lot of
-		//      unlinked nodes. (But why would you do that?)
+		//      have to be tracked using a list. Each node knows its place
+		//      in the list, so however many there are, linking or deleting
+		//      one takes constant time.
 		// The only way to see this bug was in a Visual C++ runtime debug heap
 		// leak tracker. This is compiled in by default on Windows Debug and
 		// enabled with _CRTDBG_LEAK_CHECK_DF parameter passed to _CrtSetDbgFlag().
@@ -2436,6 +2587,33 @@ int main( int argc, const char ** argv )
 			XMLElement* ele = doc.NewElement("LEAK 2");
 			doc.DeleteNode(ele);
 		}
+		{
+			// Many nodes created before any is linked, then linked,
+			// deleted, or left for the document, in a different order.
+			XMLDocument doc;
+			const int COUNT = 10000;
+			XMLNode** nodes = new XMLNode*[COUNT];
+			for( int i = 0; i < COUNT; ++i ) {
+				nodes[i] = ( i % 3 == 2 ) ? static_cast<XMLNode*>( doc.NewText( "text" ) ) : doc.NewElement( "row" );
+			}
+			XMLElement* root = doc.NewElement( "table" );
+			doc.InsertEndChild( root );
+			int linked = 0;
+			for( int i = COUNT - 1; i >= 0; i -= 2 ) {
+				root->InsertFirstChild( nodes[i] );
+				++linked;
+			}
+			for( int i = 0; i < COUNT; i += 4 ) {
+				doc.DeleteNode( nodes[i] );
+			}
+			int children = 0;
+			for( const XMLNode* child = root->FirstChild(); child; child = child->NextSibling() ) {
+				++children;
+			}
+			XMLTest( "Unlinked nodes linked", linked, children );
+			XMLTest( "Unlinked nodes in order", true, root->FirstChild() == nodes[1] && root->LastChild() == nodes[COUNT - 1] );
+			delete [] nodes;
+		}
 	}
 
 	{
@@ -2736,6 +2914,1431 @@ int main( int argc, const char ** argv )
 		}
 	}
 	
+	// ---------- ParseInPlace ------
+	{
+		char xml[] = "<root><child attr='a&amp;b'>text &lt;here&gt;</child></root>TRAILING";
+		const size_t nBytes = strlen( "<root><child attr='a&amp;b'>text &lt;here&gt;</child></root>" );
+		XMLDocument doc;
+		doc.ParseInPlace( xml, nBytes );
+		XMLTest( "ParseInPlace borrowed buffer", false, doc.Error() );
+		const XMLElement* child = doc.RootElement()->FirstChildElement( "child" );
+		XMLTest( "ParseInPlace attribute", "a&b", child->Attribute( "attr" ) );
+		XMLTest( "ParseInPlace text", "text <here>", child->GetText() );
+		const bool inBuffer = child->GetText() >= xml && child->GetText() < xml + sizeof( xml );
+		XMLTest( "ParseInPlace strings point into the buffer", true, inBuffer );
+
+		const char* src = "<a><b/></a>";
+		char* owned = new char[strlen( src ) + 1];
+		strcpy( owned, src );
+		XMLDocument ownerDoc;
+		ownerDoc.ParseInPlace( owned, static_cast<size_t>(-1), true );
+		XMLTest( "ParseInPlace transferred buffer", false, ownerDoc.Error() );
+		XMLTest( "ParseInPlace transferred buffer", "b", ownerDoc.RootElement()->FirstChildElement()->Name() );
+
+		char empty[] = "";
+		doc.ParseInPlace( empty );
+		XMLTest( "ParseInPlace empty buffer", XML_ERROR_EMPTY_DOCUMENT, doc.ErrorID() );
+
+		char* emptyOwned = new char[1];
+		emptyOwned[0] = 0;
+		doc.ParseInPlace( emptyOwned, 0, true );
+		XMLTest( "ParseInPlace empty transferred buffer", XML_ERROR_EMPTY_DOCUMENT, doc.ErrorID() );
+	}
+
+	// ---------- LoadFileMapped ------
+	{
+		XMLDocument doc;
+		doc.LoadFile( "resources/dream.xml" );
+		XMLPrinter loaded;
+		doc.Print( &loaded );
+
+		XMLDocument mappedDoc;
+		mappedDoc.LoadFileMapped( "resources/dream.xml" );
+		XMLTest( "LoadFileMapped dream.xml", false, mappedDoc.Error() );
+		XMLPrinter mapped;
+		mappedDoc.Print( &mapped );
+		XMLTest( "LoadFileMapped matches LoadFile", loaded.CStr(), mapped.CStr(), false );
+		mappedDoc.Clear();
+		XMLTest( "LoadFileMapped Clear()", true, mappedDoc.NoChildren() );
+
+		// A file that is an exact multiple of the page size has no slack
+		// for the null terminator at the end of the mapping.
+		FILE* pageFP = fopen( "resources/out/pagesized.xml", "wb" );
+		fputs( "<root>", pageFP );
+		for ( int i = 0; i < 4096 - 13; ++i ) {
+			fputc( 'x', pageFP );
+		}
+		fputs( "</root>", pageFP );
+		fclose( pageFP );
+		mappedDoc.LoadFileMapped( "resources/out/pagesized.xml" );
+		XMLTest( "LoadFileMapped page sized file", false, mappedDoc.Error() );
+		XMLTest( "LoadFileMapped page sized file", 4096 - 13, static_cast<int>( strlen( mappedDoc.RootElement()->GetText() ) ) );
+
+		mappedDoc.LoadFileMapped( "resources/no-such-file.xml" );
+		XMLTest( "LoadFileMapped missing file", XML_ERROR_FILE_NOT_FOUND, mappedDoc.ErrorID() );
+	}
+
+#if !defined( _MSC_VER ) && !defined( WIN32 )
+	// ---------- Non-seekable input ------
+	{
+		XMLDocument doc;
+		doc.LoadFile( "resources/dream.xml" );
+		XMLPrinter loaded;
+		doc.Print( &loaded );
+
+		XMLDocument piped;
+		FILE* pipeFP = popen( "cat resources/dream.xml", "r" );
+		piped.LoadFile( pipeFP );
+		pclose( pipeFP );
+		XMLTest( "LoadFile from a pipe", false, piped.Error() );
+		XMLPrinter pipedFile;
+		piped.Print( &pipedFile );
+		XMLTest( "LoadFile from a pipe", loaded.CStr(), pipedFile.CStr(), false );
+
+		pipeFP = popen( "cat resources/dream.xml", "r" );
+		piped.LoadFileDescriptor( fileno( pipeFP ) );
+		pclose( pipeFP );
+		XMLTest( "LoadFileDescriptor from a pipe", false, piped.Error() );
+		XMLPrinter pipedFD;
+		piped.Print( &pipedFD );
+		XMLTest( "LoadFileDescriptor from a pipe", loaded.CStr(), pipedFD.CStr(), false );
+
+		// A regular file is read from where the descriptor is.
+		const int fd = open( "resources/dream.xml", O_RDONLY );
+		piped.LoadFileDescriptor( fd );
+		XMLPrinter fileFD;
+		piped.Print( &fileFD );
+		XMLTest( "LoadFileDescriptor from a file", loaded.CStr(), fileFD.CStr(), false );
+		char head[256] = { 0 };
+		lseek( fd, 0, SEEK_SET );
+		XMLTest( "LoadFileDescriptor from the middle of a file", true, read( fd, head, sizeof( head ) - 1 ) > 0 );
+		lseek( fd, static_cast<off_t>( strstr( head, "<PLAY>" ) - head ), SEEK_SET );
+		piped.LoadFileDescriptor( fd );
+		close( fd );
+		XMLTest( "LoadFileDescriptor from the middle of a file", false, piped.Error() );
+		XMLTest( "LoadFileDescriptor from the middle of a file", "PLAY", piped.FirstChild()->Value() );
+
+		int ends[2];
+		XMLTest( "Empty pipe", 0, pipe( ends ) );
+		close( ends[1] );
+		piped.LoadFileDescriptor( ends[0] );
+		close( ends[0] );
+		XMLTest( "LoadFileDescriptor from an empty pipe", XML_ERROR_EMPTY_DOCUMENT, piped.ErrorID() );
+		XMLTest( "LoadFileDescriptor from a bad descriptor", XML_ERROR_FILE_READ_ERROR, piped.LoadFileDescriptor( -1 ) );
+
+		// A FIFO can't be mapped; it is read through, once.
+		static const char fifoXML[] = "<fifo><read once='yes'/></fifo>";
+		const pid_t writer = WriteFifo( "resources/out/fifo.xml", fifoXML, sizeof( fifoXML ) - 1 );
+		XMLTest( "LoadFileMapped from a FIFO", true, writer > 0 );
+		if ( writer > 0 ) {
+			piped.LoadFileMapped( "resources/out/fifo.xml" );
+			XMLTest( "LoadFileMapped from a FIFO", true, FinishFifo( "resources/out/fifo.xml", writer ) );
+			XMLTest( "LoadFileMapped from a FIFO", false, piped.Error() );
+			XMLTest( "LoadFileMapped from a FIFO", "yes", piped.RootElement()->FirstChildElement( "read" )->Attribute( "once" ) );
+		}
+	}
+#endif
+
+	// ---------- LoadFilePipelined ------
+	{
+		// Big enough for several chunks, with markup that is split between
+		// them wherever they happen to end.
+		FILE* bigFP = fopen( "resources/out/pipelined.xml", "wb" );
+		fputs( "\xef\xbb\xbf<?xml version='1.0'?>\n<root>\n", bigFP );
+		for ( int i = 0; i < 20000; ++i ) {
+			fprintf( bigFP, "<item id='%d' note=\"a > b\">text %d &amp; more<!-- c%d --><![CDATA[<%d>]]></item>\n", i, i, i, i );
+		}
+		fputs( "<last/></root>\n", bigFP );
+		fclose( bigFP );
+
+		const char* files[] = { "resources/dream.xml", "resources/out/pipelined.xml", "resources/utf8test.xml" };
+		for ( int i = 0; i < 3; ++i ) {
+			XMLDocument doc;
+			doc.LoadFile( files[i] );
+			XMLPrinter loaded;
+			doc.Print( &loaded );
+
+			XMLDocument pipelined;
+			pipelined.LoadFilePipelined( files[i] );
+			XMLTest( "LoadFilePipelined", false, pipelined.Error() );
+			XMLPrinter printed;
+			pipelined.Print( &printed );
+			XMLTest( "LoadFilePipelined matches LoadFile", loaded.CStr(), printed.CStr(), false );
+			XMLTest( "LoadFilePipelined BOM", doc.HasBOM(), pipelined.HasBOM() );
+			XMLTest( "LoadFilePipelined line numbers", doc.RootElement()->LastChildElement()->GetLineNum(),
+				pipelined.RootElement()->LastChildElement()->GetLineNum() );
+		}
+
+		// Errors, early and late, are the ones LoadFile() finds.
+		const char* broken[] = { "<root><a></b></root>", "<root>\n<a/>\n<b></root>" };
+		for ( int i = 0; i < 2; ++i ) {
+			bigFP = fopen( "resources/out/pipelined.xml", "wb" );
+			fputs( "<root>\n", bigFP );
+			for ( int j = 0; j < 20000 * i; ++j ) {
+				fputs( "<item>text</item>\n", bigFP );
+			}
+			fputs( broken[i], bigFP );
+			fclose( bigFP );
+			XMLDocument doc;
+			doc.LoadFile( "resources/out/pipelined.xml" );
+			XMLDocument pipelined;
+			pipelined.LoadFilePipelined( "resources/out/pipelined.xml" );
+			XMLTest( "LoadFilePipelined error", true, doc.Error() );
+			XMLTest( "LoadFilePipelined error", doc.ErrorID(), pipelined.ErrorID() );
+			XMLTest( "LoadFilePipelined error line", doc.ErrorLineNum(), pipelined.ErrorLineNum() );
+			XMLTest( "LoadFilePipelined error", true, pipelined.NoChildren() );
+		}
+
+		XMLDocument missing;
+		missing.LoadFilePipelined( "resources/no-such-file.xml" );
+		XMLTest( "LoadFilePipelined missing file", XML_ERROR_FILE_NOT_FOUND, missing.ErrorID() );
+	}
+
+	// ---------- Text scanning at every alignment ------
+	{
+		bool textOK = true;
+		bool linesOK = true;
+		for ( int i = 0; i < 48; ++i ) {
+			char xml[256];
+			char expected[128];
+			char* e = expected;
+			for ( int k = 0; k < i; ++k ) {
+				*e++ = static_cast<char>( 'a' + k % 26 );
+			}
+			strcpy( e, "\n-]>\n" );
+			// Shift the start, so the text lands at different alignments.
+			memset( xml, ' ', i % 16 );
+			xml[i % 16] = 0;
+			strcat( xml, "<root>" );
+			strcat( xml, expected );
+			strcat( xml, "<!--" );
+			strcat( xml, expected );
+			strcat( xml, "-->\n<![CDATA[" );
+			strcat( xml, expected );
+			strcat( xml, "]]><child/></root>" );
+
+			XMLDocument doc;
+			doc.Parse( xml );
+			const XMLElement* root = doc.RootElement();
+			if ( doc.Error() || !root ) {
+				textOK = false;
+				continue;
+			}
+			const XMLNode* text = root->FirstChild();
+			const XMLNode* comment = text->NextSibling();
+			const XMLNode* cdata = comment->NextSibling();
+			if ( strcmp( text->Value(), expected ) || strcmp( comment->Value(), expected ) || strcmp( cdata->Value(), expected ) ) {
+				textOK = false;
+			}
+			if ( comment->GetLineNum() != 3 || cdata->GetLineNum() != 6 || root->FirstChildElement( "child" )->GetLineNum() != 8 ) {
+				linesOK = false;
+			}
+		}
+		XMLTest( "Text scanning at every alignment", true, textOK );
+		XMLTest( "Line numbers at every alignment", true, linesOK );
+	}
+
+	// ---------- Character classification ------
+	{
+		// The classification table must agree with <cctype> in the "C" locale.
+		bool classesOK = true;
+		for ( int i = 0; i < 256; ++i ) {
+			const unsigned char ch = static_cast<unsigned char>( i );
+			const bool high = ch >= 128;
+			const bool space = !high && isspace( ch );
+			const bool nameStart = high || isalpha( ch ) || ch == ':' || ch == '_';
+			const bool name = nameStart || isdigit( ch ) || ch == '.' || ch == '-';
+			if ( XMLUtil::IsWhiteSpace( static_cast<char>( ch ) ) != space
+				|| XMLUtil::IsNameStartChar( ch ) != nameStart
+				|| XMLUtil::IsNameChar( ch ) != name ) {
+				classesOK = false;
+			}
+		}
+		XMLTest( "Character classification", true, classesOK );
+	}
+
+	// ---------- Deep nesting ------
+	{
+		// The parser doesn't recurse, so with the limit off, nesting is
+		// bounded by memory rather than by the stack.
+		const int DEPTH = 100000;
+		char* xml = new char[DEPTH * 7 + 1];
+		char* q = xml;
+		for ( int i = 0; i < DEPTH; ++i ) {
+			memcpy( q, "<a>", 3 );
+			q += 3;
+		}
+		for ( int i = 0; i < DEPTH; ++i ) {
+			memcpy( q, "</a>", 4 );
+			q += 4;
+		}
+		*q = 0;
+
+		XMLDocument doc;
+		XMLTest( "Default max element depth", TINYXML2_MAX_ELEMENT_DEPTH, doc.MaxElementDepth() );
+		doc.Parse( xml );
+		XMLTest( "Deep nesting rejected by default", XML_ELEMENT_DEPTH_EXCEEDED, doc.ErrorID() );
+
+		doc.SetMaxElementDepth( 0 );
+		doc.Parse( xml );
+		XMLTest( "Deep nesting with no limit", false, doc.Error() );
+		int depth = 0;
+		for ( const XMLElement* ele = doc.RootElement(); ele; ele = ele->FirstChildElement() ) {
+			++depth;
+		}
+		XMLTest( "Deep nesting depth", DEPTH, depth );
+
+		// Mismatched end tag at the bottom of the nest.
+		xml[DEPTH * 3 + 2] = 'b';
+		doc.Parse( xml );
+		XMLTest( "Deep nesting mismatch", XML_ERROR_MISMATCHED_ELEMENT, doc.ErrorID() );
+		XMLTest( "Deep nesting mismatch cleans up", true, doc.NoChildren() );
+
+		doc.SetMaxElementDepth( 10 );
+		doc.Parse( "<a><b><c><d><e><f><g><h><i><j><k/></j></i></h></g></f></e></d></c></b></a>" );
+		XMLTest( "Lowered max element depth", XML_ELEMENT_DEPTH_EXCEEDED, doc.ErrorID() );
+		doc.Parse( "<a><b><c><d><e/></d></c></b></a>" );
+		XMLTest( "Within lowered max element depth", false, doc.Error() );
+		delete [] xml;
+	}
+
+	// ---------- Parallel parse ------
+	{
+		// Big enough to split into several ranges, with the markup the
+		// prescan has to step over: '>' in attribute values, line feeds
+		// inside tags, comments and CDATA, and end tags with spaces.
+		const int RECORDS = 20000;
+		char* xml = new char[RECORDS * 200 + 100];
+		char* q = xml;
+		q += sprintf( q, "<?xml version='1.0'?>\n<!-- records -->\n<records count='%d'>\n", RECORDS );
+		for ( int i = 0; i < RECORDS; ++i ) {
+			q += sprintf( q,
+				"\t<record id='%d' note=\"a > b\n\">\n"
+				"\t\t<name>Item &amp; %d</name><empty\n/>\n"
+				"\t\t<!-- <not an element> -->\n"
+				"\t\t<data><![CDATA[<raw>\n]]></data >\n"
+				"\t</record>\n", i, i );
+		}
+		q += sprintf( q, "\ttrailing text\n</records>\n<!-- after -->\n" );
+
+		const Whitespace modes[] = { PRESERVE_WHITESPACE, COLLAPSE_WHITESPACE, PEDANTIC_WHITESPACE };
+		for ( int m = 0; m < 3; ++m ) {
+			XMLDocument serial( true, modes[m] );
+			serial.Parse( xml );
+			XMLTest( "Parallel parse: serial parse", false, serial.Error() );
+			XMLTest( "Default parse threads", 1, serial.ParseThreads() );
+
+			XMLDocument parallel( true, modes[m] );
+			parallel.SetParseThreads( 4 );
+			parallel.Parse( xml );
+			XMLTest( "Parallel parse", false, parallel.Error() );
+
+			XMLPrinter serialPrinter;
+			serial.Print( &serialPrinter );
+			XMLPrinter parallelPrinter;
+			parallel.Print( &parallelPrinter );
+			XMLTest( "Parallel parse matches serial", serialPrinter.CStr(), parallelPrinter.CStr(), false );
+
+			// Walk both trees together, comparing line numbers.
+			int nodes = 0;
+			int lineMismatches = 0;
+			const XMLNode* a = serial.FirstChild();
+			const XMLNode* b = parallel.FirstChild();
+			while ( a && b ) {
+				++nodes;
+				if ( a->GetLineNum() != b->GetLineNum() ) {
+					++lineMismatches;
+				}
+				const XMLElement* ea = a->ToElement();
+				const XMLElement* eb = b->ToElement();
+				if ( ea && eb && ea->FirstAttribute() && eb->FirstAttribute()
+					&& ea->FirstAttribute()->GetLineNum() != eb->FirstAttribute()->GetLineNum() ) {
+					++lineMismatches;
+				}
+				if ( a->FirstChild() && b->FirstChild() ) {
+					a = a->FirstChild();
+					b = b->FirstChild();
+					continue;
+				}
+				while ( a && b && !a->NextSibling() && !b->NextSibling() ) {
+					a = a->Parent();
+					b = b->Parent();
+				}
+				a = a ? a->NextSibling() : 0;
+				b = b ? b->NextSibling() : 0;
+			}
+			XMLTest( "Parallel parse visits every node", true, nodes > RECORDS * 6 );
+			XMLTest( "Parallel parse line numbers", 0, lineMismatches );
+		}
+
+		// An error late in the document is reported as the serial parse
+		// reports it.
+		char* bad = strstr( xml + strlen( xml ) / 2 + strlen( xml ) / 4, "</name>" );
+		bad[2] = 'm';
+		XMLDocument serial;
+		serial.Parse( xml );
+		XMLDocument parallel;
+		parallel.SetParseThreads( 4 );
+		parallel.Parse( xml );
+		XMLTest( "Parallel parse error", XML_ERROR_MISMATCHED_ELEMENT, parallel.ErrorID() );
+		XMLTest( "Parallel parse error matches serial", serial.ErrorID(), parallel.ErrorID() );
+		XMLTest( "Parallel parse error line", serial.ErrorLineNum(), parallel.ErrorLineNum() );
+		XMLTest( "Parallel parse error string", serial.ErrorStr(), parallel.ErrorStr() );
+		XMLTest( "Parallel parse error cleans up", true, parallel.NoChildren() );
+
+		// Small documents are parsed serially.
+		parallel.SetParseThreads( 0 );
+		parallel.Parse( "<a><b/><c/></a>" );
+		XMLTest( "Parallel parse small document", false, parallel.Error() );
+		XMLTest( "Parallel parse small document", "c", parallel.RootElement()->LastChildElement()->Name() );
+		delete [] xml;
+	}
+
+	// ---------- Lazy parse ------
+	{
+		const char* files[] = { "resources/dream.xml", "resources/utf8test.xml" };
+		const Whitespace modes[] = { PRESERVE_WHITESPACE, COLLAPSE_WHITESPACE, PEDANTIC_WHITESPACE };
+		for ( int f = 0; f < 2; ++f ) {
+			for ( int m = 0; m < 3; ++m ) {
+				XMLDocument eager( true, modes[m] );
+				eager.LoadFile( files[f] );
+				XMLDocument lazy( true, modes[m] );
+				XMLTest( "Lazy parse off by default", false, lazy.LazyParse() );
+				lazy.SetLazyParse( true );
+				lazy.LoadFile( files[f] );
+				XMLTest( "Lazy parse", false, lazy.Error() );
+
+				XMLPrinter eagerPrinter;
+				eager.Print( &eagerPrinter );
+				XMLPrinter lazyPrinter;
+				lazy.Print( &lazyPrinter );
+				XMLTest( "Lazy parse matches eager", eagerPrinter.CStr(), lazyPrinter.CStr(), false );
+
+				int lineMismatches = 0;
+				const XMLNode* a = eager.FirstChild();
+				const XMLNode* b = lazy.FirstChild();
+				while ( a && b ) {
+					if ( a->GetLineNum() != b->GetLineNum() ) {
+						++lineMismatches;
+					}
+					if ( a->FirstChild() && b->FirstChild() ) {
+						a = a->FirstChild();
+						b = b->FirstChild();
+						continue;
+					}
+					while ( a && b && !a->NextSibling() && !b->NextSibling() ) {
+						a = a->Parent();
+						b = b->Parent();
+					}
+					a = a ? a->NextSibling() : 0;
+					b = b ? b->NextSibling() : 0;
+				}
+				XMLTest( "Lazy parse line numbers", 0, lineMismatches );
+				XMLTest( "Lazy parse walks both trees", true, a == 0 && b == 0 );
+			}
+		}
+
+		// Only what is asked for is parsed; the markup that is skipped
+		// includes things that look like tags.
+		XMLDocument doc;
+		doc.SetLazyParse( true );
+		doc.Parse( "<root>\n<a x='>'><![CDATA[</a>]]><!-- </a> --><b/></a>\n<c>text</c>\n</d/>\n</root>" );
+		XMLTest( "Lazy parse lookup", false, doc.Error() );
+		XMLElement* root = doc.RootElement();
+		XMLTest( "Lazy parse lookup", "c", root->FirstChildElement( "c" )->Name() );
+		XMLTest( "Lazy parse text", "text", root->FirstChildElement( "c" )->GetText() );
+		XMLTest( "Lazy parse text line", 3, root->FirstChildElement( "c" )->FirstChild()->GetLineNum() );
+		XMLTest( "Lazy parse empty end tag", "d", root->LastChildElement()->Name() );
+		XMLTest( "Lazy parse CDATA", "</a>", root->FirstChildElement( "a" )->FirstChild()->Value() );
+		XMLTest( "Lazy parse after CDATA", "b", root->FirstChildElement( "a" )->LastChildElement()->Name() );
+
+		// Inserting into, or deleting from, an element that hasn't been
+		// read yet works as it does on a parsed one.
+		doc.Parse( "<root><a><b/><c/></a><e><f/></e></root>" );
+		XMLElement* a = doc.RootElement()->FirstChildElement( "a" );
+		a->InsertEndChild( doc.NewElement( "d" ) );
+		XMLElement* e = doc.RootElement()->LastChildElement();
+		e->DeleteChildren();
+		XMLPrinter printer( 0, true );
+		doc.Print( &printer );
+		XMLTest( "Lazy parse insert and delete", "<root><a><b/><c/><d/></a><e/></root>", printer.CStr() );
+
+		XMLDocument clone;
+		doc.Parse( "<root><a><b>1</b></a></root>" );
+		doc.DeepCopy( &clone );
+		XMLTest( "Lazy parse deep copy", "1", clone.RootElement()->FirstChildElement( "a" )->FirstChildElement( "b" )->GetText() );
+
+		// The end tags are checked by the parse; errors inside the content
+		// are found when it is read.
+		doc.Parse( "<root><a></b></rot>" );
+		XMLTest( "Lazy parse mismatched end tag", XML_ERROR_MISMATCHED_ELEMENT, doc.ErrorID() );
+		doc.Parse( "<root>\n<a><b x=1/></a>\n</root>" );
+		XMLTest( "Lazy parse deferred error", false, doc.Error() );
+		XMLTest( "Lazy parse deferred error", true, doc.RootElement()->FirstChildElement( "a" )->NoChildren() );
+		XMLTest( "Lazy parse deferred error", XML_ERROR_PARSING_ATTRIBUTE, doc.ErrorID() );
+		XMLTest( "Lazy parse deferred error line", 2, doc.ErrorLineNum() );
+
+		// An error in one element doesn't stop the others being read.
+		doc.Parse( "<r><a><x y=1/></a><b><z/></b><c><w/></c></r>" );
+		XMLTest( "Lazy parse error in one element", false, doc.Error() );
+		XMLTest( "Lazy parse error in one element", true, doc.RootElement()->FirstChildElement( "a" )->FirstChildElement() == 0 );
+		XMLTest( "Lazy parse error in one element", XML_ERROR_PARSING_ATTRIBUTE, doc.ErrorID() );
+		const XMLElement* z = doc.RootElement()->FirstChildElement( "b" )->FirstChildElement();
+		XMLTest( "Lazy parse after an error", true, z != 0 );
+		XMLTest( "Lazy parse after an error", "z", z ? z->Name() : "" );
+		XMLTest( "Lazy parse after an error", XML_ERROR_PARSING_ATTRIBUTE, doc.ErrorID() );
+		doc.ClearError();
+		XMLTest( "Lazy parse after ClearError", "w", doc.RootElement()->FirstChildElement( "c" )->FirstChildElement()->Name() );
+		XMLTest( "Lazy parse after ClearError", false, doc.Error() );
+
+		doc.SetMaxElementDepth( 4 );
+		doc.Parse( "<a><b><c><d/></c></b></a>" );
+		XMLTest( "Lazy parse depth", false, doc.Error() );
+		XMLTest( "Lazy parse depth", "b", doc.RootElement()->FirstChildElement()->Name() );
+		XMLTest( "Lazy parse depth", true, doc.RootElement()->FirstChildElement()->NoChildren() );
+		XMLTest( "Lazy parse depth", XML_ELEMENT_DEPTH_EXCEEDED, doc.ErrorID() );
+	}
+
+	// ---------- Freeze ------
+	{
+		const char* xml =
+			"<?xml version='1.0'?>\n"
+			"<root a='x &amp; y'>\n"
+			"  <item id='1'>  one  &lt;1&gt;  </item>\n"
+			"  <item id='2'><![CDATA[two]]><!-- c --></item>\n"
+			"</root>\n";
+		const size_t length = strlen( xml );
+		char* buffer = new char[length + 1];
+		char* snapshot = new char[length + 1];
+
+		for ( int frozen = 0; frozen < 2; ++frozen ) {
+			memcpy( buffer, xml, length + 1 );
+			XMLDocument doc( true, COLLAPSE_WHITESPACE );
+			doc.SetLazyParse( true );
+			doc.ParseInPlace( buffer, length );
+			if ( frozen ) {
+				doc.Freeze();
+			}
+			memcpy( snapshot, buffer, length + 1 );
+
+			const XMLDocument& reader = doc;
+			XMLTest( "Freeze: read", "x & y", reader.RootElement()->Attribute( "a" ) );
+			XMLTest( "Freeze: read", "one <1>", reader.RootElement()->FirstChildElement( "item" )->GetText() );
+			XMLPrinter printer( 0, true );
+			reader.Print( &printer );
+			XMLTest( "Freeze: read",
+				"<?xml version='1.0'?><root a=\"x &amp; y\"><item id=\"1\">one &lt;1&gt;</item><item id=\"2\"><![CDATA[two]]><!-- c --></item></root>",
+				printer.CStr() );
+			XMLTest( "Freeze: reads don't write", frozen == 1, memcmp( snapshot, buffer, length + 1 ) == 0 );
+		}
+		delete [] buffer;
+		delete [] snapshot;
+	}
+
+	// ---------- Parse filter ------
+	{
+		XMLDocument eager;
+		eager.LoadFile( "resources/dream.xml" );
+
+		XMLPathFilter filter;
+		filter.AddPath( "PLAY/ACT/TITLE" );
+		XMLDocument doc;
+		XMLTest( "No parse filter by default", true, doc.ParseFilter() == 0 );
+		doc.SetParseFilter( &filter );
+		doc.LoadFile( "resources/dream.xml" );
+		XMLTest( "Path filter", false, doc.Error() );
+		XMLTest( "Path filter keeps the declaration", true, doc.FirstChild()->ToDeclaration() != 0 );
+		const XMLElement* play = doc.RootElement();
+		XMLTest( "Path filter keeps ancestors", "ACT", play->FirstChildElement()->Name() );
+		XMLTest( "Path filter skips other children", true, play->FirstChildElement( "TITLE" ) == 0 );
+		int acts = 0;
+		const XMLElement* eagerAct = eager.RootElement()->FirstChildElement( "ACT" );
+		for( const XMLElement* act = play->FirstChildElement(); act; act = act->NextSiblingElement() ) {
+			++acts;
+			XMLTest( "Path filter keeps only the path", true, act->FirstChild() == act->LastChild() );
+			XMLTest( "Path filter keeps the subtree", eagerAct->FirstChildElement( "TITLE" )->GetText(), act->FirstChildElement( "TITLE" )->GetText() );
+			XMLTest( "Path filter line numbers", eagerAct->GetLineNum(), act->GetLineNum() );
+			eagerAct = eagerAct->NextSiblingElement( "ACT" );
+		}
+		XMLTest( "Path filter finds every match", 5, acts );
+
+		// Stop once every path has been seen.
+		XMLPathFilter header;
+		header.AddPath( "Envelope/Header" );
+		header.SetStopWhenFound( true );
+		header.SetKeepComments( false );
+		doc.SetParseFilter( &header );
+		for ( int i = 0; i < 2; ++i ) {
+			doc.Parse( "<?xml version='1.0'?><!-- c --><Envelope><Header><id>7</id><!-- c --></Header><Body><a/></Body><Header/>" );
+			XMLTest( "Path filter stops", false, doc.Error() );
+			XMLPrinter stopped( 0, true );
+			doc.Print( &stopped );
+			XMLTest( "Path filter stops", "<Envelope><Header><id>7</id></Header></Envelope>", stopped.CStr() );
+		}
+
+		// What is skipped is only balanced, not checked...
+		doc.Parse( "<Envelope><Body><a x=1></b></Body><Header/></Envelope>" );
+		XMLTest( "Skipped content isn't checked", false, doc.Error() );
+		// ...but its end tag is.
+		doc.Parse( "<Envelope>\n<Body></Bod></Envelope>" );
+		XMLTest( "Skipped element end tag", XML_ERROR_MISMATCHED_ELEMENT, doc.ErrorID() );
+		XMLTest( "Skipped element end tag", 2, doc.ErrorLineNum() );
+		doc.Parse( "<Envelope><Body><a>" );
+		XMLTest( "Skipped element not closed", XML_ERROR_MISMATCHED_ELEMENT, doc.ErrorID() );
+		XMLPathFilter other;
+		other.AddPath( "other" );
+		doc.SetParseFilter( &other );
+		doc.Parse( "<r>\n<a>" );
+		XMLTest( "Skipped root not closed", XML_ERROR_MISMATCHED_ELEMENT, doc.ErrorID() );
+		XMLTest( "Skipped root not closed", 1, doc.ErrorLineNum() );
+		XMLTest( "Skipped root not closed", true, doc.NoChildren() );
+
+		// A predicate can stop the parse.
+		FirstActFilter firstAct;
+		doc.SetParseFilter( &firstAct );
+		doc.LoadFile( "resources/dream.xml" );
+		XMLTest( "Filter stops", false, doc.Error() );
+		XMLTest( "Filter stops", "ACT", doc.RootElement()->LastChildElement()->Name() );
+		XMLTest( "Filter stops", "ACT I", doc.RootElement()->LastChildElement()->FirstChildElement( "TITLE" )->GetText() );
+		XMLTest( "Filter stops", "PERSONAE", doc.RootElement()->FirstChildElement( "PERSONAE" )->Name() );
+	}
+
+	// ---------- Recycling memory ------
+	{
+		XMLDocument doc;
+		XMLTest( "No recycling by default", true, doc.RecycleMemory() == 0 );
+		doc.SetRecycleMemory( 64 * 1024 );
+		doc.Parse( "<message id='1'><body>first</body></message>" );
+		const char* buffer = doc.RootElement()->Name();
+		doc.Parse( "<message id='2'><body>two</body></message>" );
+		XMLTest( "Recycled buffer", true, doc.RootElement()->Name() == buffer );
+		XMLTest( "Recycled buffer", "two", doc.RootElement()->FirstChildElement( "body" )->GetText() );
+		doc.Parse( "<message id='3'><body>3</bdy></message>" );
+		XMLTest( "Recycling after an error", XML_ERROR_MISMATCHED_ELEMENT, doc.ErrorID() );
+		doc.Parse( "<m/>" );
+		XMLTest( "Recycled buffer after an error", true, doc.RootElement()->Name() == buffer );
+		doc.Parse( "<message><body>fourth</body><body>fifth</body></message>" );
+		XMLTest( "Recycling after an error", "fifth", doc.RootElement()->LastChildElement()->GetText() );
+		doc.LoadFile( "resources/dream.xml" );
+		XMLTest( "Recycling a big document", false, doc.Error() );
+		doc.Parse( "<m/>" );
+		XMLTest( "Recycling a big document", "m", doc.RootElement()->Name() );
+
+		XMLDocumentPool pool( 64 * 1024, 2 );
+		XMLDocument* first = pool.Acquire();
+		XMLDocument* second = pool.Acquire();
+		XMLDocument* third = pool.Acquire();
+		XMLTest( "Document pool recycles memory", true, first->RecycleMemory() == 64 * 1024 );
+		first->Parse( "<a/>" );
+		pool.Release( first );
+		pool.Release( second );
+		pool.Release( third );
+		XMLTest( "Document pool keeps at most maxIdle", 2, pool.Idle() );
+		XMLDocument* again = pool.Acquire();
+		XMLTest( "Document pool reuses documents", true, again == first || again == second );
+		XMLTest( "Document pool clears documents", true, again->NoChildren() );
+
+		// Settings, and pointers to what may not outlive the use, go.
+		CountingAllocator counting;
+		XMLPathFilter filter;
+		filter.AddPath( "a/b" );
+		again->SetAllocator( &counting );
+		again->SetParseFilter( &filter );
+		again->SetInternNames( true );
+		again->SetStringArena( true );
+		again->SetLazyParse( true );
+		again->SetRecycleMemory( 0 );
+		again->Parse( "<a><b/><c/></a>" );
+		pool.Release( again );
+		XMLTest( "Document pool resets the allocator", counting.allocs, counting.frees );
+		XMLDocument* reset = pool.Acquire();
+		XMLTest( "Document pool resets settings", true, reset->Allocator() == 0 && reset->ParseFilter() == 0 );
+		XMLTest( "Document pool resets settings", false, reset->InternNames() || reset->StringArena() || reset->LazyParse() );
+		XMLTest( "Document pool resets settings", true, reset->RecycleMemory() == 64 * 1024 );
+		reset->Parse( "<a><b/><c/></a>" );
+		XMLTest( "Document pool resets settings", "c", reset->RootElement()->LastChildElement()->Name() );
+		pool.Release( reset );
+		XMLTest( "Document pool per thread", true, &XMLDocumentPool::ForThread() == &XMLDocumentPool::ForThread() );
+	}
+
+	// ---------- Byte offsets and the line index ------
+	{
+		const char* xml =
+			"<root a='x &amp; y'>\r\n"
+			"  <item>one\r\ntwo &lt;</item><!--c-->\n"
+			"\t<empty/></root>";
+		XMLDocument doc;
+		XMLTest( "No line index by default", false, doc.LineIndex() );
+		doc.SetLineIndex( true );
+		doc.Parse( xml );
+		XMLTest( "Byte offsets", false, doc.Error() );
+		const XMLElement* root = doc.RootElement();
+		const XMLElement* item = root->FirstChildElement( "item" );
+		const XMLElement* empty = root->FirstChildElement( "empty" );
+		const int64_t itemAt = static_cast<int64_t>( strstr( xml, "item" ) - xml );
+		XMLTest( "Element byte offset", int64_t(1), root->GetByteOffset() );
+		XMLTest( "Element byte offset", itemAt, item->GetByteOffset() );
+		XMLTest( "Text byte offset", itemAt + 5, item->FirstChild()->GetByteOffset() );
+		XMLTest( "Text byte offset", item->FirstChild()->GetByteOffset(), doc.ByteOffset( item->GetText() ) );
+		XMLTest( "Comment byte offset", static_cast<int64_t>( strstr( xml, "c-->" ) - xml ), item->NextSibling()->GetByteOffset() );
+		XMLTest( "Attribute byte offsets", int64_t(6), doc.ByteOffset( root->FirstAttribute()->Name() ) );
+		XMLTest( "Attribute byte offsets", int64_t(9), doc.ByteOffset( root->FirstAttribute()->Value() ) );
+		XMLTest( "Document byte offset", int64_t(-1), doc.GetByteOffset() );
+		XMLTest( "Byte offset of other strings", int64_t(-1), doc.ByteOffset( xml ) );
+
+		int line = 0;
+		int column = 0;
+		XMLTest( "Line and column", true, doc.LineColumn( empty->GetByteOffset(), &line, &column ) );
+		XMLTest( "Line and column", empty->GetLineNum(), line );
+		XMLTest( "Line and column", 3, column );
+		doc.LineColumn( item->GetByteOffset(), &line, &column );
+		XMLTest( "Line and column after CR LF", 2, line );
+		XMLTest( "Line and column after CR LF", 4, column );
+		XMLTest( "Line and column out of range", false, doc.LineColumn( -1, &line, &column ) );
+		XMLTest( "Line and column out of range", false, doc.LineColumn( static_cast<int64_t>( strlen( xml ) ) + 1, &line, &column ) );
+
+		XMLNode* text = doc.RootElement()->FirstChildElement( "item" )->FirstChild();
+		text->SetValue( "three" );
+		XMLTest( "Byte offset after SetValue", int64_t(-1), text->GetByteOffset() );
+
+		doc.SetLineIndex( false );
+		doc.Parse( xml );
+		XMLTest( "Line and column without an index", false, doc.LineColumn( 0, &line, &column ) );
+
+		// The index agrees with the line numbers found by the parse.
+		doc.SetLineIndex( true );
+		doc.LoadFile( "resources/dream.xml" );
+		bool agree = true;
+		for( const XMLElement* act = doc.RootElement()->FirstChildElement( "ACT" ); act; act = act->NextSiblingElement( "ACT" ) ) {
+			for( const XMLElement* e = act->FirstChildElement(); e; e = e->NextSiblingElement() ) {
+				agree = doc.LineColumn( e->GetByteOffset(), &line, 0 ) && line == e->GetLineNum() && agree;
+			}
+		}
+		XMLTest( "Line index agrees with line numbers", true, agree );
+	}
+
+	// ---------- XMLReader ------
+	{
+		// Printing the tokens should give the same XML as printing the DOM.
+		const char* files[] = { "resources/dream.xml", "resources/utf8test.xml", "resources/empty.xml", 0 };
+		for ( int i = 0; files[i]; ++i ) {
+			XMLDocument doc;
+			doc.LoadFile( files[i] );
+			XMLPrinter domPrinter;
+			doc.Print( &domPrinter );
+
+			XMLReader reader;
+			XMLPrinter readerPrinter;
+			FILE* readerFP = fopen( files[i], "rb" );
+			char* buf = new char[1000000];
+			const size_t n = fread( buf, 1, 999999, readerFP );
+			fclose( readerFP );
+			reader.ParseInPlace( buf, n );
+			readerPrinter.PushHeader( reader.HasBOM(), false );
+			while ( reader.Next() != XMLReader::END_DOCUMENT && !reader.Error() ) {
+				PrintToken( reader, &readerPrinter );
+			}
+			XMLTest( "XMLReader error matches DOM", doc.ErrorID(), reader.ErrorID() );
+			XMLTest( "XMLReader output matches DOM", domPrinter.CStr(), readerPrinter.CStr(), false );
+			delete [] buf;
+		}
+	}
+	{
+		const char* xml =
+			"<?xml version='1.0'?>\n"
+			"<root a='1' b=\"&lt;2&gt;\">\n"
+			"  <empty x='y'/>\n"
+			"  <text>A &amp; B</text><![CDATA[<raw>]]>\n"
+			"  <!-- comment -->\n"
+			"</root>";
+		XMLReader reader;
+		XMLTest( "XMLReader Parse", XML_SUCCESS, reader.Parse( xml ) );
+		XMLTest( "XMLReader declaration", XMLReader::DECLARATION, reader.Next() );
+		XMLTest( "XMLReader declaration value", "xml version='1.0'", reader.Value() );
+		XMLTest( "XMLReader start", XMLReader::START_ELEMENT, reader.Next() );
+		XMLTest( "XMLReader start name", "root", reader.Name() );
+		XMLTest( "XMLReader start line", 2, reader.LineNum() );
+		XMLTest( "XMLReader depth", 1, reader.Depth() );
+		XMLTest( "XMLReader attribute count", 2, reader.AttributeCount() );
+		XMLTest( "XMLReader attribute lookup", "<2>", reader.Attribute( "b" ) );
+		XMLTest( "XMLReader attribute lookup missing", true, reader.Attribute( "c" ) == 0 );
+		XMLTest( "XMLReader attribute", XMLReader::ATTRIBUTE, reader.Next() );
+		XMLTest( "XMLReader attribute name", "a", reader.Name() );
+		XMLTest( "XMLReader attribute value", "1", reader.Value() );
+		XMLTest( "XMLReader attribute", XMLReader::ATTRIBUTE, reader.Next() );
+		// Already translated by the lookup above; must not be translated twice.
+		XMLTest( "XMLReader attribute value", "<2>", reader.Value() );
+		XMLTest( "XMLReader empty start", XMLReader::START_ELEMENT, reader.Next() );
+		XMLTest( "XMLReader empty depth", 2, reader.Depth() );
+		XMLTest( "XMLReader empty attribute", "y", reader.Attribute( "x" ) );
+		XMLTest( "XMLReader empty attribute", XMLReader::ATTRIBUTE, reader.Next() );
+		XMLTest( "XMLReader empty end", XMLReader::END_ELEMENT, reader.Next() );
+		XMLTest( "XMLReader empty end name", "empty", reader.Name() );
+		XMLTest( "XMLReader empty end depth", 2, reader.Depth() );
+		XMLTest( "XMLReader text start", XMLReader::START_ELEMENT, reader.Next() );
+		XMLTest( "XMLReader text", XMLReader::TEXT, reader.Next() );
+		XMLTest( "XMLReader text value", "A & B", reader.Value() );
+		XMLTest( "XMLReader text line", 4, reader.LineNum() );
+		XMLTest( "XMLReader text end", XMLReader::END_ELEMENT, reader.Next() );
+		XMLTest( "XMLReader text end name", "text", reader.Name() );
+		XMLTest( "XMLReader cdata", XMLReader::TEXT, reader.Next() );
+		XMLTest( "XMLReader cdata flag", true, reader.CData() );
+		XMLTest( "XMLReader cdata value", "<raw>", reader.Value() );
+		XMLTest( "XMLReader comment", XMLReader::COMMENT, reader.Next() );
+		XMLTest( "XMLReader comment value", " comment ", reader.Value() );
+		XMLTest( "XMLReader comment line", 5, reader.LineNum() );
+		XMLTest( "XMLReader end", XMLReader::END_ELEMENT, reader.Next() );
+		XMLTest( "XMLReader end name", "root", reader.Name() );
+		XMLTest( "XMLReader end of document", XMLReader::END_DOCUMENT, reader.Next() );
+		XMLTest( "XMLReader stays at end", XMLReader::END_DOCUMENT, reader.Next() );
+		XMLTest( "XMLReader no error", false, reader.Error() );
+	}
+	{
+		struct ReaderErrorTest {
+			const char* xml;
+			XMLError error;
+			int lineNum;
+		};
+		const ReaderErrorTest tests[] = {
+			{ "<a>\n<b>\n</a>", XML_ERROR_MISMATCHED_ELEMENT, 3 },
+			{ "<a>\n<b/>", XML_ERROR_PARSING, 2 },
+			{ "<a x='1' x='2'/>", XML_ERROR_PARSING_ATTRIBUTE, 1 },
+			{ "<a x=1/>", XML_ERROR_PARSING_ATTRIBUTE, 1 },
+			{ "<a/><?xml?>", XML_ERROR_PARSING_DECLARATION, 1 },
+			{ "<a>\n<!-- c", XML_ERROR_PARSING_COMMENT, 2 },
+			{ "<a>text", XML_ERROR_PARSING_TEXT, 1 },
+			{ "</a>", XML_ERROR_MISMATCHED_ELEMENT, 1 },
+			{ "   ", XML_ERROR_EMPTY_DOCUMENT, 0 },
+		};
+		for ( size_t i = 0; i < sizeof( tests ) / sizeof( tests[0] ); ++i ) {
+			XMLReader reader;
+			reader.Parse( tests[i].xml );
+			while ( reader.Next() != XMLReader::END_DOCUMENT && reader.Token() != XMLReader::PARSE_ERROR ) {
+			}
+			XMLTest( "XMLReader error", tests[i].error, reader.ErrorID() );
+			XMLTest( "XMLReader error line", tests[i].lineNum, reader.ErrorLineNum() );
+		}
+	}
+
+	// ---------- XMLReader push mode ------
+	{
+		// Feeding the input in pieces of any size gives the same tokens.
+		XMLDocument doc;
+		doc.LoadFile( "resources/dream.xml" );
+		XMLPrinter domPrinter;
+		doc.Print( &domPrinter );
+
+		FILE* pushFP = fopen( "resources/dream.xml", "rb" );
+		char* buf = new char[1000000];
+		const size_t n = fread( buf, 1, 1000000, pushFP );
+		fclose( pushFP );
+
+		const size_t chunkSizes[] = { 1, 7, 100, 4096 };
+		for ( size_t c = 0; c < sizeof( chunkSizes ) / sizeof( chunkSizes[0] ); ++c ) {
+			XMLReader reader;
+			XMLPrinter printer;
+			for ( size_t i = 0; i < n; i += chunkSizes[c] ) {
+				reader.Feed( buf + i, n - i < chunkSizes[c] ? n - i : chunkSizes[c] );
+				while ( reader.Next() != XMLReader::NEED_MORE_INPUT && !reader.Error() ) {
+					PrintToken( reader, &printer );
+				}
+			}
+			reader.Finish();
+			while ( reader.Next() != XMLReader::END_DOCUMENT && !reader.Error() ) {
+				PrintToken( reader, &printer );
+			}
+			XMLTest( "XMLReader push no error", false, reader.Error() );
+			XMLTest( "XMLReader push output matches DOM", domPrinter.CStr(), printer.CStr(), false );
+		}
+		delete [] buf;
+	}
+	{
+		// Tokens split across pieces: a tag, an entity, and CDATA.
+		XMLReader reader;
+		reader.Feed( "<root a='x&a", 12 );
+		XMLTest( "XMLReader push partial tag", XMLReader::NEED_MORE_INPUT, reader.Next() );
+		reader.Feed( "mp;y'>A &l", 10 );
+		XMLTest( "XMLReader push start", XMLReader::START_ELEMENT, reader.Next() );
+		XMLTest( "XMLReader push attribute", "x&y", reader.Attribute( "a" ) );
+		XMLTest( "XMLReader push attribute token", XMLReader::ATTRIBUTE, reader.Next() );
+		XMLTest( "XMLReader push partial text", XMLReader::NEED_MORE_INPUT, reader.Next() );
+		reader.Feed( "t; B<![CDATA[<", 14 );
+		XMLTest( "XMLReader push text", XMLReader::TEXT, reader.Next() );
+		XMLTest( "XMLReader push text value", "A < B", reader.Value() );
+		XMLTest( "XMLReader push partial cdata", XMLReader::NEED_MORE_INPUT, reader.Next() );
+		reader.Feed( "]]", 2 );
+		XMLTest( "XMLReader push partial cdata end", XMLReader::NEED_MORE_INPUT, reader.Next() );
+		reader.Feed( "></ro", 5 );
+		XMLTest( "XMLReader push cdata", XMLReader::TEXT, reader.Next() );
+		XMLTest( "XMLReader push cdata value", "<", reader.Value() );
+		XMLTest( "XMLReader push partial end tag", XMLReader::NEED_MORE_INPUT, reader.Next() );
+		reader.Feed( "ot>", 3 );
+		XMLTest( "XMLReader push end", XMLReader::END_ELEMENT, reader.Next() );
+		XMLTest( "XMLReader push end name", "root", reader.Name() );
+		XMLTest( "XMLReader push waits for more", XMLReader::NEED_MORE_INPUT, reader.Next() );
+		reader.Finish();
+		XMLTest( "XMLReader push end of document", XMLReader::END_DOCUMENT, reader.Next() );
+
+		// Input that stops short is an error, once finished. Feeding
+		// after Finish() starts a new document.
+		reader.Feed( "<a>\n<b", 6 );
+		XMLTest( "XMLReader push start again", XMLReader::START_ELEMENT, reader.Next() );
+		XMLTest( "XMLReader push truncated", XMLReader::NEED_MORE_INPUT, reader.Next() );
+		reader.Finish();
+		XMLTest( "XMLReader push truncated error", XMLReader::PARSE_ERROR, reader.Next() );
+		XMLTest( "XMLReader push truncated error id", XML_ERROR_PARSING_ELEMENT, reader.ErrorID() );
+		XMLTest( "XMLReader push truncated error line", 2, reader.ErrorLineNum() );
+	}
+	{
+		// Token offsets count every byte of the input, however it is fed.
+		const char* xml = "\xEF\xBB\xBF<a x='1'>hi<b/><!--c--></a>";
+		const char* expected = "0:3-12 1:3-12 3:12-14 0:14-18 2:18-18 4:18-26 2:26-30 ";
+		for( int push = 0; push < 2; ++push ) {
+			XMLReader reader;
+			char offsets[256] = { 0 };
+			size_t length = 0;
+			if ( push ) {
+				for( size_t i = 0; xml[i]; ++i ) {
+					reader.Feed( xml + i, 1 );
+				}
+				reader.Finish();
+			}
+			else {
+				reader.Parse( xml );
+			}
+			while( reader.Next() != XMLReader::END_DOCUMENT && !reader.Error() && reader.Token() != XMLReader::NEED_MORE_INPUT ) {
+				length += sprintf( offsets + length, "%d:%d-%d ", static_cast<int>( reader.Token() ),
+								   static_cast<int>( reader.TokenOffset() ), static_cast<int>( reader.TokenEnd() ) );
+			}
+			XMLTest( "XMLReader token offsets", expected, offsets );
+		}
+	}
+
+	// ---------- Allocators ------
+	{
+		CountingAllocator counting;
+		{
+			XMLDocument doc;
+			doc.SetAllocator( &counting );
+			doc.LoadFile( "resources/dream.xml" );
+			XMLTest( "Allocator parse", false, doc.Error() );
+			XMLTest( "Allocator parse", "SPEECH", doc.RootElement()->FirstChildElement( "ACT" )->FirstChildElement( "SCENE" )->FirstChildElement( "SPEECH" )->Name() );
+			XMLTest( "Allocator used", true, counting.allocs > 0 && counting.bytes > 0 );
+			doc.RootElement()->SetAttribute( "set", "a string of its own" );
+			doc.NewElement( "unlinked" );
+			doc.Parse( "<a b='c'>text</a>" );
+			XMLTest( "Allocator reparse", "c", doc.RootElement()->Attribute( "b" ) );
+			doc.SetAllocator( 0 );
+			XMLTest( "Allocator gets everything back", 0, static_cast<int>( counting.bytes ) );
+			XMLTest( "Allocator gets everything back", counting.allocs, counting.frees );
+			doc.Parse( "<a/>" );
+			XMLTest( "Allocator removed", false, doc.Error() );
+		}
+		XMLTest( "Allocator removed", counting.allocs, counting.frees );
+
+		{
+			XMLDocument doc;
+			doc.SetAllocator( &counting );
+			doc.SetRecycleMemory( 64 * 1024 );
+			doc.Parse( "<a><b/></a>" );
+			doc.RootElement()->SetText( "a string of its own" );
+			doc.Parse( "<a><c/></a>" );
+			XMLTest( "Allocator and recycling", "c", doc.RootElement()->FirstChildElement()->Name() );
+		}
+		XMLTest( "Allocator and recycling free everything", counting.allocs, counting.frees );
+
+		// An arena over the heap, which can be reset and reused.
+		XMLArenaAllocator arena( 4096 );
+		{
+			XMLDocument doc;
+			doc.SetAllocator( &arena );
+			doc.LoadFile( "resources/dream.xml" );
+			XMLTest( "Arena parse", false, doc.Error() );
+			XMLTest( "Arena parse", true, arena.Used() > 0 );
+			XMLDocument copy;
+			copy.SetAllocator( &arena );
+			doc.DeepCopy( &copy );
+			XMLPrinter printDoc, printCopy;
+			doc.Print( &printDoc );
+			copy.Print( &printCopy );
+			XMLTest( "Arena deep copy", printDoc.CStr(), printCopy.CStr() );
+		}
+		arena.Reset();
+		XMLTest( "Arena reset", true, arena.Used() == 0 );
+
+		// A fixed buffer: the heap isn't touched, and running out is an error.
+		static char memory[16 * 1024];
+		XMLArenaAllocator fixed( memory, sizeof( memory ) );
+		{
+			XMLDocument doc;
+			doc.SetAllocator( &fixed );
+			doc.Parse( "<order id='17' side='buy'><qty>100</qty></order>" );
+			XMLTest( "Fixed buffer parse", false, doc.Error() );
+			XMLTest( "Fixed buffer parse", "buy", doc.RootElement()->Attribute( "side" ) );
+			const char* start = memory;
+			const char* name = doc.RootElement()->Name();
+			XMLTest( "Fixed buffer holds the document", true, name >= start && name < start + sizeof( memory ) );
+
+			doc.LoadFile( "resources/dream.xml" );
+			XMLTest( "Fixed buffer out of memory", XML_ERROR_OUT_OF_MEMORY, doc.ErrorID() );
+		}
+		fixed.Reset();
+		{
+			XMLDocument doc;
+			doc.SetAllocator( &fixed );
+			doc.Parse( "<order id='18'/>" );
+			XMLTest( "Fixed buffer after reset", false, doc.Error() );
+
+			// Nodes until the buffer is full.
+			XMLElement* element = 0;
+			int made = 0;
+			while( ( element = doc.NewElement( "filler" ) ) != 0 && made < 10000 ) {
+				doc.RootElement()->InsertEndChild( element );
+				++made;
+			}
+			XMLTest( "Fixed buffer runs out of nodes", true, element == 0 && made > 0 );
+			XMLTest( "Fixed buffer runs out of nodes", XML_ERROR_OUT_OF_MEMORY, doc.ErrorID() );
+			XMLTest( "Fixed buffer runs out of nodes", true, doc.RootElement()->InsertNewChildElement( "more" ) == 0 );
+		}
+		fixed.Reset();
+		{
+			// Room for the nodes, but not for a string: nothing is left half made.
+			XMLDocument doc;
+			doc.SetAllocator( &fixed );
+			doc.Parse( "<r a='1'><b/></r>" );
+			XMLTest( "Fixed buffer, long strings", false, doc.Error() );
+			static char longString[sizeof( memory ) + 1];
+			memset( longString, 'n', sizeof( longString ) - 1 );
+			XMLElement* root = doc.RootElement();
+
+			XMLTest( "Fixed buffer, long element name", true, doc.NewElement( longString ) == 0 );
+			XMLTest( "Fixed buffer, long element name", XML_ERROR_OUT_OF_MEMORY, doc.ErrorID() );
+			doc.ClearError();
+			XMLTest( "Fixed buffer, long text", true, doc.NewText( longString ) == 0 );
+			XMLTest( "Fixed buffer, long text", XML_ERROR_OUT_OF_MEMORY, doc.ErrorID() );
+			doc.ClearError();
+
+			root->SetAttribute( longString, "value" );
+			XMLTest( "Fixed buffer, long attribute name", XML_ERROR_OUT_OF_MEMORY, doc.ErrorID() );
+			XMLTest( "Fixed buffer, long attribute name", true, root->FirstAttribute()->Next() == 0 );
+			doc.ClearError();
+			root->SetAttribute( "name", longString );
+			XMLTest( "Fixed buffer, long attribute value", XML_ERROR_OUT_OF_MEMORY, doc.ErrorID() );
+			XMLTest( "Fixed buffer, long attribute value", true, root->Attribute( "name" ) == 0 );
+			doc.ClearError();
+			root->SetAttribute( "a", longString );
+			XMLTest( "Fixed buffer, long attribute value keeps the old one", "1", root->Attribute( "a" ) );
+			doc.ClearError();
+
+			root->FirstChildElement()->SetValue( longString );
+			XMLTest( "Fixed buffer, long SetValue", XML_ERROR_OUT_OF_MEMORY, doc.ErrorID() );
+			XMLTest( "Fixed buffer, long SetValue keeps the old one", "b", root->FirstChildElement()->Value() );
+			doc.ClearError();
+
+			XMLPrinter printer;
+			doc.Print( &printer );
+			XMLTest( "Fixed buffer, long strings", true, strstr( printer.CStr(), "=\"\"" ) == 0 );
+			XMLTest( "Fixed buffer, short strings still fit", true, doc.NewElement( "short" ) != 0 );
+		}
+	}
+
+	// ---------- String arena ------
+	{
+		int allocs[2] = { 0, 0 };
+		for( int arena = 0; arena < 2; ++arena ) {
+			CountingAllocator counting;
+			XMLDocument doc;
+			doc.SetAllocator( &counting );
+			XMLTest( "String arena off by default", false, doc.StringArena() );
+			doc.SetStringArena( arena != 0 );
+			XMLElement* root = doc.NewElement( "report" );
+			doc.InsertEndChild( root );
+			for( int i = 0; i < 1000; ++i ) {
+				XMLElement* row = root->InsertNewChildElement( "row" );
+				row->SetAttribute( "id", i );
+				row->SetAttribute( "name", "a name" );
+				row->SetText( i * 2 );
+			}
+			allocs[arena] = counting.allocs;
+			XMLTest( "String arena values", 1998, root->LastChildElement()->IntText() );
+			XMLTest( "String arena values", 999, root->LastChildElement()->IntAttribute( "id" ) );
+			XMLTest( "String arena values", "a name", root->FirstChildElement()->Attribute( "name" ) );
+			root->FirstChildElement()->SetName( "first" );
+			XMLTest( "String arena rename", "first", root->FirstChildElement()->Name() );
+
+			XMLDocument copy;
+			copy.SetAllocator( &counting );
+			copy.SetStringArena( arena != 0 );
+			doc.DeepCopy( &copy );
+			XMLTest( "String arena deep copy", 1998, copy.RootElement()->LastChildElement()->IntText() );
+			copy.SetAllocator( 0 );
+
+			doc.Clear();
+			doc.Parse( "<a b='c'/>" );
+			doc.RootElement()->SetAttribute( "b", "d" );
+			XMLTest( "String arena after Clear()", "d", doc.RootElement()->Attribute( "b" ) );
+			doc.SetAllocator( 0 );
+			XMLTest( "String arena frees everything", 0, static_cast<int>( counting.bytes ) );
+		}
+		XMLTest( "String arena allocates less", true, allocs[1] * 10 < allocs[0] );
+	}
+
+	// ---------- Interned names ------
+	{
+		XMLDocument doc;
+		XMLTest( "Names not interned by default", false, doc.InternNames() );
+		doc.SetInternNames( true );
+		doc.LoadFile( "resources/dream.xml" );
+		XMLTest( "Interned names parse", false, doc.Error() );
+		XMLElement* act = doc.RootElement()->FirstChildElement( "ACT" );
+		XMLElement* nextAct = act->NextSiblingElement( "ACT" );
+		XMLTest( "Interned names share storage", true, act->Name() == nextAct->Name() );
+		XMLTest( "Interned names lookup", "ACT", nextAct->Name() );
+		XMLTest( "Interned names lookup", 5, doc.RootElement()->ChildElementCount( "ACT" ) );
+		XMLTest( "Interned names lookup", true, doc.RootElement()->LastChildElement( "ACT" )->PreviousSiblingElement( "FM" ) == doc.RootElement()->FirstChildElement( "FM" ) );
+		XMLTest( "Interned names unknown name", true, doc.RootElement()->FirstChildElement( "NOSUCH" ) == 0 );
+
+		XMLElement* element = doc.NewElement( "ACT" );
+		XMLTest( "Interned names NewElement()", true, element->Name() == act->Name() );
+		element->SetAttribute( "scene", 1 );
+		element->SetAttribute( "scene", 2 );
+		XMLTest( "Interned attribute", 2, element->IntAttribute( "scene" ) );
+		XMLTest( "Interned attribute", true, element->FindAttribute( "other" ) == 0 );
+		doc.RootElement()->InsertEndChild( element );
+		XMLTest( "Interned names new element found", 6, doc.RootElement()->ChildElementCount( "ACT" ) );
+		element->SetName( "EPILOGUE", true );
+		XMLTest( "Interned names rename", true, doc.RootElement()->LastChildElement( "EPILOGUE" ) == element );
+
+		XMLDocument clone;
+		clone.SetInternNames( true );
+		doc.DeepCopy( &clone );
+		XMLTest( "Interned names clone", 5, clone.RootElement()->ChildElementCount( "ACT" ) );
+		XMLTest( "Interned names clone has its own names", true, clone.RootElement()->FirstChildElement( "ACT" )->Name() != act->Name() );
+
+		doc.Parse( "<a x='1' y='2'><b/><c/><b z='3'/></a>" );
+		XMLTest( "Interned names reparse", 2, doc.RootElement()->ChildElementCount( "b" ) );
+		XMLTest( "Interned attributes reparse", 3, doc.RootElement()->LastChildElement( "b" )->IntAttribute( "z" ) );
+		XMLTest( "Interned attributes reparse", 2, doc.RootElement()->IntAttribute( "y" ) );
+		doc.Parse( "<a x='1' x='2'/>" );
+		XMLTest( "Interned duplicate attributes", XML_ERROR_PARSING_ATTRIBUTE, doc.ErrorID() );
+		doc.Parse( "<a><b></a></b>" );
+		XMLTest( "Interned mismatched element", XML_ERROR_MISMATCHED_ELEMENT, doc.ErrorID() );
+
+		// The same lookups, lazily.
+		doc.SetLazyParse( true );
+		doc.LoadFile( "resources/dream.xml" );
+		XMLTest( "Interned names lazily", 5, doc.RootElement()->ChildElementCount( "ACT" ) );
+		XMLTest( "Interned names lazily", "SCENE", doc.RootElement()->FirstChildElement( "ACT" )->FirstChildElement( "SCENE" )->Name() );
+
+		// A long name is compared only as far as the shorter names go.
+		XMLDocument many;
+		many.SetInternNames( true );
+		XMLElement* root = many.NewElement( "root" );
+		many.InsertEndChild( root );
+		char name[301];
+		for( int i = 0; i < 2000; ++i ) {
+			sprintf( name, "name%011d", i );
+			root->InsertNewChildElement( name );
+		}
+		memset( name, 'n', 300 );
+		name[300] = 0;
+		XMLTest( "Interned long name lookup", true, root->FirstChildElement( name ) == 0 );
+		XMLTest( "Interned long name lookup", "name00000001999", root->LastChildElement( "name00000001999" )->Name() );
+	}
+
+	// ---------- XMLCompactDocument ------
+	{
+		const char* files[] = { "resources/dream.xml", "resources/utf8test.xml", "resources/empty.xml" };
+		for( int i = 0; i < 3; ++i ) {
+			XMLDocument doc;
+			doc.LoadFile( files[i] );
+			XMLCompactDocument compact;
+			XMLTest( "Compact build", XML_SUCCESS, compact.Build( doc ), true );
+			for( int mode = 0; mode < 2; ++mode ) {
+				XMLPrinter printDoc( 0, mode != 0 ), printCompact( 0, mode != 0 );
+				doc.Print( &printDoc );
+				compact.Print( &printCompact );
+				XMLTest( "Compact prints as the document", printDoc.CStr(), printCompact.CStr(), false );
+			}
+		}
+
+		XMLDocument doc;
+		doc.Parse( "<?xml version='1.0'?>\n"
+				   "<catalog>\n"
+				   "  <!-- items -->\n"
+				   "  <item id='1' price='2.5'>first</item>\n"
+				   "  <note/>\n"
+				   "  <item id='2'><![CDATA[<second>]]></item>\n"
+				   "</catalog>" );
+		XMLCompactDocument compact;
+		compact.Build( doc );
+		doc.Clear();	// the copy stands alone
+		XMLTest( "Compact node count", 8, static_cast<int>( compact.NodeCount() ) );
+		const uint32_t NONE = XMLCompactDocument::NONE;
+		XMLTest( "Compact declaration", true, compact.Type( 0 ) == XMLCompactDocument::DECLARATION );
+		const uint32_t root = compact.RootElement();
+		XMLTest( "Compact root", "catalog", compact.Value( root ) );
+		XMLTest( "Compact root", true, compact.Parent( root ) == NONE );
+		XMLTest( "Compact line", 2, compact.GetLineNum( root ) );
+		XMLTest( "Compact comment", true, compact.Type( compact.FirstChild( root ) ) == XMLCompactDocument::COMMENT );
+		const uint32_t item = compact.FirstChildElement( root, "item" );
+		XMLTest( "Compact first item", "1", compact.Attribute( item, "id" ) );
+		XMLTest( "Compact first item", "first", compact.GetText( item ) );
+		XMLTest( "Compact attributes", 2, static_cast<int>( compact.AttributeCount( item ) ) );
+		XMLTest( "Compact attributes", "price", compact.AttributeName( item, 1 ) );
+		XMLTest( "Compact attributes", "2.5", compact.AttributeValue( item, 1 ) );
+		XMLTest( "Compact missing attribute", true, compact.Attribute( item, "size" ) == 0 );
+		XMLTest( "Compact missing name", true, compact.Attribute( item, "nosuchname" ) == 0 );
+		const uint32_t second = compact.NextSiblingElement( item, "item" );
+		XMLTest( "Compact second item", "2", compact.Attribute( second, "id" ) );
+		XMLTest( "Compact cdata", true, compact.CData( compact.FirstChild( second ) ) );
+		XMLTest( "Compact cdata", "<second>", compact.GetText( second ) );
+		XMLTest( "Compact no more items", true, compact.NextSiblingElement( second, "item" ) == NONE );
+		XMLTest( "Compact any element", "note", compact.Value( compact.NextSiblingElement( item ) ) );
+		XMLTest( "Compact no element", true, compact.FirstChildElement( root, "nosuchname" ) == NONE );
+		XMLTest( "Compact names are shared", true, compact.Value( item ) == compact.Value( second ) );
+		XMLTest( "Compact no children", true, compact.FirstChild( compact.NextSiblingElement( item ) ) == NONE );
+		XMLTest( "Compact parent", true, compact.Parent( second ) == root );
+		compact.Clear();
+		XMLTest( "Compact cleared", 0, static_cast<int>( compact.NodeCount() ) );
+		XMLTest( "Compact cleared", true, compact.RootElement() == NONE );
+	}
+
+	// ---------- Snapshots ------
+	{
+		const char* files[] = { "resources/dream.xml", "resources/utf8test.xml", "resources/empty.xml" };
+		for( int i = 0; i < 3; ++i ) {
+			XMLDocument doc;
+			doc.LoadFile( files[i] );
+			XMLCompactDocument built;
+			built.Build( doc );
+			XMLTest( "Snapshot save", XML_SUCCESS, built.SaveSnapshot( "resources/out/snapshot.bin" ), true );
+			XMLCompactDocument loaded;
+			XMLTest( "Snapshot load", XML_SUCCESS, loaded.LoadSnapshot( "resources/out/snapshot.bin" ), true );
+			XMLTest( "Snapshot node count", static_cast<int>( built.NodeCount() ), static_cast<int>( loaded.NodeCount() ) );
+			for( int mode = 0; mode < 2; ++mode ) {
+				XMLPrinter printDoc( 0, mode != 0 ), printLoaded( 0, mode != 0 );
+				doc.Print( &printDoc );
+				loaded.Print( &printLoaded );
+				XMLTest( "Snapshot prints as the document", printDoc.CStr(), printLoaded.CStr(), false );
+			}
+		}
+
+		XMLDocument doc;
+		doc.LoadFile( "resources/dream.xml" );
+		XMLCompactDocument compact;
+		compact.Build( doc );
+		compact.SaveSnapshot( "resources/out/snapshot.bin" );
+		XMLCompactDocument loaded;
+		loaded.LoadSnapshot( "resources/out/snapshot.bin" );
+		const uint32_t act = loaded.FirstChildElement( loaded.RootElement(), "ACT" );
+		XMLTest( "Snapshot query", "ACT I", loaded.GetText( loaded.FirstChildElement( act, "TITLE" ) ) );
+		XMLTest( "Snapshot query", true, loaded.FirstChildElement( act, "nosuchname" ) == XMLCompactDocument::NONE );
+
+		// A snapshot in memory is used in place.
+		FILE* file = fopen( "resources/out/snapshot.bin", "rb" );
+		fseek( file, 0, SEEK_END );
+		const size_t size = static_cast<size_t>( ftell( file ) );
+		fseek( file, 0, SEEK_SET );
+		char* data = static_cast<char*>( malloc( size + 4 ) );
+		XMLTest( "Snapshot read", true, fread( data, 1, size, file ) == size );
+		fclose( file );
+		XMLCompactDocument inPlace;
+		XMLTest( "Snapshot in memory", XML_SUCCESS, inPlace.LoadSnapshot( data, size ) );
+		XMLTest( "Snapshot in memory", loaded.NodeCount(), inPlace.NodeCount() );
+		XMLTest( "Snapshot in place", true, inPlace.Value( 0 ) > data && inPlace.Value( 0 ) < data + size );
+#if !defined( _MSC_VER ) && !defined( WIN32 )
+		{
+			// A snapshot from a FIFO is read, rather than mapped.
+			XMLCompactDocument fromFifo;
+			const pid_t writer = WriteFifo( "resources/out/snapshot.fifo", data, size );
+			XMLTest( "Snapshot from a FIFO", XML_SUCCESS, fromFifo.LoadSnapshot( "resources/out/snapshot.fifo" ) );
+			XMLTest( "Snapshot from a FIFO", true, FinishFifo( "resources/out/snapshot.fifo", writer ) );
+			XMLTest( "Snapshot from a FIFO", loaded.NodeCount(), fromFifo.NodeCount() );
+		}
+#endif
+
+		// Ones that are damaged don't load.
+		XMLTest( "Snapshot truncated", XML_ERROR_INVALID_SNAPSHOT, inPlace.LoadSnapshot( data, size - 1 ) );
+		XMLTest( "Snapshot truncated", true, inPlace.NodeCount() == 0 );
+		XMLTest( "Snapshot too short", XML_ERROR_INVALID_SNAPSHOT, inPlace.LoadSnapshot( data, 8 ) );
+		memmove( data + 1, data, size );
+		XMLTest( "Snapshot misaligned", XML_ERROR_INVALID_SNAPSHOT, inPlace.LoadSnapshot( data + 1, size ) );
+		memmove( data, data + 1, size );
+		data[0] = 'X';
+		XMLTest( "Snapshot magic", XML_ERROR_INVALID_SNAPSHOT, inPlace.LoadSnapshot( data, size ) );
+		data[0] = 'T';
+		XMLTest( "Snapshot repaired", XML_SUCCESS, inPlace.LoadSnapshot( data, size ) );
+		// The header is 40 bytes; the second node's next sibling, back to the first.
+		uint32_t original = 0, next = 0;
+		memcpy( &original, data + 40 + 24 + 8, sizeof( original ) );
+		memcpy( data + 40 + 24 + 8, &next, sizeof( next ) );
+		XMLTest( "Snapshot tree", XML_ERROR_INVALID_SNAPSHOT, inPlace.LoadSnapshot( data, size ) );
+		const uint32_t far = 0x7fffffff;
+		memcpy( data + 40 + 24 + 8, &far, sizeof( far ) );
+		XMLTest( "Snapshot index", XML_ERROR_INVALID_SNAPSHOT, inPlace.LoadSnapshot( data, size ) );
+		memcpy( data + 40 + 24 + 8, &original, sizeof( original ) );
+		XMLTest( "Snapshot repaired", XML_SUCCESS, inPlace.LoadSnapshot( data, size ) );
+		memcpy( data + 40, &far, sizeof( far ) );
+		XMLTest( "Snapshot string", XML_ERROR_INVALID_SNAPSHOT, inPlace.LoadSnapshot( data, size ) );
+		free( data );
+
+		XMLTest( "Snapshot missing file", XML_ERROR_FILE_NOT_FOUND, inPlace.LoadSnapshot( "resources/nosuchfile.bin" ) );
+
+		// An empty copy saves as an empty document.
+		XMLCompactDocument empty;
+		XMLTest( "Snapshot empty", XML_SUCCESS, empty.SaveSnapshot( "resources/out/snapshot.bin" ) );
+		XMLTest( "Snapshot empty", XML_SUCCESS, inPlace.LoadSnapshot( "resources/out/snapshot.bin" ) );
+		XMLTest( "Snapshot empty", 0, static_cast<int>( inPlace.NodeCount() ) );
+	}
+
+	// ---------- XMLIndex ------
+	{
+		const int RECORDS = 2000;
+		FILE* archive = fopen( "resources/out/archive.xml", "wb" );
+		fprintf( archive, "<?xml version='1.0'?>\n<archive>\n\t<header created='today'/>\n" );
+		for( int i = 0; i < RECORDS; ++i ) {
+			fprintf( archive, "\t<record id='%d'>\n\t\t<name>Item &amp; %d</name>\n\t\t<part id='p%d'><![CDATA[<raw>]]></part>\n\t</record>\n", i, i, i );
+		}
+		fprintf( archive, "\t<record id='a&amp;b'/>\n</archive>\n" );
+		fclose( archive );
+
+		XMLIndex index;
+		XMLTest( "Index build", XML_SUCCESS, index.Build( "resources/out/archive.xml" ), true );
+		// The root, the header, the first record by path, and each record and part by id.
+		XMLTest( "Index keys", static_cast<uint32_t>( 3 + 2 * RECORDS + 1 ), index.KeyCount() );
+
+		XMLDocument full;
+		full.LoadFile( "resources/out/archive.xml" );
+		const int picks[] = { 0, 1234, RECORDS - 1 };
+		for( int i = 0; i < 3; ++i ) {
+			char key[64];
+			sprintf( key, "/archive/record[@id='%d']", picks[i] );
+			XMLDocument record;
+			XMLTest( "Index load subtree", XML_SUCCESS, record.LoadSubtree( "resources/out/archive.xml", index, key ), true );
+			const XMLElement* expected = full.RootElement()->FirstChildElement( "record" );
+			while( expected->IntAttribute( "id" ) != picks[i] ) {
+				expected = expected->NextSiblingElement( "record" );
+			}
+			XMLPrinter printExpected, printRecord;
+			expected->Accept( &printExpected );
+			record.Print( &printRecord );
+			XMLTest( "Index subtree is the element", printExpected.CStr(), printRecord.CStr(), false );
+		}
+		XMLDocument part;
+		part.LoadSubtree( "resources/out/archive.xml", index, "/archive/record/part[@id='p7']" );
+		XMLTest( "Index nested key", "<raw>", part.RootElement()->GetText() );
+		part.LoadSubtree( "resources/out/archive.xml", index, "/archive/record[@id='a&b']" );
+		XMLTest( "Index entity in key", false, part.Error() );
+		XMLTest( "Index empty element", true, part.RootElement()->NoChildren() );
+		part.LoadSubtree( "resources/out/archive.xml", index, "/archive/record" );
+		XMLTest( "Index first by path", 0, part.RootElement()->IntAttribute( "id", -1 ) );
+		part.LoadSubtree( "resources/out/archive.xml", index, "/archive/header" );
+		XMLTest( "Index path", "today", part.RootElement()->Attribute( "created" ) );
+		XMLTest( "Index missing key", XML_ERROR_KEY_NOT_FOUND,
+				 part.LoadSubtree( "resources/out/archive.xml", index, "/archive/record[@id='nosuchid']" ) );
+		XMLTest( "Index too deep for a path", XML_ERROR_KEY_NOT_FOUND,
+				 part.LoadSubtree( "resources/out/archive.xml", index, "/archive/record/name" ) );
+
+		// Saved, and loaded again.
+		XMLTest( "Index save", XML_SUCCESS, index.Save( "resources/out/archive.xml.idx" ) );
+		XMLIndex loaded;
+		XMLTest( "Index load", XML_SUCCESS, loaded.Load( "resources/out/archive.xml.idx" ) );
+		XMLTest( "Index loaded keys", index.KeyCount(), loaded.KeyCount() );
+		XMLTest( "Index loaded size", index.SourceSize(), loaded.SourceSize() );
+		uint64_t start = 0, end = 0, loadedStart = 0, loadedEnd = 0;
+		index.Find( "/archive/record[@id='1999']", &start, &end );
+		XMLTest( "Index loaded find", true, loaded.Find( "/archive/record[@id='1999']", &loadedStart, &loadedEnd ) );
+		XMLTest( "Index loaded find", true, start == loadedStart && end == loadedEnd );
+		part.LoadSubtree( "resources/out/archive.xml", loaded, "/archive/record[@id='42']" );
+		XMLTest( "Index loaded subtree", "Item & 42", part.RootElement()->FirstChildElement( "name" )->GetText() );
+		XMLTest( "Index load missing", XML_ERROR_FILE_NOT_FOUND, loaded.Load( "resources/nosuchfile.idx" ) );
+		XMLTest( "Index load not an index", XML_ERROR_INVALID_SNAPSHOT, loaded.Load( "resources/dream.xml" ) );
+		XMLTest( "Index load not an index", static_cast<uint32_t>( 0 ), loaded.KeyCount() );
+#if !defined( _MSC_VER ) && !defined( WIN32 )
+		{
+			// An index from a FIFO is read, rather than mapped.
+			FILE* file = fopen( "resources/out/archive.xml.idx", "rb" );
+			char* bytes = new char[1024 * 1024];
+			const size_t size = fread( bytes, 1, 1024 * 1024, file );
+			fclose( file );
+			const pid_t writer = WriteFifo( "resources/out/index.fifo", bytes, size );
+			XMLTest( "Index load from a FIFO", XML_SUCCESS, loaded.Load( "resources/out/index.fifo" ) );
+			XMLTest( "Index load from a FIFO", true, FinishFifo( "resources/out/index.fifo", writer ) );
+			XMLTest( "Index load from a FIFO", index.KeyCount(), loaded.KeyCount() );
+			delete [] bytes;
+		}
+#endif
+
+		// Other options, and files that can't be indexed.
+		XMLIndex byName;
+		byName.Build( "resources/out/archive.xml", "created", 1 );
+		XMLTest( "Index key attribute", static_cast<uint32_t>( 2 ), byName.KeyCount() );
+		XMLTest( "Index key attribute", true, byName.Find( "/archive/header[@created='today']", &start, &end ) );
+		XMLTest( "Index build missing", XML_ERROR_FILE_NOT_FOUND, byName.Build( "resources/nosuchfile.xml" ) );
+		XMLTest( "Index build empty", XML_ERROR_EMPTY_DOCUMENT, byName.Build( "resources/empty.xml" ) );
+
+		// A changed file isn't read with the old offsets.
+		archive = fopen( "resources/out/archive.xml", "ab" );
+		fprintf( archive, "<!-- appended -->\n" );
+		fclose( archive );
+		XMLTest( "Index stale", XML_ERROR_INDEX_OUT_OF_DATE,
+				 part.LoadSubtree( "resources/out/archive.xml", index, "/archive/record[@id='42']" ) );
+	}
+
+	// ---------- Pool blocks ------
+	{
+		const int ROWS = 20000;
+		char* xml = new char[ROWS * 40 + 100];
+		char* q = xml;
+		q += sprintf( q, "<table>" );
+		for( int i = 0; i < ROWS; ++i ) {
+			q += sprintf( q, "<row n='%d'>text</row>", i );
+		}
+		sprintf( q, "</table>" );
+
+		CountingAllocator counting;
+		XMLDocument doc;
+		doc.SetAllocator( &counting );
+		doc.Parse( xml );
+		delete [] xml;
+		// The blocks grow, so a big document takes few of them.
+		XMLTest( "Pool blocks grow", true, counting.allocs < 100 );
+
+		// Deleting most of the rows leaves blocks that nothing is in.
+		XMLElement* table = doc.RootElement();
+		while( table->LastChildElement()->IntAttribute( "n" ) >= ROWS / 4 ) {
+			table->DeleteChild( table->LastChild() );
+		}
+		const size_t before = counting.bytes;
+		const size_t freed = doc.ShrinkToFit();
+		XMLTest( "Pool shrink frees", true, freed > before / 2 );
+		XMLTest( "Pool shrink frees", before - freed, counting.bytes );
+		XMLTest( "Pool shrink again", static_cast<size_t>( 0 ), doc.ShrinkToFit() );
+
+		// What is left is untouched, and the pools still work.
+		int rows = 0;
+		bool intact = true;
+		for( const XMLElement* row = table->FirstChildElement(); row; row = row->NextSiblingElement() ) {
+			intact = intact && row->IntAttribute( "n" ) == rows && XMLUtil::StringEqual( row->GetText(), "text" );
+			++rows;
+		}
+		XMLTest( "Pool shrink keeps rows", ROWS / 4, rows );
+		XMLTest( "Pool shrink keeps rows", true, intact );
+		for( int i = 0; i < ROWS; ++i ) {
+			table->InsertNewChildElement( "added" )->SetAttribute( "n", i );
+		}
+		XMLTest( "Pool grows again", ROWS, table->LastChildElement( "added" )->IntAttribute( "n" ) + 1 );
+
+		// Nothing in use: everything goes.
+		doc.DeleteChildren();
+		doc.ShrinkToFit();
+		doc.Parse( "<a/>" );
+		XMLTest( "Pool after shrinking everything", "a", doc.RootElement()->Name() );
+		doc.SetAllocator( 0 );
+		XMLTest( "Pool blocks all freed", static_cast<size_t>( 0 ), counting.bytes );
+	}
+
     // ----------- Performance tracking --------------
 	{
 #if defined( _MSC_VER )